@@ -0,0 +1,38 @@
+// Benchmarks for the trampoline allocator.
+// Allocation and deallocation cost should be flat regardless of how many trampolines are live.
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "bench-wrapper.hpp"
+#include "page-allocator.hpp"
+
+namespace {
+
+// A spread of sizes typical of trampolines (4-32 instructions)
+constexpr std::array<uint_fast16_t, 8> kSizes{ 16, 32, 48, 64, 80, 96, 112, 128 };
+auto const kProtection = flamingo::PageProtectionType::kExecute | flamingo::PageProtectionType::kRead;
+
+void bench_allocations(size_t count) {
+  std::vector<flamingo::PointerWrapper<uint32_t>> allocations;
+  allocations.reserve(count);
+  auto const allocate = [&](size_t i) {
+    allocations.push_back(flamingo::Allocate(16, kSizes[i % kSizes.size()], kProtection));
+  };
+  report("Allocate (fresh)", count, time_per_op_ns(count, allocate));
+  report("Deallocate", count, time_per_op_ns(count, [&](size_t i) { flamingo::Deallocate(allocations[i]); }));
+  allocations.clear();
+  report("Allocate (reuse)", count, time_per_op_ns(count, allocate));
+  for (auto const& allocation : allocations) {
+    flamingo::Deallocate(allocation);
+  }
+}
+
+}  // namespace
+
+int main() {
+  for (size_t count : { 10U, 100U, 1000U, 10000U, 100000U }) {
+    bench_allocations(count);
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <fmt/core.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <string_view>
+
+// Helpers for simple wall-clock benchmarks.
+// These are not registered as tests, run them manually on a quiet machine (or device) and compare the numbers.
+
+// Runs f(i) for each i in [0, iterations) and returns the average time taken per call, in nanoseconds.
+template <class F>
+double time_per_op_ns(size_t iterations, F&& f) {
+  auto const start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++) {
+    f(i);
+  }
+  auto const end = std::chrono::steady_clock::now();
+  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) /
+         static_cast<double>(iterations == 0 ? 1 : iterations);
+}
+
+inline void report(std::string_view name, size_t iterations, double ns_per_op) {
+  fmt::print("{:<48} n={:>7} {:>12.1f} ns/op\n", name, iterations, ns_per_op);
+  fflush(stdout);
+}
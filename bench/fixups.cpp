@@ -0,0 +1,113 @@
+// Benchmarks for generating trampolines.
+// Each iteration relocates a target holding a mix of PC-relative instructions, counting heap allocations made while
+// doing so, which should be zero.
+// Also reports how many bytes of executable memory a trampoline far from its target takes, with its data inline and
+// with its data separate.
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <span>
+
+#include "bench-wrapper.hpp"
+#include "fixups.hpp"
+
+namespace {
+
+size_t allocation_count = 0;
+
+constexpr size_t kIterations = 100000;
+
+void bench_fixups(std::string_view name, std::span<uint32_t const> insts, std::span<uint32_t> code) {
+  auto const rw = flamingo::PageProtectionType::kRead | flamingo::PageProtectionType::kWrite;
+  std::copy(insts.begin(), insts.end(), code.begin());
+  flamingo::Fixups fixups{
+    .target = { flamingo::PointerWrapper<uint32_t>(code.first(insts.size()), rw) },
+    // Place the trampoline on the next page, so that fixups are near
+    .fixup_inst_destination = flamingo::PointerWrapper<uint32_t>(
+        code.subspan(flamingo::Page::PageSize / sizeof(uint32_t), insts.size() * 4 * 4), rw),
+  };
+  fixups.CopyOriginalInsts();
+  auto const before = allocation_count;
+  auto const ns = time_per_op_ns(kIterations, [&](size_t) { fixups.PerformFixupsAndCallback(); });
+  report(name, kIterations, ns);
+  fmt::print("{:<48} {:>9} allocations/op\n", "",
+             static_cast<double>(allocation_count - before) / static_cast<double>(kIterations));
+}
+
+// Marks words of the trampoline that were never written
+constexpr uint32_t kUnwritten = 0xDEADBEEFU;
+
+// Returns the number of bytes of region before the last written word.
+size_t written_bytes(std::span<uint32_t const> region) {
+  auto const last = std::find_if(region.rbegin(), region.rend(), [](uint32_t word) { return word != kUnwritten; });
+  return static_cast<size_t>(region.rend() - last) * sizeof(uint32_t);
+}
+
+void measure_code_bytes(std::string_view name, std::span<uint32_t const> insts, std::span<uint32_t> target,
+                        std::span<uint32_t> code, std::span<uint32_t> data) {
+  auto const rw = flamingo::PageProtectionType::kRead | flamingo::PageProtectionType::kWrite;
+  std::copy(insts.begin(), insts.end(), target.begin());
+  for (auto const separate : { false, true }) {
+    std::fill(code.begin(), code.end(), kUnwritten);
+    std::fill(data.begin(), data.end(), kUnwritten);
+    flamingo::Fixups fixups{
+      .target = { flamingo::PointerWrapper<uint32_t>(target.first(insts.size()), rw) },
+      .fixup_inst_destination = flamingo::PointerWrapper<uint32_t>(code, rw),
+      .fixup_data_destination = separate ? flamingo::PointerWrapper<uint32_t>(data, rw)
+                                         : flamingo::PointerWrapper<uint32_t>(std::span<uint32_t>{}, rw),
+    };
+    fixups.CopyOriginalInsts();
+    fixups.PerformFixupsAndCallback();
+    fmt::print("{:<48} {:>9} code bytes {:>9} data bytes\n",
+               fmt::format("{} ({})", name, separate ? "separate data" : "inline data"), written_bytes(code),
+               written_bytes(data));
+  }
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  allocation_count++;
+  if (auto* ptr = std::malloc(size == 0 ? 1 : size)) return ptr;
+  std::abort();
+}
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+int main() {
+  // Two RW pages, the first holding the target and the second holding the trampoline
+  auto* page = ::mmap(nullptr, flamingo::Page::PageSize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    std::perror("mmap");
+    return 1;
+  }
+  auto code = std::span<uint32_t>(static_cast<uint32_t*>(page), flamingo::Page::PageSize * 2 / sizeof(uint32_t));
+  // stp x29, x30, [sp, #-0x10]!; mov x29, sp; sub sp, sp, #0x20; str x19, [sp]
+  constexpr uint32_t no_fixups[]{ 0xA9BF7BFDU, 0x910003FDU, 0xD10083FFU, 0xF90003F3U };
+  // tbnz w8, #0, #0xc; adrp x0, #0x1000; bl #0x40; cbz x0, #-4
+  constexpr uint32_t mixed[]{ 0x37000068U, 0xB0000000U, 0x94000010U, 0xB4FFFFE0U };
+  bench_fixups("PerformFixupsAndCallback (no fixups)", no_fixups, code);
+  bench_fixups("PerformFixupsAndCallback (mixed)", mixed, code);
+
+  // Place the trampoline (and its data, on the next page) out of B range of the target, so that it needs data
+  auto* far_page = ::mmap(static_cast<uint8_t*>(page) + (1LL << 30), flamingo::Page::PageSize * 2,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (far_page == MAP_FAILED) {
+    std::perror("mmap");
+    return 1;
+  }
+  fmt::print("Trampoline is {:#x} bytes from its target\n",
+             std::llabs(static_cast<uint8_t*>(far_page) - static_cast<uint8_t*>(page)));
+  auto far = std::span<uint32_t>(static_cast<uint32_t*>(far_page), flamingo::Page::PageSize * 2 / sizeof(uint32_t));
+  measure_code_bytes("Far trampoline (mixed)", mixed, code, far.first(far.size() / 2), far.subspan(far.size() / 2));
+  ::munmap(far_page, flamingo::Page::PageSize * 2);
+  ::munmap(page, flamingo::Page::PageSize * 2);
+}
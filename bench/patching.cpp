@@ -0,0 +1,43 @@
+// Benchmarks for patching target code, comparing each PatchMode.
+// Each iteration rewrites the jump at a read/execute page, as Install and Uninstall would for a real target.
+#include <sys/mman.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+
+#include "bench-wrapper.hpp"
+#include "fixups.hpp"
+
+namespace {
+
+constexpr size_t kIterations = 10000;
+
+void bench_write_jump(std::string_view name, flamingo::PatchMode mode, std::span<uint32_t> code) {
+  flamingo::SetPatchMode(mode);
+  flamingo::ShimTarget target{ flamingo::PointerWrapper<uint32_t>(
+      code.first(flamingo::Fixups::kNormalFixupInstCount),
+      flamingo::PageProtectionType::kExecute | flamingo::PageProtectionType::kRead) };
+  // Alternate between two destinations, so that every write actually changes the target
+  // The target is large enough for a far jump, so writes never fail, and never replace a veneer
+  auto replaced = flamingo::PointerWrapper<uint32_t>(std::span<uint32_t>{}, flamingo::PageProtectionType::kNone);
+  auto const ns = time_per_op_ns(
+      kIterations, [&](size_t i) { static_cast<void>(target.WriteJump(&code[(i % 2) + 64], replaced)); });
+  report(name, kIterations, ns);
+}
+
+}  // namespace
+
+int main() {
+  // Stand in for a library's text page
+  auto* page = ::mmap(nullptr, flamingo::Page::PageSize, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    std::perror("mmap");
+    return 1;
+  }
+  auto code = std::span<uint32_t>(static_cast<uint32_t*>(page), flamingo::Page::PageSize / sizeof(uint32_t));
+  bench_write_jump("WriteJump (mprotect)", flamingo::PatchMode::kProtect, code);
+  bench_write_jump("WriteJump (/proc/self/mem)", flamingo::PatchMode::kProcMem, code);
+  flamingo::SetPatchMode(flamingo::PatchMode::kProtect);
+  ::munmap(page, flamingo::Page::PageSize);
+}
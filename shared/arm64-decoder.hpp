@@ -0,0 +1,543 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace flamingo::arm64 {
+
+/// @brief The classes of instruction that reference the PC, and thus must be rewritten when relocated.
+/// Every other instruction is position independent and may be copied verbatim.
+enum struct InstKind : uint8_t {
+  kOther,
+  /// @brief B imm26
+  kB,
+  /// @brief B.cond imm19 (and BC.cond)
+  kBCond,
+  /// @brief BL imm26
+  kBl,
+  /// @brief CBZ/CBNZ imm19
+  kCbz,
+  /// @brief TBZ/TBNZ imm14
+  kTbz,
+  /// @brief LDR (literal) into a general purpose register, imm19
+  kLdrLiteral,
+  /// @brief LDR (literal) into a SIMD/FP register, imm19
+  kLdrSimdLiteral,
+  /// @brief LDRSW (literal), imm19
+  kLdrswLiteral,
+  /// @brief PRFM (literal), imm19
+  kPrfmLiteral,
+  /// @brief ADR immhi:immlo
+  kAdr,
+  /// @brief ADRP immhi:immlo, in units of pages
+  kAdrp,
+};
+
+/// @brief A single entry of the classification table: an instruction is of kind if (inst & mask) == value.
+struct Encoding {
+  uint32_t mask;
+  uint32_t value;
+  InstKind kind;
+};
+
+// Encodings are from the Arm A64 Instruction Set Architecture, C4.1 "A64 instruction set encoding".
+// No two entries overlap, so order only matters for speed.
+constexpr std::array<Encoding, 11> kPcRelativeEncodings{ {
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/B--Branch-
+  { 0xFC000000U, 0x14000000U, InstKind::kB },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/BL--Branch-with-Link-
+  { 0xFC000000U, 0x94000000U, InstKind::kBl },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/B-cond--Branch-conditionally-
+  { 0xFF000000U, 0x54000000U, InstKind::kBCond },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/CBZ--Compare-and-Branch-on-Zero-
+  { 0x7E000000U, 0x34000000U, InstKind::kCbz },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/TBZ--Test-bit-and-Branch-if-Zero-
+  { 0x7E000000U, 0x36000000U, InstKind::kTbz },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/LDR--literal---Load-Register--literal--
+  { 0xBF000000U, 0x18000000U, InstKind::kLdrLiteral },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/LDRSW--literal---Load-Register-Signed-Word--literal--
+  { 0xFF000000U, 0x98000000U, InstKind::kLdrswLiteral },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/PRFM--literal---Prefetch-Memory--literal--
+  { 0xFF000000U, 0xD8000000U, InstKind::kPrfmLiteral },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/SIMD-FP-Instructions/LDR--literal--SIMD-FP---Load-SIMD-FP-Register--PC-relative-literal--
+  { 0x3F000000U, 0x1C000000U, InstKind::kLdrSimdLiteral },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/ADR--Form-PC-relative-address-
+  { 0x9F000000U, 0x10000000U, InstKind::kAdr },
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/ADRP--Form-PC-relative-address-to-4KB-page-
+  { 0x9F000000U, 0x90000000U, InstKind::kAdrp },
+} };
+
+/// @brief Returns the kind of the provided instruction, kOther if it is not PC-relative.
+constexpr InstKind Classify(uint32_t inst) {
+  for (auto const& encoding : kPcRelativeEncodings) {
+    if ((inst & encoding.mask) == encoding.value) return encoding.kind;
+  }
+  return InstKind::kOther;
+}
+
+/// @brief Returns true if the provided instruction must be rewritten when moved to a different address.
+constexpr bool IsPcRelative(uint32_t inst) {
+  return Classify(inst) != InstKind::kOther;
+}
+
+/// @brief Sign extends the bits-wide field of value starting at bit lsb.
+constexpr int64_t SignExtend(uint32_t value, uint32_t lsb, uint32_t bits) {
+  auto const field = static_cast<uint64_t>((value >> lsb) & ((1U << bits) - 1U));
+  auto const sign_bit = 1ULL << (bits - 1U);
+  return static_cast<int64_t>((field ^ sign_bit) - sign_bit);
+}
+
+/// @brief The result of decoding a single instruction.
+struct DecodedInst {
+  InstKind kind;
+  /// @brief The Rt/Rd register of the instruction (bits 0-4). Only meaningful for kinds other than kOther.
+  uint8_t reg;
+  /// @brief The absolute address the instruction references, computed from the pc it was decoded at.
+  /// For ADRP, this is the referenced page. Only meaningful for kinds other than kOther.
+  int64_t target;
+};
+
+/// @brief Decodes the provided instruction as if it were located at pc.
+/// pc is expected to be untagged.
+constexpr DecodedInst Decode(uint32_t inst, int64_t pc) {
+  constexpr uint32_t reg_mask = 0b11111U;
+  auto const kind = Classify(inst);
+  auto const reg = static_cast<uint8_t>(inst & reg_mask);
+  switch (kind) {
+    case InstKind::kB:
+    case InstKind::kBl:
+      return { kind, reg, pc + SignExtend(inst, 0, 26) * 4 };
+    case InstKind::kBCond:
+    case InstKind::kCbz:
+    case InstKind::kLdrLiteral:
+    case InstKind::kLdrSimdLiteral:
+    case InstKind::kLdrswLiteral:
+    case InstKind::kPrfmLiteral:
+      return { kind, reg, pc + SignExtend(inst, 5, 19) * 4 };
+    case InstKind::kTbz:
+      return { kind, reg, pc + SignExtend(inst, 5, 14) * 4 };
+    case InstKind::kAdr:
+    case InstKind::kAdrp: {
+      // immhi:immlo, with immlo in bits 29-30 and immhi in bits 5-23
+      auto const imm = SignExtend(((inst >> 5) << 2) | ((inst >> 29) & 3U), 0, 21);
+      if (kind == InstKind::kAdr) return { kind, reg, pc + imm };
+      constexpr int64_t page_mask = ~0xFFFLL;
+      return { kind, reg, (pc & page_mask) + imm * 0x1000 };
+    }
+    case InstKind::kOther:
+      break;
+  }
+  return { InstKind::kOther, reg, 0 };
+}
+
+/// @brief Returns true if execution never continues on to the instruction after inst: B, BR, RET and ERET (including
+/// their pointer authenticated forms), B.cond with AL or NV, and UDF, which is used as padding after calls that do not
+/// return.
+constexpr bool IsTerminator(uint32_t inst) {
+  // Unconditional branch (register), other than those that link (BLR, BLRAA, etc.), which have bit 21 set
+  // https://developer.arm.com/documentation/ddi0602/2023-12/Index-by-Encoding/Branches--Exception-Generating-and-System-instructions
+  constexpr uint32_t branch_reg_mask = 0xFE000000U;
+  constexpr uint32_t branch_reg_value = 0xD6000000U;
+  if ((inst & branch_reg_mask) == branch_reg_value) return (inst & (1U << 21)) == 0;
+  // UDF #imm16
+  if ((inst & 0xFFFF0000U) == 0) return true;
+  switch (Classify(inst)) {
+    case InstKind::kB:
+      return true;
+    case InstKind::kBCond:
+      return (inst & 0b1110U) == 0b1110U;
+    default:
+      return false;
+  }
+}
+
+/// @brief Returns true if inst is a call: a BL, or a BLR (including its pointer authenticated forms).
+constexpr bool IsCall(uint32_t inst) {
+  // Unconditional branch (register) with bit 21 set, as for IsTerminator
+  constexpr uint32_t branch_reg_mask = 0xFE000000U;
+  constexpr uint32_t branch_reg_value = 0xD6000000U;
+  if ((inst & branch_reg_mask) == branch_reg_value) return (inst & (1U << 21)) != 0;
+  return Classify(inst) == InstKind::kBl;
+}
+
+/// @brief The result of scanning the function starting at some pc, see AnalyzeFunction.
+struct FunctionAnalysis {
+  /// @brief The number of instructions up to and including the first terminator that no branch seen so far jumps past,
+  /// or the number of instructions scanned if there was none. Instructions past this are assumed to belong to another
+  /// function.
+  uint16_t num_insts;
+  /// @brief The largest number of instructions from the start of the function that can be patched, such that no branch
+  /// from after the patch lands within the patch (other than on its first instruction). At most num_insts.
+  uint16_t safe_patch_size;
+};
+
+/// @brief Scans insts, the start of a function located at pc, for the end of the function and every branch within it
+/// that lands in its first few instructions. pc is expected to be untagged.
+/// Only branches within the function itself are found, so a branch from elsewhere into the function is not.
+/// The function is known to be at least declared_insts long, so a UDF within those (which may just be a data word of
+/// 0) does not end it.
+constexpr FunctionAnalysis AnalyzeFunction(std::span<uint32_t const> insts, int64_t pc, size_t declared_insts = 0) {
+  // Returns the index of the instruction the branch at idx lands on, or -1 if it is not a branch within insts
+  auto const branch_destination = [&](size_t idx) -> int64_t {
+    auto const decoded = Decode(insts[idx], pc + static_cast<int64_t>(idx * sizeof(uint32_t)));
+    switch (decoded.kind) {
+      case InstKind::kB:
+      case InstKind::kBCond:
+      case InstKind::kCbz:
+      case InstKind::kTbz:
+        break;
+      default:
+        return -1;
+    }
+    auto const offset = decoded.target - pc;
+    if (offset < 0 || offset >= static_cast<int64_t>(insts.size_bytes())) return -1;
+    return offset / static_cast<int64_t>(sizeof(uint32_t));
+  };
+  // The function ends at the first terminator that nothing we have seen branches past
+  size_t num_insts = insts.size();
+  int64_t furthest = 0;
+  for (size_t i = 0; i < insts.size(); i++) {
+    auto const dst = branch_destination(i);
+    if (dst > furthest) furthest = dst;
+    bool const udf = (insts[i] & 0xFFFF0000U) == 0;
+    if (IsTerminator(insts[i]) && !(udf && i < declared_insts) && furthest <= static_cast<int64_t>(i)) {
+      num_insts = i + 1;
+      break;
+    }
+  }
+  // A backwards branch (or a branch to itself) to dst makes every patch that covers dst but not the branch unsafe.
+  // Forward branches from within a patch are relocated with it, so they never are.
+  size_t safe_patch_size = num_insts;
+  for (size_t i = 0; i < num_insts; i++) {
+    auto const dst = branch_destination(i);
+    if (dst > 0 && dst <= static_cast<int64_t>(i) && static_cast<size_t>(dst) < safe_patch_size) {
+      safe_patch_size = dst;
+    }
+  }
+  return { static_cast<uint16_t>(num_insts), static_cast<uint16_t>(safe_patch_size) };
+}
+
+/// @brief Returns true if a B or BL at pc can reach target, which must be within +-128MB.
+constexpr bool BranchInRange(int64_t pc, int64_t target) {
+  auto const delta = target - pc;
+  return delta >= -(1LL << 27) && delta < (1LL << 27);
+}
+
+/// @brief Returns true if a conditional branch (kBCond, kCbz, kTbz) has a condition that can be inverted.
+/// B.cond with AL or NV always branches, so it has no inverse.
+constexpr bool HasInvertibleCondition(uint32_t inst) {
+  if (Classify(inst) != InstKind::kBCond) return true;
+  return (inst & 0b1110U) != 0b1110U;
+}
+
+/// @brief Returns inst with its condition inverted: B.cond becomes B.!cond, CBZ becomes CBNZ and TBZ becomes TBNZ (and
+/// vice versa). The immediate is left untouched. inst must satisfy HasInvertibleCondition.
+constexpr uint32_t InvertCondition(uint32_t inst) {
+  if (Classify(inst) == InstKind::kBCond) {
+    // The low bit of the condition code selects its inverse
+    return inst ^ 1U;
+  }
+  // For CBZ/CBNZ and TBZ/TBNZ, bit 24 is the op bit
+  return inst ^ (1U << 24);
+}
+
+/// @brief Returns true if an ADR at pc can reference target, which must be within +-1MB.
+constexpr bool AdrInRange(int64_t pc, int64_t target) {
+  auto const delta = target - pc;
+  return delta >= -(1LL << 20) && delta < (1LL << 20);
+}
+
+/// @brief Encodes an ADR of reg at pc referencing target. target must be in range, see AdrInRange.
+constexpr uint32_t EncodeAdr(uint8_t reg, int64_t pc, int64_t target) {
+  constexpr uint32_t adr_opcode = 0x10000000U;
+  constexpr uint32_t reg_mask = 0b11111U;
+  constexpr uint32_t immhi_mask = 0x7FFFFU;
+  auto const delta = static_cast<uint32_t>(target - pc);
+  return adr_opcode | ((delta & 3U) << 29) | (((delta >> 2) & immhi_mask) << 5) | (reg & reg_mask);
+}
+
+/// @brief Returns true if an ADRP at pc can reference the page containing target, which must be within +-4GB.
+constexpr bool AdrpInRange(int64_t pc, int64_t target) {
+  constexpr int64_t page_mask = ~0xFFFLL;
+  auto const delta_pages = ((target & page_mask) - (pc & page_mask)) / 0x1000;
+  return delta_pages >= -(1LL << 20) && delta_pages < (1LL << 20);
+}
+
+/// @brief Encodes an ADRP of reg at pc referencing the page containing target. target must be in range, see
+/// AdrpInRange.
+constexpr uint32_t EncodeAdrp(uint8_t reg, int64_t pc, int64_t target) {
+  constexpr uint32_t adrp_opcode = 0x90000000U;
+  constexpr uint32_t reg_mask = 0b11111U;
+  constexpr uint32_t immhi_mask = 0x7FFFFU;
+  constexpr int64_t page_mask = ~0xFFFLL;
+  // Both the pc and the target are rounded down to their pages before taking the difference
+  auto const delta_pages = static_cast<uint32_t>(((target & page_mask) - (pc & page_mask)) / 0x1000);
+  return adrp_opcode | ((delta_pages & 3U) << 29) | (((delta_pages >> 2) & immhi_mask) << 5) | (reg & reg_mask);
+}
+
+/// @brief Returns the number of bytes loaded by a literal load (kLdrLiteral, kLdrSimdLiteral, kLdrswLiteral), or 0 for
+/// a PRFM literal.
+constexpr uint32_t LiteralSize(uint32_t inst) {
+  auto const opc = inst >> 30;
+  switch (Classify(inst)) {
+    case InstKind::kLdrLiteral:
+      // opc is 00 for W, 01 for X
+      return opc == 0 ? 4 : 8;
+    case InstKind::kLdrSimdLiteral:
+      // opc is 00 for S, 01 for D, 10 for Q
+      return 4U << opc;
+    case InstKind::kLdrswLiteral:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+/// @brief Returns true if a literal load at pc can reference target, which must be within +-1MB.
+constexpr bool LiteralInRange(int64_t pc, int64_t target) {
+  auto const delta = target - pc;
+  return delta >= -(1LL << 20) && delta < (1LL << 20);
+}
+
+/// @brief Re-encodes the provided literal load (or conditional branch), assumed to be moved to pc, to reference target.
+/// target must be in range, see LiteralInRange.
+constexpr uint32_t EncodeImm19(uint32_t inst, int64_t pc, int64_t target) {
+  constexpr uint32_t imm19_mask = 0x7FFFFU << 5;
+  auto const delta = static_cast<uint32_t>(target - pc);
+  return (inst & ~imm19_mask) | (((delta >> 2) << 5) & imm19_mask);
+}
+
+/// @brief Returns the equivalent of the provided literal load that instead loads from [base, #offset], with the same Rt
+/// and size. offset must be a multiple of the size of the load (8 for a PRFM), and less than 4096 times it.
+/// https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/LDR--immediate---Load-Register--immediate--
+constexpr uint32_t EncodeLoadFromBase(uint32_t inst, uint8_t base, uint32_t offset = 0) {
+  constexpr uint32_t reg_mask = 0b11111U;
+  uint32_t opcode = 0;
+  switch (Classify(inst)) {
+    case InstKind::kLdrLiteral:
+      // LDR Wt, [Xn] or LDR Xt, [Xn]
+      opcode = (inst >> 30) == 0 ? 0xB9400000U : 0xF9400000U;
+      break;
+    case InstKind::kLdrswLiteral:
+      // LDRSW Xt, [Xn]
+      opcode = 0xB9800000U;
+      break;
+    case InstKind::kPrfmLiteral:
+      // PRFM <prfop>, [Xn]
+      opcode = 0xF9800000U;
+      break;
+    case InstKind::kLdrSimdLiteral: {
+      // LDR St, [Xn], LDR Dt, [Xn] or LDR Qt, [Xn]
+      constexpr std::array<uint32_t, 3> simd_opcodes{ 0xBD400000U, 0xFD400000U, 0x3DC00000U };
+      opcode = simd_opcodes[(inst >> 30) % simd_opcodes.size()];
+    } break;
+    default:
+      break;
+  }
+  // The unsigned offset is scaled by the size of the load, which is 8 for a PRFM
+  constexpr uint32_t imm12_mask = 0xFFFU;
+  uint32_t const size = LiteralSize(inst) != 0 ? LiteralSize(inst) : 8U;
+  auto const imm12 = (offset / size) & imm12_mask;
+  return opcode | (imm12 << 10) | ((base & reg_mask) << 5) | (inst & reg_mask);
+}
+
+/// @brief An instruction that consumes the page an ADRP formed in a register, leaving nothing of it behind.
+struct PageOffsetUse {
+  /// @brief The number of bytes the instruction adds to the page
+  uint32_t offset;
+  /// @brief For a load, the literal load (with an imm19 of 0) of the same register and size. 0 for an ADD.
+  uint32_t literal_load;
+};
+
+/// @brief Returns how inst consumes the page in reg, if it is either an ADD Xreg, Xreg, #imm or a load of reg from
+/// [Xreg, #imm] (an LDR of W or X, or an LDRSW). reg must not be 31, which is SP or ZR depending on the instruction.
+/// https://developer.arm.com/documentation/ddi0602/2023-12/Base-Instructions/ADD--immediate---Add--immediate--
+constexpr std::optional<PageOffsetUse> DecodePageOffsetUse(uint32_t inst, uint8_t reg) {
+  constexpr uint32_t reg_mask = 0b11111U;
+  constexpr uint32_t imm12_mask = 0xFFFU;
+  if (reg == 31 || (inst & reg_mask) != reg || ((inst >> 5) & reg_mask) != reg) return std::nullopt;
+  auto const imm12 = (inst >> 10) & imm12_mask;
+  // ADD Xd, Xn, #imm{, LSL #12}
+  if ((inst & 0xFF800000U) == 0x91000000U) {
+    auto const shift = (inst & (1U << 22)) != 0 ? 12U : 0U;
+    return PageOffsetUse{ .offset = imm12 << shift, .literal_load = 0 };
+  }
+  // LDR Wt, [Xn, #imm], LDR Xt, [Xn, #imm] and LDRSW Xt, [Xn, #imm], with their literal equivalents
+  struct Load {
+    uint32_t opcode;
+    uint32_t size;
+    uint32_t literal_load;
+  };
+  constexpr std::array<Load, 3> loads{ {
+    { 0xB9400000U, 4, 0x18000000U },
+    { 0xF9400000U, 8, 0x58000000U },
+    { 0xB9800000U, 4, 0x98000000U },
+  } };
+  constexpr uint32_t load_mask = 0xFFC00000U;
+  for (auto const& load : loads) {
+    if ((inst & load_mask) == load.opcode) {
+      return PageOffsetUse{ .offset = imm12 * load.size, .literal_load = load.literal_load | reg };
+    }
+  }
+  return std::nullopt;
+}
+
+/// @brief Returns true if insts, an entire function located at pc (see AnalyzeFunction), can be relocated as a whole:
+/// it ends in a terminator, makes no calls (so that no return address ever points into the relocated copy, where
+/// unwinders cannot follow it), and never forms an address within itself, as a jump table or computed branch would.
+/// pc is expected to be untagged.
+constexpr bool IsRelocatableLeaf(std::span<uint32_t const> insts, int64_t pc) {
+  if (insts.empty() || !IsTerminator(insts.back())) return false;
+  auto const end = pc + static_cast<int64_t>(insts.size_bytes());
+  for (size_t i = 0; i < insts.size(); i++) {
+    if (IsCall(insts[i])) return false;
+    auto const decoded = Decode(insts[i], pc + static_cast<int64_t>(i * sizeof(uint32_t)));
+    auto address = decoded.target;
+    if (decoded.kind == InstKind::kAdrp) {
+      // An ADRP alone is page granular, so only the address it forms along with the instruction after it counts
+      auto const use = i + 1 < insts.size() ? DecodePageOffsetUse(insts[i + 1], decoded.reg) : std::nullopt;
+      if (!use.has_value() || use->literal_load != 0) continue;
+      address += use->offset;
+    } else if (decoded.kind != InstKind::kAdr) {
+      continue;
+    }
+    if (address >= pc && address < end) return false;
+  }
+  return true;
+}
+
+/// @brief The register that far jumps (and spills around SIMD/FP literal loads) use when no other is provably dead: x17
+/// (IP1), which the ABI already lets linker veneers clobber on the way into any function.
+constexpr uint8_t kDefaultScratchReg = 17;
+
+/// @brief Returns true if inst is a RET (including RETAA and RETAB).
+constexpr bool IsReturn(uint32_t inst) {
+  constexpr uint32_t ret_mask = 0xFFFFFC1FU;
+  constexpr uint32_t ret_value = 0xD65F0000U;
+  return (inst & ret_mask) == ret_value || inst == 0xD65F0BFFU || inst == 0xD65F0FFFU;
+}
+
+/// @brief Returns true if inst writes the whole of the general purpose register reg (as an X or a W register) without
+/// reading it: an ADR, ADRP, MOVZ, MOVN, literal load, LDR or LDRSW from an unsigned offset, or an ADD, SUB or logical
+/// operation (of an immediate or a shifted register) of other registers. Only covers what compilers commonly emit, so
+/// false does not mean that inst reads reg.
+/// https://developer.arm.com/documentation/ddi0602/2023-12/Index-by-Encoding/Data-Processing----Immediate
+constexpr bool OverwritesRegister(uint32_t inst, uint8_t reg) {
+  constexpr uint32_t reg_mask = 0b11111U;
+  if (reg == 31 || (inst & reg_mask) != reg) return false;
+  auto const rn = (inst >> 5) & reg_mask;
+  auto const rm = (inst >> 16) & reg_mask;
+  switch (Classify(inst)) {
+    case InstKind::kAdr:
+    case InstKind::kAdrp:
+    case InstKind::kLdrLiteral:
+    case InstKind::kLdrswLiteral:
+      return true;
+    default:
+      break;
+  }
+  // MOVN and MOVZ, but not MOVK, which keeps the rest of the register
+  if ((inst & 0x7F800000U) == 0x12800000U || (inst & 0x7F800000U) == 0x52800000U) return true;
+  // ADD/SUB (immediate) and logical (immediate)
+  if ((inst & 0x1F800000U) == 0x11000000U || (inst & 0x1F800000U) == 0x12000000U) return rn != reg;
+  // ADD/SUB (shifted register) and logical (shifted register)
+  if ((inst & 0x1F200000U) == 0x0B000000U || (inst & 0x1F000000U) == 0x0A000000U) return rn != reg && rm != reg;
+  // LDR Wt, [Xn, #imm], LDR Xt, [Xn, #imm] and LDRSW Xt, [Xn, #imm]
+  if ((inst & 0xBFC00000U) == 0xB9400000U || (inst & 0xFFC00000U) == 0xB9800000U) return rn != reg;
+  return false;
+}
+
+/// @brief Returns true if inst may read the general purpose register reg. Conservatively, this is any instruction with
+/// a register field (Rt, Rn, Rt2 or Rm) that names reg, whether or not it has such a field, as well as a CASP of the
+/// pair reg belongs to.
+constexpr bool MayReadRegister(uint32_t inst, uint8_t reg) {
+  constexpr uint32_t reg_mask = 0b11111U;
+  constexpr std::array<uint32_t, 4> field_shifts{ 0, 5, 10, 16 };
+  for (auto const shift : field_shifts) {
+    if (((inst >> shift) & reg_mask) == reg) return true;
+  }
+  // CASP reads (and writes) the pairs starting at Rs and Rt, of which only the first is encoded
+  constexpr uint32_t casp_mask = 0xBFA07C00U;
+  constexpr uint32_t casp_value = 0x08207C00U;
+  return (inst & casp_mask) == casp_value && (reg % 2) != 0 &&
+         (((inst >> 16) & reg_mask) == reg - 1U || (inst & reg_mask) == reg - 1U);
+}
+
+/// @brief Returns true if the general purpose register reg is provably dead at the start of insts, located at pc: on
+/// every path through insts, it is overwritten (see OverwritesRegister) before anything may read it, or it is one of
+/// the temporaries x9-x17 and a call or RET is reached first, across which the ABI preserves none of them.
+/// Forward branches within insts are followed down both paths. Any other branch (or running off the end of insts) may
+/// lead anywhere, so reg is assumed to be live there. pc is expected to be untagged.
+constexpr bool IsDeadAt(std::span<uint32_t const> insts, int64_t pc, uint8_t reg) {
+  auto const end = pc + static_cast<int64_t>(insts.size_bytes());
+  for (size_t i = 0; i < insts.size(); i++) {
+    auto const inst = insts[i];
+    if (OverwritesRegister(inst, reg)) return true;
+    if (MayReadRegister(inst, reg)) return false;
+    if (IsCall(inst) || IsReturn(inst)) return reg >= 9 && reg <= 17;
+    auto const current_pc = pc + static_cast<int64_t>(i * sizeof(uint32_t));
+    auto const decoded = Decode(inst, current_pc);
+    switch (decoded.kind) {
+      case InstKind::kB:
+      case InstKind::kBCond:
+      case InstKind::kCbz:
+      case InstKind::kTbz:
+        break;
+      default:
+        if (IsTerminator(inst)) return false;
+        continue;
+    }
+    // Only branches forward are followed, so that loops are never walked twice
+    if (decoded.target <= current_pc || decoded.target >= end) return false;
+    auto const dst = static_cast<size_t>(decoded.target - pc) / sizeof(uint32_t);
+    if (!IsDeadAt(insts.subspan(dst), decoded.target, reg)) return false;
+    if (IsTerminator(inst)) return true;
+  }
+  return false;
+}
+
+/// @brief Returns a register that is dead at the start of insts (see IsDeadAt), preferring x17 and x16, which nothing
+/// but veneers should expect to survive a branch, over the other temporaries x9-x15. Returns std::nullopt if none is.
+constexpr std::optional<uint8_t> FindScratchRegister(std::span<uint32_t const> insts, int64_t pc) {
+  constexpr std::array<uint8_t, 9> candidates{ 17, 16, 9, 10, 11, 12, 13, 14, 15 };
+  for (auto const reg : candidates) {
+    if (IsDeadAt(insts, pc, reg)) return reg;
+  }
+  return std::nullopt;
+}
+
+/// @brief Returns a human readable name for the provided kind, for logging.
+constexpr std::string_view KindName(InstKind kind) {
+  switch (kind) {
+    case InstKind::kB:
+      return "B";
+    case InstKind::kBCond:
+      return "B.cond";
+    case InstKind::kBl:
+      return "BL";
+    case InstKind::kCbz:
+      return "CBZ/CBNZ";
+    case InstKind::kTbz:
+      return "TBZ/TBNZ";
+    case InstKind::kLdrLiteral:
+      return "LDR (literal)";
+    case InstKind::kLdrSimdLiteral:
+      return "LDR (literal, SIMD&FP)";
+    case InstKind::kLdrswLiteral:
+      return "LDRSW (literal)";
+    case InstKind::kPrfmLiteral:
+      return "PRFM (literal)";
+    case InstKind::kAdr:
+      return "ADR";
+    case InstKind::kAdrp:
+      return "ADRP";
+    case InstKind::kOther:
+      break;
+  }
+  return "other";
+}
+
+}  // namespace flamingo::arm64
@@ -26,6 +26,7 @@ typedef enum {
   FLAMINGO_INSTALL_MISMATCH_PARAM,
   FLAMINGO_INSTALL_MISMATCH_PARAM_COUNT,
 #endif
+  FLAMINGO_INSTALL_NO_SCRATCH_REGISTER,
 } FlamingoInstallationType;
 
 /// @brief Opaque pointer around a flamingo::HookHandle
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <span>
+#include <utility>
 #include <vector>
 #include "page-allocator.hpp"
 #include "util.hpp"
@@ -12,31 +16,93 @@
 
 namespace flamingo {
 
+/// @brief How a ProtectionWriter writes to memory that is not dual mapped.
+enum struct PatchMode {
+  /// @brief Protect the target as writable for the lifetime of the writer, then protect it back afterwards.
+  kProtect,
+  /// @brief Buffer all writes and commit them with a single pwrite to /proc/self/mem, which writes through the page's
+  /// existing protection without changing it. Writes the kernel refuses fall back to kProtect.
+  kProcMem,
+};
+
+/// @brief Sets the PatchMode used by all ProtectionWriters constructed after this call. Defaults to kProtect.
+FLAMINGO_EXPORT void SetPatchMode(PatchMode mode);
+/// @brief Returns the current PatchMode.
+FLAMINGO_EXPORT PatchMode GetPatchMode();
+
+/// @brief Where the literals loaded by fixups (far branch targets, relocated literals, etc.) are placed.
+enum struct DataLayout {
+  /// @brief Literals are laid out in the same allocation as the fixups, directly after the callback.
+  kInline,
+  /// @brief Literals are laid out in a separate, read-only allocation near the fixups, so that fixups are densely
+  /// packed code and never share cache lines with data. Literals within +-1MB of their load are loaded with an LDR
+  /// literal, otherwise with an ADRP + LDR pair.
+  kSeparate,
+};
+
+/// @brief Sets the DataLayout used by all hooks installed after this call. Defaults to kInline.
+FLAMINGO_EXPORT void SetDataLayout(DataLayout layout);
+/// @brief Returns the current DataLayout.
+FLAMINGO_EXPORT DataLayout GetDataLayout();
+
+/// @brief Writes size bytes from src to dst via /proc/self/mem, regardless of the protection of dst.
+/// Returns false if /proc/self/mem is unavailable or the kernel refused the write.
+bool WriteProcMem(void* dst, void const* src, size_t size);
+
 template <class T>
 struct ProtectionWriter {
   // The target to write to
   PointerWrapper<T> target;
-  PageProtectionType original_permissions;
+  // The actual protections of the (at most two) pages the target spans, restored once we are done writing
+  std::array<PageProtectionType, 2> original_protections{ PageProtectionType::kNone, PageProtectionType::kNone };
   // Where in the target we are currently about to write to
   uint_fast16_t target_offset{ 0 };
+  // For PatchMode::kProcMem, holds everything written so far, which is committed on Flush
+  std::vector<T> buffer{};
+  bool buffered{ false };
+  bool dirty{ false };
 
-  ProtectionWriter(PointerWrapper<T> ptr) : target(ptr), original_permissions(target.protection) {
-    // When we construct this writer, we mark the page we are operating on as writable.
-    // To do this, we align the pointer down to the multiple of the PageSize
-    // and then we protect it with the write permission.
-    target.protection |= PageProtectionType::kWrite;
-    target.Protect();
+  ProtectionWriter(PointerWrapper<T> ptr) : target(ptr) {
+    // Dual mapped targets are written through their writable alias, so their protection never changes.
+    if (target.IsDualMapped()) return;
+    if (GetPatchMode() == PatchMode::kProcMem) {
+      buffered = true;
+      buffer.reserve(target.addr.size());
+      return;
+    }
+    // When we construct this writer, we mark the pages we are operating on as writable, remembering what they were.
+    MakeWritable();
   }
   ProtectionWriter(ProtectionWriter const&) = delete;
   ProtectionWriter(ProtectionWriter&& other)
-      : target(other.target), original_permissions(other.original_permissions), target_offset(other.target_offset) {
+      : target(other.target),
+        original_protections(other.original_protections),
+        target_offset(other.target_offset),
+        buffer(std::move(other.buffer)),
+        buffered(other.buffered),
+        dirty(std::exchange(other.dirty, false)) {
     // Set other's target to null to avoid a case where we re-protect on the first instance's dtor
     other.target.addr = {};
   }
 
   ~ProtectionWriter() {
-    target.protection = original_permissions;
-    target.Protect();
+    if (target.IsDualMapped()) return;
+    if (buffered) {
+      Flush();
+      return;
+    }
+    RestoreProtections();
+  }
+  /// @brief Commits all buffered writes to the target. Must be called before flushing the icache for the target, if the
+  /// writer is still alive at that point. Does nothing for writers that are not buffered.
+  void Flush() {
+    if (!buffered || !dirty) return;
+    dirty = false;
+    if (WriteProcMem(target.addr.data(), buffer.data(), buffer.size() * sizeof(T))) return;
+    // The kernel refused our write, so make the target writable just for the copy
+    MakeWritable();
+    std::memcpy(target.addr.data(), buffer.data(), buffer.size() * sizeof(T));
+    RestoreProtections();
   }
   // Write data to this writer. Returns the index that we wrote to.
   uint_fast16_t Write(T inst) {
@@ -44,34 +110,178 @@ struct ProtectionWriter {
       FLAMINGO_ABORT("Cannot write if there is no space available! {} should be < {}", target_offset,
                      target.addr.size());
     }
-    target.addr[target_offset] = inst;
+    if (buffered) {
+      buffer.push_back(inst);
+      dirty = true;
+    } else {
+      *target.WritableAt(target_offset) = inst;
+    }
     auto to_return = target_offset;
     target_offset++;
     return to_return;
   }
+  /// @brief Returns a writable reference to a previously written index, for patching it after the fact.
+  T& At(uint_fast16_t idx) {
+    FLAMINGO_ASSERT(idx < target_offset);
+    if (buffered) {
+      dirty = true;
+      return buffer[idx];
+    }
+    return *target.WritableAt(idx);
+  }
+
+ private:
+  // Calls f with each page the target spans and the slot holding that page's original protection.
+  template <class F>
+  void ForEachTargetPage(F&& f) {
+    if (target.addr.empty()) return;
+    auto const start = reinterpret_cast<uintptr_t>(target.addr.data());
+    auto const first_page = Page::PageAlign(start);
+    auto const last_page = Page::PageAlign(start + target.addr.size_bytes() - 1);
+    FLAMINGO_ASSERT(last_page - first_page <= Page::PageSize);
+    f(first_page, original_protections[0]);
+    if (last_page != first_page) {
+      f(last_page, original_protections[1]);
+    }
+  }
+  void MakeWritable() {
+    ForEachTargetPage([](uintptr_t page, PageProtectionType& original) { original = BeginPageWrite(page); });
+  }
+  void RestoreProtections() {
+    ForEachTargetPage([](uintptr_t page, PageProtectionType original) { EndPageWrite(page, original); });
+  }
 };
 
+/// @brief Returns a veneer (ldr x17, #8; br x17; .quad destination) within branch range of near, through which a single
+/// B at near can reach destination. Veneers are pooled: a live veneer to the same destination that near can reach is
+/// shared (and reference counted) instead of allocating a new one, and new veneers are packed alongside every other
+/// allocation near near, so many targets share a single pool page.
+/// Returns a PointerWrapper with an empty span if no memory in range of near could be found.
+PointerWrapper<uint32_t> AcquireVeneer(void const* near, void const* destination);
+/// @brief Releases a veneer returned by AcquireVeneer, freeing it once nothing else uses it. Empty veneers are ignored.
+void ReleaseVeneer(PointerWrapper<uint32_t> veneer);
+/// @brief Returns the number of distinct veneers that are currently live.
+size_t VeneerCount();
+
 struct ShimTarget : PointerWrapper<uint32_t> {
+  /// @brief The number of instructions (including data) a far jump stub takes up
+  constexpr static auto kStubInstCount = 4U;
   /// @brief Holds the original instructions at this target BEFORE a HOOK was written there.
   /// This is not the same as a Fixups' original_instructions, which are populated across ALL fixups performed.
   std::vector<uint32_t> original_instructions{};
-  void WriteJump(void* addr);
+  /// @brief The veneer (see AcquireVeneer) that a target too small for a far jump branches through, when its jump
+  /// destination is out of range of a single B. Empty otherwise.
+  PointerWrapper<uint32_t> veneer{ std::span<uint32_t>{}, PageProtectionType::kNone };
+  /// @brief Marks a target that has no register a jump to it may clobber, see scratch_reg.
+  constexpr static uint8_t kNoScratchReg = 31;
+  /// @brief The register a far jump at the target loads its destination into. x17 (which the ABI lets veneers clobber
+  /// on the way into any function), unless the target is a midpoint, where it must be dead (see arm64::IsDeadAt), or
+  /// kNoScratchReg if none is, in which case only a single B directly to the destination can be written.
+  /// Veneers are shared, so they always use x17, and a target can only branch through one if its scratch_reg is x17.
+  uint8_t scratch_reg{ 17 };
+  /// @brief Returns true if a jump to addr can be written at the target without clobbering a register that may be live
+  /// there: it is a single B, or it loads addr into scratch_reg (through a veneer, if the target is too small for a far
+  /// jump). Says nothing about whether a veneer can be found.
+  [[nodiscard]] bool CanJumpTo(void const* addr) const;
+  /// @brief Writes a jump to addr at the target, swapping veneers as needed. The reference to the veneer the target
+  /// branched through before is moved to replaced_veneer (empty if there was none), since a thread may still be inside
+  /// of it, so the caller releases it (see ReleaseVeneer) once it is safe to.
+  /// Returns false (writing nothing) if addr is out of range of a single B, and either the target is too small for a
+  /// far jump and no veneer within range could be found, or the jump would clobber a register that may be live (see
+  /// scratch_reg).
+  [[nodiscard]] bool WriteJump(void* addr, PointerWrapper<uint32_t>& replaced_veneer);
 
  private:
   void WriteCallback(ProtectionWriter<uint32_t>& writer, uint32_t const* target);
 };
 
+/// @brief What the peephole pass of PerformFixupsAndCallback removed from a set of fixups, compared to relocating every
+/// instruction on its own.
+struct PeepholeStats {
+  /// @brief The number of instructions no longer emitted, counted as the relocations of target instructions (and the
+  /// callback) would have been emitted without the pass. Relocations are dropped either because nothing could reach
+  /// them or because they were a B to the instruction after them.
+  uint16_t removed_insts;
+  /// @brief The number of branches retargeted past a B they used to branch to
+  uint16_t threaded_branches;
+  /// @brief The number of bytes of code and data saved
+  uint16_t saved_bytes;
+};
+
 struct Fixups {
   /// @brief The number of instructions to typically use for normal fixups
   constexpr static auto kNormalFixupInstCount = 4U;
+  /// @brief The number of instructions to patch when a single B can reach the first hook, directly or through a
+  /// veneer (see AcquireVeneer)
+  constexpr static auto kNearFixupInstCount = 1U;
+  /// @brief The maximum number of target instructions PerformFixupsAndCallback can relocate, and so the largest
+  /// function that can be relocated whole (see relocated_insts)
+  constexpr static auto kMaxFixupInstCount = 32U;
   // The location to read as input for fixup writes
   ShimTarget target;
   // The location to write fixups to
   PointerWrapper<uint32_t> fixup_inst_destination;
+  /// @brief The location to write literals to for DataLayout::kSeparate, which must be within ADRP range (+-4GB) of
+  /// fixup_inst_destination. If empty, literals are written inline after the fixups instead.
+  PointerWrapper<uint32_t> fixup_data_destination{ std::span<uint32_t>{}, PageProtectionType::kNone };
   std::vector<uint32_t> original_instructions{};
+  /// @brief The number of instructions from the start of the target that PerformFixupsAndCallback relocates, if it
+  /// relocates a whole function rather than just the patch at target. Such fixups end wherever the function does, and
+  /// never return into the target. 0 to relocate just the patch.
+  uint16_t relocated_insts{ 0 };
+  /// @brief The number of instructions of the function from the start of the target, if known, which bounds how far
+  /// past the relocated instructions PerformFixupsAndCallback looks for registers that are dead (see
+  /// arm64::FindScratchRegister), so that far jumps need not clobber x17. 0 if unknown.
+  uint16_t function_insts{ 0 };
+  /// @brief What the peephole pass removed, as of the last PerformFixupsAndCallback.
+  PeepholeStats peephole_stats{};
+
+  /// @brief Returns the largest fixup_data_destination (in bytes) that PerformFixupsAndCallback can need to relocate
+  /// num_insts instructions. Each instruction (and the callback) loads at most a single 128b literal, which may need up
+  /// to 12 bytes of padding to align it.
+  constexpr static uint_fast16_t MaxDataSize(uint_fast16_t num_insts) {
+    return (num_insts + 1) * 7 * sizeof(uint32_t);
+  }
+
+  /// @brief The number of bytes written to fixup_inst_destination and fixup_data_destination.
+  struct Size {
+    uint_fast16_t code;
+    uint_fast16_t data;
+  };
+  /// @brief Returns the number of bytes PerformFixupsAndCallback needs to relocate target into a fixup_inst_destination
+  /// aligned to 16 bytes, with separate data if separate_data is true.
+  /// This is exact if nothing target references is in range of the fixups and function_insts is unset, and an upper
+  /// bound otherwise.
+  static Size SizeFor(std::span<uint32_t const> target, bool separate_data) {
+    return SizeFor(target, target.data(), separate_data);
+  }
+  /// @brief Returns the number of bytes PerformFixupsAndCallback needs to relocate the instructions target, as if they
+  /// were located at target_pc.
+  static Size SizeFor(std::span<uint32_t const> target, void const* target_pc, bool separate_data);
+  /// @brief Returns the number of bytes PerformFixupsAndCallback needs to relocate this target from its
+  /// original_instructions, which may be larger than what is allocated if the target was rewritten since then.
+  [[nodiscard]] Size RequiredSize() const {
+    return SizeFor(RelocatedInstructions(), target.addr.data(), !fixup_data_destination.addr.empty());
+  }
+  /// @brief Returns the original_instructions that PerformFixupsAndCallback relocates: those of the patch, or those of
+  /// the whole function if relocated_insts is set.
+  [[nodiscard]] std::span<uint32_t const> RelocatedInstructions() const {
+    return std::span<uint32_t const>(original_instructions)
+        .first(relocated_insts != 0 ? relocated_insts : target.addr.size());
+  }
+  /// @brief Returns true if fixup_inst_destination and fixup_data_destination are large enough for
+  /// PerformFixupsAndCallback.
+  [[nodiscard]] bool Fits() const {
+    auto const size = RequiredSize();
+    return size.code <= fixup_inst_destination.addr.size_bytes() &&
+           size.data <= fixup_data_destination.addr.size_bytes();
+  }
 
-  /// @brief Copies over the original instructions from target to the original_instructions set.
+  /// @brief Copies over the original instructions from target to the original_instructions set, continuing past the
+  /// patch for as many as relocated_insts.
   /// Required before calling PerformFixupsAndCallback, and generally required for uninstallable hooks.
+  /// PerformFixupsAndCallback relocates original_instructions rather than the target, so it may be called again once
+  /// the target is patched.
   void CopyOriginalInsts();
 
   /// @brief Logs various information about the fixups.
@@ -81,7 +291,8 @@ struct Fixups {
   // For each instruction listed, fixes it up
   void PerformFixupsAndCallback();
   /// @brief Uninstalls the fixups for this target, rewriting the original instructions back to the target.
-  /// TODO: Eventually this will also clear the allocation at fixup_inst_destination, but for now, we will leak it.
+  /// Does not free fixup_inst_destination, fixup_data_destination or target.veneer. The installer deallocates the
+  /// former two and releases its reference to the pooled veneer (see ReleaseVeneer) once the target is restored.
   void Uninstall();
 };
 
@@ -1,5 +1,6 @@
 #pragma once
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <utility>
@@ -119,8 +120,10 @@ struct HookInfo {
                  std::move(priority),
                  InstallationMetadata{ .need_orig = orig_ptr != nullptr, .is_midpoint = false, .write_prot = false }) {}
 
+  /// @brief Points the orig of this hook at ptr. The store is atomic (and a release), so that a thread calling orig
+  /// concurrently either sees the old orig or the new one, after everything written to ptr beforehand.
   void assign_orig(void* ptr) {
-    if (orig_ptr != nullptr) *orig_ptr = ptr;
+    if (orig_ptr != nullptr) std::atomic_ref<void*>(*orig_ptr).store(ptr, std::memory_order_release);
   }
 
   void* target;
@@ -5,6 +5,7 @@
 #include <string_view>
 #include <utility>
 #include <variant>
+#include <vector>
 
 #include "calling-convention.hpp"
 #include "hook-metadata.hpp"
@@ -77,6 +78,11 @@ struct TargetTooSmall : HookErrorInfo {
   uint_fast16_t actual_num_insts;
   uint_fast16_t needed_num_insts;
 };
+/// @brief An error when the target of a midpoint hook is out of range of a single B, and no register is provably dead
+/// there for a far jump (or a veneer) to clobber.
+struct TargetNoScratchRegister : HookErrorInfo {
+  TargetNoScratchRegister(HookMetadata const& m) : HookErrorInfo(m.name_info) {}
+};
 /// @brief An error when the target method is impossible to install given its priorities and other hooks to install it
 /// onto.
 struct TargetBadPriorities : HookErrorInfo {
@@ -135,10 +141,20 @@ using TargetMismatch = std::variant<MismatchTargetConv, MismatchMidpoint>;
 #endif
 
 // Can be one of many cases.
-using Error = std::variant<TargetIsNull, TargetBadPriorities, TargetMismatch, TargetTooSmall>;
+using Error = std::variant<TargetIsNull, TargetBadPriorities, TargetMismatch, TargetTooSmall, TargetNoScratchRegister>;
 
 using Result = flamingo::Result<Ok, Error>;
 
+/// @brief An error from installing a batch of hooks, holding the error of the hook that failed and its index within
+/// the batch.
+struct BatchError {
+  size_t index;
+  Error error;
+};
+
+/// @brief Holds the result of installing every hook in a batch, in the same order as the batch.
+using BatchResult = flamingo::Result<std::vector<Ok>, BatchError>;
+
 }  // namespace installation
 
 }  // namespace flamingo
@@ -167,6 +183,10 @@ class fmt::formatter<flamingo::installation::Error> {
             return fmt::format_to(
                 ctx.out(), "Target too small, needed: {} instructions, but have: {} instructions for hook: {}",
                 small_target.needed_num_insts, small_target.actual_num_insts, small_target.installing_hook);
+          },
+          [&ctx](TargetNoScratchRegister const& no_scratch) {
+            return fmt::format_to(ctx.out(), "No dead register at midpoint to jump through, for hook: {}",
+                                  no_scratch.installing_hook);
           } },
         error);
   }
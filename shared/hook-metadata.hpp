@@ -18,6 +18,10 @@ struct InstallationMetadata {
   bool is_midpoint;
   /// @brief If write protection should be enabled for the target address (primarily for debugging to avoid issues with near pages)
   bool write_prot;
+  /// @brief If the target is a tiny leaf function (see arm64::IsRelocatableLeaf), relocate all of it for the orig,
+  /// rather than just the patch, so that calling the orig never branches back into the target. Only the first hook
+  /// installed at a target decides this, and its TargetMetadata records whether it was done.
+  bool relocate_whole_function{ false };
 };
 
 /// @brief Describes the name metadata of the hook, used for lookups and priorities.
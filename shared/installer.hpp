@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <span>
 #include <variant>
@@ -11,7 +12,6 @@
 namespace flamingo {
 
 constexpr static auto kHookAlignment = 16U;
-constexpr static auto kNumFixupsPerInst = 4U;
 
 /// @brief To install a hook, we require a constructed HookInfo. We want to hold exclusive ownership, so we require an
 /// rvalue (we may also forward params?). Because a HookInfo is just data, we go find our TargetInfo that matches our
@@ -19,8 +19,21 @@ constexpr static auto kNumFixupsPerInst = 4U;
 /// other HookInfo references within the list). We update the shared information within the HookInfo and perform the
 /// install as necessary. Priorities use named IDs for cleaer ordering (before x, after y). This may require a full
 /// reassmebly of the list!
+/// The method_num_insts of a hook is an upper bound on the patch: the function at the target is scanned up to its end
+/// (or a fixed limit, or the end of readable memory) for its end and for branches back into its start, and a hook that
+/// cannot be patched in without overwriting either fails with TargetTooSmall.
 [[nodiscard]] FLAMINGO_EXPORT installation::Result Install(HookInfo&& hook);
 
+/// @brief Installs a copy of every hook in hooks as a single transaction, leaving the span unchanged.
+/// Hooks are installed in order of target address within a single WriteBatch, so each page that is written to has its
+/// protection changed once, and the instruction cache is flushed once over merged ranges, regardless of the number of
+/// hooks.
+/// If any hook fails to install, every hook installed by this call is uninstalled (in reverse order), every target
+/// that was already hooked is recompiled back to the patch it had before (if a hook in the batch changed it), every
+/// orig in hooks is given back the value it had, and the error of the failing hook is returned alongside its index in
+/// hooks. Otherwise, returns the installation results in the same order as hooks.
+[[nodiscard]] FLAMINGO_EXPORT installation::BatchResult InstallBatch(std::span<HookInfo> hooks);
+
 /// @brief Called on a target to reinstall all targets present at that location.
 /// A reinstall is done by re-performing orig fixups at the target, and rewriting a jump to the first hook.
 /// All other hooks remain unchanged.
@@ -41,10 +54,20 @@ constexpr static auto kNumFixupsPerInst = 4U;
 /// After all that is done, the iterator is removed from the list of all hooks, and if empty, the entry from the targets
 /// map is destroyed. Note that this invalidates all other held HookHandles to the SAME entry. Other entries will not be
 /// invalidated.
+/// The fixups of a removed target are retired rather than freed, see ReclaimRetiredFixups.
 /// @returns Ok(true) if the target remains, Ok(false) if the full target was removed from the map, Error(false) if no
 /// target was found from this handle, Error(true) if a remapping failure happened.
 [[nodiscard]] FLAMINGO_EXPORT Result<bool, bool> Uninstall(HookHandle handle);
 
+/// @brief Frees the fixups (along with their separate data and veneers) retired by Uninstall or replaced by a
+/// recompile, and the veneers a target no longer branches through since its jump was rewritten. These are held back
+/// from the allocator since a thread may still be executing them, or be about to call an orig that points to them.
+/// Freed memory is reused by later installs, so this must only be called once no thread can still be inside of (or
+/// about to enter) any fixups retired before this call, for example once every thread that may have called an orig of
+/// an uninstalled hook has returned from it. Until then, retired fixups stay allocated.
+/// Returns the number of retired fixups (or lone veneers) that were freed.
+FLAMINGO_EXPORT size_t ReclaimRetiredFixups();
+
 /// @brief Returns the original instructions for a specified target, if it is the start of a known hook.
 /// If the target is not hooked, returns an empty span.
 std::span<uint32_t> FLAMINGO_EXPORT OriginalInstsFor(TargetDescriptor target);
@@ -58,4 +81,8 @@ std::span<uint32_t> FLAMINGO_EXPORT OriginalInstsFor(TargetDescriptor target);
 [[nodiscard]] FLAMINGO_EXPORT Result<std::span<uint32_t const>, std::monostate> FixupPointerFor(
     TargetDescriptor target);
 
+/// @brief Returns what the peephole pass removed from the fixups for a provided TargetDescriptor, for debugging.
+/// If the target is not hooked, returns an error Result.
+[[nodiscard]] FLAMINGO_EXPORT Result<PeepholeStats, std::monostate> PeepholeStatsFor(TargetDescriptor target);
+
 }  // namespace flamingo
@@ -38,34 +38,122 @@ struct Page {
   }
 };
 
+/// @brief Returns the protection of the page containing ptr.
+/// Protections are cached per page: the first lookup of a page reads its protection from /proc/self/maps, after which
+/// it is kept up to date by ProtectPages. Returns kNone if the page is not mapped.
+PageProtectionType GetPageProtection(void const* ptr);
+/// @brief Protects every page overlapping [ptr, ptr + size) with the provided protection.
+/// Skips the mprotect entirely if all of those pages already have that protection. Aborts if mprotect fails.
+void ProtectPages(void const* ptr, size_t size, PageProtectionType protection);
+/// @brief Updates the cached protection of every page overlapping [ptr, ptr + size), for memory that was just mapped
+/// (or protected) outside of ProtectPages.
+void RecordPageProtection(void const* ptr, size_t size, PageProtectionType protection);
+/// @brief Drops the cached protection of every page overlapping [ptr, ptr + size). Must be called when such memory is
+/// unmapped or protected outside of ProtectPages, otherwise ProtectPages may skip an mprotect that was needed.
+void ForgetPageProtections(void const* ptr, size_t size);
+
+/// @brief Groups together all writes made while it is alive. Within a batch, a page made writable by BeginPageWrite
+/// (as ProtectionWriter does) stays writable until the outermost batch ends, at which point every page is restored to
+/// its original protection exactly once. Instruction cache flushes are likewise deferred, merged into as few ranges as
+/// possible, and performed once at the end of the outermost batch.
+/// Note that this means written code is not guaranteed to be visible (and pages may be writable and executable) until
+/// the batch ends. Batches may nest.
+struct FLAMINGO_EXPORT WriteBatch {
+  WriteBatch();
+  ~WriteBatch();
+  WriteBatch(WriteBatch const&) = delete;
+  WriteBatch& operator=(WriteBatch const&) = delete;
+};
+
+/// @brief Makes the provided page writable, returning the protection it should be restored to by EndPageWrite.
+PageProtectionType BeginPageWrite(uintptr_t page);
+/// @brief Restores a page made writable by BeginPageWrite, or defers doing so until the end of the current WriteBatch.
+void EndPageWrite(uintptr_t page, PageProtectionType original);
+/// @brief Flushes the instruction cache for [begin, end), or defers doing so until the end of the current WriteBatch.
+void FlushInstructionCache(void const* begin, void const* end);
+
 // Holds a pointer with a size and a protection.
 // Provides a way of protecting the memory at this pointer by page aligning
 template <class T>
 struct PointerWrapper {
   std::span<T> addr;
   PageProtectionType protection;
+  /// @brief If the memory at addr is dual mapped, a writable alias of addr[0]. Writes through this alias are visible at
+  /// addr without ever changing the protection of addr. nullptr if the memory is only mapped once.
+  T* writable{ nullptr };
 
-  PointerWrapper(std::span<T> addr, PageProtectionType prot) : addr(addr), protection(prot) {}
+  PointerWrapper(std::span<T> addr, PageProtectionType prot, T* writable = nullptr)
+      : addr(addr), protection(prot), writable(writable) {}
   PointerWrapper(PointerWrapper const&) = default;
+  PointerWrapper& operator=(PointerWrapper const&) = default;
+
+  /// @brief Returns true if this memory has a writable alias, and thus never needs to be protected for writes.
+  [[nodiscard]] bool IsDualMapped() const {
+    return writable != nullptr;
+  }
+  /// @brief Returns a pointer to addr[idx] that may be written through. For dual mapped memory this is within the
+  /// writable alias, otherwise it is addr[idx] itself (which must be protected as writable first).
+  T* WritableAt(size_t idx) const {
+    return writable != nullptr ? &writable[idx] : &addr[idx];
+  }
 
   void Protect() const {
-    // If we have nothing in the address, don't bother protecting
-    if (addr.empty()) return;
-    auto const page_aligned = Page::PageAlign(addr.data());
-    auto const page_offset = reinterpret_cast<uint64_t>(addr.data()) % Page::PageSize;
-    if (::mprotect(page_aligned, addr.size_bytes() + page_offset, static_cast<int>(protection)) != 0) {
-      // Log error on mprotect!
-      FLAMINGO_ABORT("Failed to mark ptr at: {} (page aligned: {}) with size: {} with permissions: {}. err: {}",
-                     fmt::ptr(addr.data()), fmt::ptr(page_aligned), page_offset + addr.size_bytes(),
-                     static_cast<int>(protection), std::strerror(errno));
-    }
+    ProtectPages(addr.data(), addr.size_bytes(), protection);
   }
   /// @brief Returns a subspan that is of the (potentially shrunken) size.
   PointerWrapper<T> Subspan(size_t n) const {
-    return PointerWrapper(addr.first(std::min(n, addr.size())), protection);
+    return PointerWrapper(addr.first(std::min(n, addr.size())), protection, writable);
   }
 };
 
+/// @brief The maximum distance (in bytes) between a near allocation and the address it was requested near.
+/// This is the range of a B instruction, less a few pages of slack so that any instruction within a page of the
+/// requested address can reach any instruction within the allocation (and vice versa).
+constexpr static int64_t kNearRange = (1LL << 27) - 4 * static_cast<int64_t>(Page::PageSize);
+
+/// @brief Allocates memory of the provided size and protection from anywhere in the address space.
+/// Allocations are rounded up to 16 bytes, so alignment must be at most 16. Size must be at most a Page.
+/// Executable, non-writable allocations are dual mapped (see PointerWrapper::writable) when the OS supports memfds,
+/// so that they can be written to without ever becoming writable and executable at the same time.
 PointerWrapper<uint32_t> Allocate(uint_fast16_t alignment, uint_fast16_t size, PageProtectionType protection);
 
+/// @brief Allocates memory that is within kNearRange of the provided near address, such that a single B instruction
+/// can reach the allocation from near. Existing pages are reused if they are close enough, otherwise free space is
+/// found via /proc/self/maps and reserved with mmap hints.
+/// If near is within a loaded module, the padding in the pages of its executable segments (outside of every segment)
+/// is used first, such that near allocations need not map any new pages at all. Such memory is never dual mapped.
+/// Returns a PointerWrapper with an empty span if no memory could be found in range.
+PointerWrapper<uint32_t> AllocateNear(void const* near, uint_fast16_t alignment, uint_fast16_t size,
+                                      PageProtectionType protection);
+
+/// @brief Returns an allocation made by Allocate or AllocateNear to the allocator, so that it may be reused.
+/// Freed blocks are coalesced with their neighbors, and pages are unmapped once nothing is allocated from them.
+/// The allocation must be passed exactly as it was returned. Empty allocations are ignored.
+void Deallocate(PointerWrapper<uint32_t> allocation);
+
+/// @brief A snapshot of the state of the allocator, all sizes are in bytes.
+struct AllocatorStats {
+  /// @brief The number of pages currently mapped by the allocator
+  size_t mapped_pages;
+  /// @brief Bytes currently handed out to callers
+  size_t live_bytes;
+  /// @brief Bytes that were freed and are available for reuse within mapped pages
+  size_t free_bytes;
+  /// @brief Bytes within mapped pages that have never been handed out
+  size_t unused_bytes;
+  /// @brief Bytes that have ever been freed
+  size_t total_freed_bytes;
+  /// @brief Pages that have ever been unmapped
+  size_t released_pages;
+  /// @brief The number of currently mapped pages that have a writable alias
+  size_t dual_mapped_pages;
+  /// @brief Bytes of padding within loaded modules that have been claimed for near allocations (see AllocateNear),
+  /// whether or not they are currently handed out. Pages containing such padding are not counted in mapped_pages,
+  /// though writing to one still makes a private (dirty) copy of it.
+  size_t code_cave_bytes;
+};
+
+/// @brief Returns the current allocator stats.
+AllocatorStats GetAllocatorStats();
+
 }  // namespace flamingo
@@ -20,6 +20,8 @@ struct TargetMetadata {
   CallingConvention convention;
   InstallationMetadata metadata;
   uint16_t method_num_insts;
+  /// @brief The largest patch that can be written at the target without covering the destination of a branch within it
+  uint16_t safe_patch_size;
 #ifndef FLAMINGO_NO_REGISTRATION_CHECKS
   std::vector<TypeInfo> parameter_info;
   TypeInfo return_info;
@@ -37,6 +39,23 @@ struct TargetData {
   TargetMetadata metadata;
   Fixups fixups;
   std::list<HookInfo> hooks{};
+
+  /// @brief Regenerates the fixups for a patch of patch_size instructions at the target, with or without an orig, and
+  /// rewrites the patch to match. The new fixups are written to a newly allocated block, unless the existing block was
+  /// never reachable (no orig was needed until now) and is large enough to be reused in place. Every orig in hooks is
+  /// re-pointed to match, ordered such that a concurrent call to an orig always runs either the old fixups or the new
+  /// ones against an intact target. The old fixups are retired (see ReclaimRetiredFixups), since a thread may have
+  /// loaded an orig that points to them before it was re-pointed.
+  /// Returns false (changing nothing) if a patch of a single instruction is requested, but it cannot reach the first
+  /// hook, even through a veneer.
+  bool Recompile(uint16_t patch_size, bool need_orig);
+  /// @brief Writes a jump to the first hook at the target. If the target is patched with a single B that cannot reach
+  /// it, even through a veneer, recompiles the target with a far jump instead.
+  /// Returns false (changing nothing) if the target is too small for a far jump.
+  bool JumpToFirstHook();
+  /// @brief Points the orig of every hook in hooks at the hook after it, and the orig of the last hook at the fixups
+  /// (or at a function that aborts, if no orig is needed).
+  void RelinkOrigs();
 };
 
 /// @brief A handle to an installed hook. Used for uninstalls.
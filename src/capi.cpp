@@ -60,6 +60,7 @@ FlamingoInstallationResult convert_install_result(flamingo::installation::Result
                    [](TargetBadPriorities const&) { return FLAMINGO_INSTALL_BAD_PRIORITIES; },
                    [](TargetMismatch const& mismatch) { return type_from_mismatch(mismatch); },
                    [](TargetTooSmall const&) { return FLAMINGO_INSTALL_TOO_SMALL; },
+                   [](TargetNoScratchRegister const&) { return FLAMINGO_INSTALL_NO_SCRATCH_REGISTER; },
                  },
                  error);
   return FlamingoInstallationResult{
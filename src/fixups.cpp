@@ -1,40 +1,23 @@
 #include "fixups.hpp"
+#include <fcntl.h>
 #include <fmt/core.h>
 #include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
-#include <list>
+#include <optional>
 #include <span>
-#include "capstone/capstone.h"
-#include "capstone/platform.h"
+#include <utility>
+#include "arm64-decoder.hpp"
 #if !defined(GIT_COMMIT) && __has_include("git_info.inc")
 #include "git_info.inc"
 #endif
 #include "util.hpp"
 
 namespace {
-auto get_branch_immediate(cs_insn const& inst) {
-  FLAMINGO_ASSERT(inst.detail->arm64.op_count == 1);
-  return inst.detail->arm64.operands[0].imm;
-}
-
-std::pair<uint8_t, int64_t> get_second_immediate(cs_insn const& inst) {
-  // register is just bottom 5 bits
-  constexpr uint32_t reg_mask = 0b11111;
-  FLAMINGO_ASSERT(inst.detail->arm64.op_count == 2);
-  return { *reinterpret_cast<uint32_t const*>(inst.bytes) & reg_mask, inst.detail->arm64.operands[1].imm };
-}
-
-std::pair<uint8_t, int64_t> get_last_immediate(cs_insn const& inst) {
-  // register is just bottom 5 bits
-  constexpr uint32_t reg_mask = 0b11111;
-  FLAMINGO_ASSERT(inst.detail->arm64.op_count >= 2);
-  return { *reinterpret_cast<uint32_t const*>(inst.bytes) & reg_mask,
-           inst.detail->arm64.operands[inst.detail->arm64.op_count - 1].imm };
-}
-
 constexpr int64_t get_untagged_pc(uint64_t pc) {
   // Upper byte is tagged for PC addresses on android 11+
   constexpr uint64_t mask = ~(0xFFULL << (64U - 8U));
@@ -44,457 +27,892 @@ int64_t get_untagged_pc(void const* pc) {
   return get_untagged_pc(reinterpret_cast<uint64_t>(pc));
 }
 
-// Helper types for holding immediate masks, lshifts and rshifts for conversions to immediates from PC differences
-template <arm64_insn>
-struct BranchImmTypeTrait;
+flamingo::PatchMode patch_mode = flamingo::PatchMode::kProtect;
+flamingo::DataLayout data_layout = flamingo::DataLayout::kInline;
+// Lazily opened on the first write, -1 if not yet opened
+int proc_mem_fd = -1;
+bool proc_mem_unavailable = false;
+// Every live veneer, each shared by all of the targets that jump to the same destination through it
+struct PooledVeneer {
+  flamingo::PointerWrapper<uint32_t> veneer;
+  int64_t destination;
+  uint32_t references;
+};
+std::vector<PooledVeneer> veneer_pool;
 
-template <arm64_insn type>
-  requires(type == ARM64_INS_B || type == ARM64_INS_BL)
-struct BranchImmTypeTrait<type> {
-  constexpr static uint32_t imm_mask = 0b00000011111111111111111111111111U;
-  constexpr static uint32_t lshift = 0;
-  constexpr static uint32_t rshift = 2;
+constexpr uint32_t reg_mask = 0b11111U;
+constexpr uint32_t imm26_mask = 0b00000011111111111111111111111111U;
+constexpr uint32_t imm19_mask = 0b00000000111111111111111111100000U;
+constexpr uint32_t imm14_mask = 0b00000000000001111111111111100000U;
+constexpr uint32_t b_opcode = 0b00010100000000000000000000000000U;
+constexpr uint32_t bl_opcode = 0b10010100000000000000000000000000U;
+// https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/LDR--literal---Load-Register--literal--
+constexpr uint32_t ldr_x_literal = 0b01011000000000000000000000000000U;
+// BR Xn and BLR Xn, with Rn at bit 5
+constexpr uint32_t br_opcode = 0xD61F0000U;
+constexpr uint32_t blr_opcode = 0xD63F0000U;
+// STR x17, [sp, #-16]!
+constexpr uint32_t push_x17 = 0xF81F0FF1U;
+// LDR x17, [sp], #16
+constexpr uint32_t pop_x17 = 0xF84107F1U;
+
+/// @brief A vector with a fixed inline capacity, so that per-fixup bookkeeping never touches the heap.
+template <class T, size_t N>
+struct InlineVector {
+  std::array<T, N> storage{};
+  size_t count{ 0 };
+
+  T& push_back(T const& value) {
+    if (count >= N) {
+      FLAMINGO_ABORT("InlineVector is full! Capacity: {}", N);
+    }
+    storage[count] = value;
+    return storage[count++];
+  }
+  void clear() {
+    count = 0;
+  }
+  [[nodiscard]] size_t size() const {
+    return count;
+  }
+  T& operator[](size_t idx) {
+    FLAMINGO_ASSERT(idx < count);
+    return storage[idx];
+  }
+  T const& operator[](size_t idx) const {
+    FLAMINGO_ASSERT(idx < count);
+    return storage[idx];
+  }
+  T* begin() {
+    return storage.data();
+  }
+  T* end() {
+    return storage.data() + count;
+  }
+  T const* begin() const {
+    return storage.data();
+  }
+  T const* end() const {
+    return storage.data() + count;
+  }
 };
 
-template <arm64_insn type>
-  requires(type == ARM64_INS_CBZ || type == ARM64_INS_CBNZ)
-struct BranchImmTypeTrait<type> {
-  constexpr static uint32_t imm_mask = 0b00000000111111111111111111100000;
-  constexpr static uint32_t lshift = 5;
-  constexpr static uint32_t rshift = 2;
+/// @brief What the immediate of an Op is computed from.
+enum struct SymbolKind : uint8_t {
+  /// @brief An absolute address outside of the fixups
+  kAbsolute,
+  /// @brief The first fixup of the target instruction at the index value
+  kLabel,
+  /// @brief Wherever the literal at the index value is laid out
+  kLiteral,
 };
 
-template <arm64_insn type>
-  requires(type == ARM64_INS_TBZ || type == ARM64_INS_TBNZ)
-struct BranchImmTypeTrait<type> {
-  constexpr static uint32_t imm_mask = 0b00000000000001111111111111100000;
-  constexpr static uint32_t lshift = 5;
-  constexpr static uint32_t rshift = 2;
+struct Symbol {
+  SymbolKind kind;
+  int64_t value;
 };
 
-/// @brief Helper function that returns an encoded b for a particular offset
-consteval uint32_t get_b(int offset) {
-  constexpr uint32_t b_opcode = 0b00010100000000000000000000000000U;
-  return (b_opcode | (static_cast<uint32_t>(offset) >> 2U));
+/// @brief How the immediate of an Op is encoded, once the address of its symbol is known.
+enum struct Reloc : uint8_t {
+  /// @brief The instruction is written verbatim
+  kNone,
+  /// @brief B/BL imm26, +-128MB
+  kImm26,
+  /// @brief B.cond, CBZ and literal load imm19, +-1MB
+  kImm19,
+  /// @brief TBZ imm14, +-32KB
+  kImm14,
+  /// @brief ADR of the symbol, +-1MB
+  kAdr,
+  /// @brief ADRP of the page of the symbol, +-4GB
+  kAdrp,
+  /// @brief The literal load is rewritten to load from [base, #offset of the symbol within its page]
+  kPageOffset,
+};
+
+/// @brief A single instruction of the IR, whose immediate is left symbolic until the layout is known.
+struct Op {
+  uint32_t inst;
+  Reloc reloc;
+  /// @brief The base register, for Reloc::kPageOffset
+  uint8_t base;
+  Symbol symbol;
+};
+
+/// @brief Returns an Op that is written verbatim.
+constexpr Op Verbatim(uint32_t inst) {
+  return { .inst = inst, .reloc = Reloc::kNone, .base = 0, .symbol = { SymbolKind::kAbsolute, 0 } };
 }
 
-constexpr uint32_t ldr_imm_mask = 0b111111111111111111100000U;
-
-struct ImmediateReferenceTag {
-  /// @brief The immediate mask to use when rewriting the instruction
-  uint32_t imm_mask;
-  /// @brief The amount to shift the immediate to the left to encode it correctly such that the mask would be valid
-  uint_fast16_t lshift;
-  /// @brief The amount to shift the immediate to the right to encode it correctly such that the mask would be valid
-  uint_fast16_t rshift;
-  /// @brief Index of the fixup index with the immediate to be overwritten
-  uint_fast16_t fixup_index;
-  /// @brief Index into the resultant data section to resolve to
-  uint_fast16_t data_index;
+/// @brief How control leaves a Node, for the peephole pass.
+enum struct Flow : uint8_t {
+  /// @brief Always continues on to the next node
+  kNext,
+  /// @brief Either continues on to the next node or branches to the destination (conditional branches and BL)
+  kBranch,
+  /// @brief Always branches to the destination (B)
+  kJump,
+  /// @brief Never continues on to the next node, nor branches anywhere within the fixups (RET, BR, UDF, etc.)
+  kExit,
+};
+
+/// @brief A single way of relocating an instruction. The largest is a far SIMD literal load from separate data: a spill
+/// of x17, an ADRP + LDR of the literal's address, the load itself and a reload of x17.
+using Form = InlineVector<Op, 5>;
+
+/// @brief A target instruction (or the callback), lowered to every form it may be relocated as, from smallest to
+/// largest.
+struct Node {
+  InlineVector<Form, 4> forms{};
+  /// @brief The index of the form that is currently chosen. Relaxation only ever increases this.
+  uint_fast8_t choice{ 0 };
+  /// @brief The index of the first word of the chosen form within the fixups, for the current layout.
+  uint_fast16_t offset{ 0 };
+  /// @brief How control leaves the target instruction this node relocates
+  Flow flow{ Flow::kNext };
+  /// @brief Where a kBranch or kJump node branches to
+  Symbol destination{ SymbolKind::kAbsolute, 0 };
+
+  [[nodiscard]] Form const& Chosen() const {
+    return forms[choice];
+  }
 };
-struct BranchReferenceTag {
-  /// @brief The immediate mask to use when rewriting the instruction
-  uint32_t imm_mask;
-  /// @brief The amount to shift the immediate to the left to encode it correctly such that the mask would be valid
-  uint32_t lshift;
-  /// @brief The amount to shift the immediate to the right to encode it correctly such that the mask would be valid
-  uint32_t rshift;
-  /// @brief Index to overwrite
-  uint32_t target_index;
+
+/// @brief A literal that one or more forms load, which is only laid out while one of those forms is chosen.
+struct Literal {
+  std::array<uint32_t, 4> words;
+  uint_fast8_t size;
+
+  [[nodiscard]] std::span<uint32_t const> Words() const {
+    return std::span<uint32_t const>(words.data(), size);
+  }
 };
+
 struct DataEntry {
   /// @brief The data to hold in this entry
   uint32_t data;
   /// @brief The alignment (in multiples of 4 bytes) that we should perform for this entry
   uint_fast8_t alignment;
-  /// @brief The actual index into the data section this data entry maps to.
-  /// This is only assigned to AFTER all data entries have been added.
+  /// @brief For inline data, the index of this entry past the end of the code once padding is inserted.
   uint32_t actual_idx{};
 };
+
 // Holds the context for performing fixups that we don't want to expose to the caller.
+// Fixups are generated in three phases:
+// 1. Lowering: every target instruction (and the callback) becomes a Node, holding every form it could be relocated as.
+// Each form is a sequence of Ops, whose immediates reference symbols (absolute addresses, other target instructions, or
+// literals) rather than offsets.
+// 2. Relaxation: every Node starts at its smallest form. We lay everything out, move every Node with an Op that cannot
+// reach its symbol on to its next form, and repeat until everything is in range. Nodes only ever grow, so this always
+// terminates, and no Node is ever larger than the layout requires.
+// 3. Emission: with every address known, each Op is encoded exactly once, followed by the data.
+// All bookkeeping is held inline, bounded by the maximum number of target instructions, so generating a trampoline does
+// not allocate.
 struct FixupContext {
-  // The initial target pointer
+  constexpr static auto kMaxInsts = flamingo::Fixups::kMaxFixupInstCount;
+  // Every instruction (and the callback) needs at most a single 128b data entry, plus padding to align it
+  constexpr static auto kMaxDataEntries = flamingo::Fixups::MaxDataSize(kMaxInsts) / sizeof(uint32_t);
+  // Every instruction needs at most 5 instructions (a far SIMD literal load from separate data), the callback needs at
+  // most 3, and inline data follows on after
+  constexpr static auto kMaxCodeInsts = kMaxInsts * 5 + 3 + kMaxDataEntries;
+  // Every node (target instruction or callback) may load one literal as lowered, and one more once the peephole pass
+  // threads it
+  constexpr static auto kMaxLiterals = 2 * (kMaxInsts + 1);
+  // Branches between target instructions keep their original encoding, which is only possible because even the
+  // shortest of them (TBZ) can reach anywhere within the largest possible fixups.
+  static_assert(kMaxCodeInsts * sizeof(uint32_t) < (1U << 15));
+  // At most this many instructions past the target are considered when looking for dead registers
+  constexpr static size_t kMaxFollowingInsts = kMaxInsts;
+  // The instructions to relocate, which are the original instructions of the target (which may already be patched)
   std::span<uint32_t const> target;
+  // The target, followed by as many of the instructions after it in the same function as are known, which is where
+  // execution continues once it leaves the fixups, and so what decides which registers are dead (see DeadRegisterAt).
+  std::array<uint32_t, kMaxInsts + kMaxFollowingInsts> flow_insts{};
+  size_t flow_size{ 0 };
   flamingo::ProtectionWriter<uint32_t> fixup_writer;
-  // Holds sequentially laid out data for usage within fixups
-  std::vector<DataEntry> data_block{};
-  uint_fast16_t data_index = 0;
-  // Holds a collection of data elements, which describes which fixups to perform overwrites of after data is allocated
-  std::vector<ImmediateReferenceTag> data_ref_tags{};
-  // Holds a mapping from fixup index to a list of branches targeting that location
-  std::vector<std::list<BranchReferenceTag>> branch_ref_map{};
-  // Holds the mapping of target index to fixup index for branch references
-  // TODO: Technically, we need to see if ANY branch target would leave us in ANY fixup block...
-  // TODO: Should collect a set of references so that if we ever install a hook over somewhere we would jump to we would
-  // force a recompile. We should check against the full set of all fixups for this.
-  std::vector<uint32_t> target_to_fixups{};
+  // Where data is written to, if it is separate from our fixups. Empty if data is inline.
+  flamingo::ProtectionWriter<uint32_t> data_writer;
+  // One node per target instruction, followed by one for the callback
+  InlineVector<Node, kMaxInsts + 1> nodes{};
+  // Every literal any form may load
+  InlineVector<Literal, kMaxLiterals> literals{};
+  // For the current layout, the address of every literal loaded by a chosen form
+  std::array<int64_t, kMaxLiterals> literal_addresses{};
+  // Holds sequentially laid out data for usage within fixups, for the current layout
+  InlineVector<DataEntry, kMaxDataEntries> data_block{};
+  // The number of code words in the current layout, which inline data follows
+  uint_fast16_t code_size{ 0 };
   // The raw address of the target start/end as an untagged PC address
   uint64_t target_start;
   uint64_t target_end;
+  // The untagged PC of the first fixup and of the first word of separate data. These are where the writers write to,
+  // except when sizing, where we write to scratch memory as if it were placed elsewhere.
+  int64_t fixup_pc;
+  int64_t data_pc;
+  // What the peephole pass removed
+  flamingo::PeepholeStats stats{};
 
-  FixupContext(flamingo::PointerWrapper<uint32_t> fixup_ptr, std::span<uint32_t const> target)
+  FixupContext(flamingo::PointerWrapper<uint32_t> fixup_ptr, flamingo::PointerWrapper<uint32_t> data_ptr,
+               std::span<uint32_t const> target, void const* target_pc, std::span<uint32_t const> following)
+      : FixupContext(fixup_ptr, data_ptr, target, target_pc, get_untagged_pc(fixup_ptr.addr.data()),
+                     get_untagged_pc(data_ptr.addr.data()), following) {}
+  FixupContext(flamingo::PointerWrapper<uint32_t> fixup_ptr, flamingo::PointerWrapper<uint32_t> data_ptr,
+               std::span<uint32_t const> target, void const* target_pc, int64_t fixup_pc, int64_t data_pc,
+               std::span<uint32_t const> following = {})
       : target(target),
         fixup_writer(fixup_ptr),
-        target_start(get_untagged_pc(target.data())),
-        target_end(get_untagged_pc(&target[target.size()])) {
-    target_to_fixups.resize(target.size());
-    branch_ref_map.resize(target.size());
-    // based off of the size of the fixups, we allocate accordingly.
-    // TODO: This is an overestimate (each fixup needs a uint64_t)
-    data_block.reserve(target.size() * 2);
-    data_ref_tags.reserve(target.size());
+        data_writer(data_ptr),
+        target_start(get_untagged_pc(target_pc)),
+        target_end(target_start + target.size() * sizeof(uint32_t)),
+        fixup_pc(fixup_pc),
+        data_pc(data_pc) {
+    if (target.size() > kMaxInsts) {
+      FLAMINGO_ABORT("Cannot perform fixups for: {} instructions, at most: {} are supported", target.size(), kMaxInsts);
+    }
+    following = following.first(std::min(following.size(), kMaxFollowingInsts));
+    std::copy(target.begin(), target.end(), flow_insts.begin());
+    std::copy(following.begin(), following.end(), flow_insts.begin() + target.size());
+    flow_size = target.size() + following.size();
   }
 
-  auto GetFixupPC() const {
-    return get_untagged_pc(&fixup_writer.target.addr[fixup_writer.target_offset]);
+  // Returns the PC of the provided fixup index.
+  int64_t PcAt(size_t fixup_idx) const {
+    return fixup_pc + static_cast<int64_t>(fixup_idx * sizeof(uint32_t));
+  }
+  [[nodiscard]] bool SeparateData() const {
+    return !data_writer.target.addr.empty();
+  }
+  // Returns the address of the provided index into separate data.
+  int64_t DataAddress(size_t data_index) const {
+    return data_pc + static_cast<int64_t>(data_index * sizeof(uint32_t));
   }
 
-  auto Write(uint32_t inst) {
-    return fixup_writer.Write(inst);
+  // Returns a register that is provably dead once execution continues from the target instruction at index idx (which
+  // may be past the end of the target), if any, so that it may be clobbered on the way there.
+  [[nodiscard]] std::optional<uint8_t> DeadRegisterAt(size_t idx) const {
+    if (idx >= flow_size) return std::nullopt;
+    auto const insts = std::span<uint32_t const>(flow_insts.data(), flow_size).subspan(idx);
+    return flamingo::arm64::FindScratchRegister(insts,
+                                                static_cast<int64_t>(target_start + idx * sizeof(uint32_t)));
   }
-  void WriteData(uint_fast16_t fixup_idx, uint32_t data, uint32_t imm_mask, uint_fast16_t lshift,
-                 uint_fast16_t rshift) {
-    FLAMINGO_ASSERT(fixup_idx < fixup_writer.target_offset);
-    uint_fast16_t data_index = data_block.size();
-    // Pointer is known to be little endian
-    FLAMINGO_DEBUG("Adding 32b data: 0x{:x} at data index: {} for fixup index: {} ({})", data, data_index, fixup_idx,
-                   fmt::ptr(&fixup_writer.target.addr[fixup_idx]));
-    data_block.push_back({ .data = data, .alignment = 1 });
-    data_ref_tags.emplace_back(ImmediateReferenceTag{
-      .imm_mask = imm_mask,
-      .lshift = lshift,
-      .rshift = rshift,
-      .fixup_index = fixup_idx,
-      .data_index = data_index,
-    });
-  }
-  // When we call WriteData, we are using the previously written fixup as our fixup index. This means, however, that we
-  // must have written at least one fixup already.
-  void WriteData(uint_fast16_t fixup_idx, uint64_t large_data, uint32_t imm_mask, uint_fast16_t lshift,
-                 uint_fast16_t rshift) {
-    FLAMINGO_ASSERT(fixup_idx < fixup_writer.target_offset);
-    uint_fast16_t data_index = data_block.size();
+  // Returns the register a jump to destination loads it into: one that is dead at destination if destination is known,
+  // otherwise x17, as it always was.
+  [[nodiscard]] uint8_t ScratchFor(int64_t destination) const {
+    auto const offset = destination - static_cast<int64_t>(target_start);
+    constexpr auto fallback = flamingo::arm64::kDefaultScratchReg;
+    if (offset < 0 || offset % sizeof(uint32_t) != 0) return fallback;
+    return DeadRegisterAt(static_cast<size_t>(offset) / sizeof(uint32_t)).value_or(fallback);
+  }
+
+  // Adds words (in order) to the data section, aligned to the size of words (which must be a power of two), and returns
+  // the data index of the first. If the same words were already added with at least the same alignment, the existing
+  // entry is shared instead.
+  size_t AddData(std::span<uint32_t const> words) {
+    FLAMINGO_ASSERT(!words.empty());
+    auto data_index = FindData(words);
+    if (data_index < data_block.size()) {
+      return data_index;
+    }
+    if (SeparateData()) {
+      // Separate data is laid out as it is added (from a 16b aligned start), so pad it to alignment now
+      while (data_block.size() % words.size() != 0) {
+        data_block.push_back({ .data = 0, .alignment = 1 });
+      }
+      data_index = data_block.size();
+    }
+    // Only the first entry needs aligning, the rest follow on directly
+    data_block.push_back({ .data = words[0], .alignment = static_cast<uint_fast8_t>(words.size()) });
+    for (auto const word : words.subspan(1)) {
+      data_block.push_back({ .data = word, .alignment = 1 });
+    }
+    return data_index;
+  }
+  // Returns the index of an existing data entry holding words that is at least as aligned as words needs to be, or the
+  // size of the data block if there is none.
+  size_t FindData(std::span<uint32_t const> words) const {
+    for (size_t i = 0; i + words.size() <= data_block.size(); i++) {
+      if (data_block[i].alignment < words.size()) continue;
+      auto const matches = std::equal(words.begin(), words.end(), data_block.begin() + i,
+                                      [](uint32_t word, DataEntry const& entry) { return word == entry.data; });
+      if (matches) return i;
+    }
+    return data_block.size();
+  }
+
+  // Returns the address of the provided symbol in the current layout.
+  int64_t AddressOf(Symbol const& symbol) const {
+    switch (symbol.kind) {
+      case SymbolKind::kAbsolute:
+        return symbol.value;
+      case SymbolKind::kLabel:
+        return PcAt(nodes[symbol.value].offset);
+      case SymbolKind::kLiteral:
+        return literal_addresses[symbol.value];
+    }
+    return 0;
+  }
+  // Returns true if the op, placed at pc, can encode the address of its symbol in the current layout.
+  bool InRange(Op const& op, int64_t pc) const {
+    auto const address = AddressOf(op.symbol);
+    switch (op.reloc) {
+      case Reloc::kNone:
+      case Reloc::kPageOffset:
+        return true;
+      case Reloc::kImm26:
+        return flamingo::arm64::BranchInRange(pc, address);
+      case Reloc::kImm19:
+        // Conditional branches share the range of literal loads
+        return flamingo::arm64::LiteralInRange(pc, address);
+      case Reloc::kImm14:
+        return address - pc >= -(1LL << 15) && address - pc < (1LL << 15);
+      case Reloc::kAdr:
+        return flamingo::arm64::AdrInRange(pc, address);
+      case Reloc::kAdrp:
+        return flamingo::arm64::AdrpInRange(pc, address);
+    }
+    return false;
+  }
+  // Returns the encoding of the op placed at pc, for the current layout. The op must be in range.
+  uint32_t Encode(Op const& op, int64_t pc) const {
+    auto const address = AddressOf(op.symbol);
+    auto const delta = static_cast<uint32_t>(address - pc);
+    switch (op.reloc) {
+      case Reloc::kNone:
+        return op.inst;
+      case Reloc::kImm26:
+        return (op.inst & ~imm26_mask) | ((delta >> 2) & imm26_mask);
+      case Reloc::kImm19:
+        return flamingo::arm64::EncodeImm19(op.inst, pc, address);
+      case Reloc::kImm14:
+        return (op.inst & ~imm14_mask) | (((delta >> 2) << 5) & imm14_mask);
+      case Reloc::kAdr:
+        return flamingo::arm64::EncodeAdr(static_cast<uint8_t>(op.inst & reg_mask), pc, address);
+      case Reloc::kAdrp:
+        return flamingo::arm64::EncodeAdrp(static_cast<uint8_t>(op.inst & reg_mask), pc, address);
+      case Reloc::kPageOffset: {
+        constexpr int64_t page_offset_mask = 0xFFF;
+        return flamingo::arm64::EncodeLoadFromBase(op.inst, op.base, static_cast<uint32_t>(address & page_offset_mask));
+      }
+    }
+    return op.inst;
+  }
+
+  // Adds a literal holding words, returning the symbol that refers to it.
+  Symbol AddLiteral(std::span<uint32_t const> words) {
+    Literal literal{ .words = {}, .size = static_cast<uint_fast8_t>(words.size()) };
+    std::copy(words.begin(), words.end(), literal.words.begin());
+    literals.push_back(literal);
+    return { SymbolKind::kLiteral, static_cast<int64_t>(literals.size() - 1) };
+  }
+  Symbol AddLiteral(int64_t value) {
     // Pointer is known to be little endian
-    FLAMINGO_DEBUG("Adding 64b data: 0x{:x} at data index: {} for fixup index: {} ({})", large_data, data_index,
-                   fixup_idx, fmt::ptr(&fixup_writer.target.addr[fixup_idx]));
-    // The first entry is aligned 64, the second entry has 32b alignment.
-    data_block.push_back({ .data = static_cast<uint32_t>(large_data & (UINT32_MAX)), .alignment = 2 });
-    data_block.push_back({ .data = static_cast<uint32_t>((large_data >> 32) & UINT32_MAX), .alignment = 1 });
-    data_ref_tags.emplace_back(ImmediateReferenceTag{
-      .imm_mask = imm_mask,
-      .lshift = lshift,
-      .rshift = rshift,
-      .fixup_index = fixup_idx,
-      .data_index = data_index,
-    });
-  }
-  void WriteLdrWithData(int64_t data, uint_fast8_t reg) {
-    // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/LDR--literal---Load-Register--literal--
-    // imm is encoded as << 2, LSB just to the right of reg
-    constexpr uint32_t ldr_mask = 0b01011000000000000000000000000000U;
-    constexpr uint32_t reg_mask = 0b11111;
-    auto ldr_idx = Write(ldr_mask | (reg_mask & reg));
-    WriteData(ldr_idx, static_cast<uint64_t>(data), ldr_imm_mask, 5, 2);
-  }
-  void WriteLdrBrData(int64_t target) {
-    // LDR x17, DATA OFFSET FOR BRANCH TARGET
-    WriteLdrWithData(target, 17);
-    // BR x17
-    constexpr uint32_t br_x17 = 0xD61F0220U;
-    Write(br_x17);
-  }
-  void WriteCallback(uint32_t const* target) {
-    constexpr uint32_t branch_imm_mask = 0b00000011111111111111111111111111U;
-    auto delta = get_untagged_pc(target) - GetFixupPC();
-    if (std::llabs(delta) > (branch_imm_mask << 1) + 1) {
-      // Too far for b. Emit a br instead.
-      WriteLdrBrData(get_untagged_pc(target));
-    } else {
-      // Small enough to emit a b.
-      // b opcode | encoded immediate (delta >> 2)
-      // Note, abs(delta >> 2) must be < (1 << 26)
-      constexpr uint32_t b_opcode = 0b00010100000000000000000000000000U;
-      Write(b_opcode | ((delta >> 2) & branch_imm_mask));
-    }
-  }
-  void WriteB(int64_t imm) {
-    // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/B--Branch-
-    WriteCallback(reinterpret_cast<uint32_t*>(imm));
-  }
-
-  void WriteBl(int64_t imm) {
-    // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/BL--Branch-with-Link-
-    constexpr uint32_t branch_imm_mask = 0b00000011111111111111111111111111U;
-    int64_t delta = imm - GetFixupPC();
-    if (std::llabs(delta) > (branch_imm_mask << 1) + 1) {
-      // Too far to emit a b. Emit a br instead.
-      // We CAN emit a blr here because the pc + 4 for return will no longer be in the data section.
-      // LDR X17, DATA OFFSET FOR BRANCH
-      WriteLdrWithData(imm, 17);
-      // BLR x17
-      constexpr uint32_t blr_x17 = 0xD63F0220U;
-      Write(blr_x17);
-    } else {
-      // Small enough to emit a b/bl.
-      // bl opcode | encoded immediate (delta >> 2)
-      // Note, abs(delta >> 2) must be < (1 << 26)
-      constexpr uint32_t bl_opcode = 0b10010100000000000000000000000000U;
-      Write(bl_opcode | ((delta >> 2) & branch_imm_mask));
-    }
-  }
-
-  void WriteAdr(uint8_t reg, int64_t imm) {
-    // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/ADR--Form-PC-relative-address-?lang=en
-    constexpr uint32_t adr_maximum_imm = 0b00000000000111111111111111111111U;
-    constexpr uint32_t reg_mask = 0b11111;
-    int64_t delta = imm - GetFixupPC();
-    if (std::llabs(delta) >= (adr_maximum_imm >> 1U)) {
-      // Too far to emit just an adr.
-      // LDR (used register), DATA OFSET FOR IMM
-      WriteLdrWithData(imm, reg);
-    } else {
-      // Close enough to emit an adr.
-      // Note that delta should be within +-1 MB
-      constexpr uint32_t adr_opcode = 0b00010000000000000000000000000000;
-      // Get immlo
-      uint32_t imm_lo = ((static_cast<uint32_t>(delta) & 3U) << 29);
-      // Get immhi
-      uint32_t imm_hi = (static_cast<uint32_t>(delta) >> 2U) << 5;
-      Write(adr_opcode | imm_lo | imm_hi | (reg_mask & reg));
-    }
-  }
-
-  void WriteAdrp(uint8_t reg, int64_t imm) {
-    // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/ADR--Form-PC-relative-address-?lang=en
-    // constexpr uint32_t adr_maximum_imm = 0b00000000000111111111111111111111U;
-    constexpr uint32_t pc_imm_mask = ~0b111111111111U;
-    constexpr int64_t adrp_maximum_imm = 0xFFFFF000U;
-    int64_t delta = (GetFixupPC() & pc_imm_mask) - imm;
-
-    if (std::llabs(delta) < adrp_maximum_imm) {
-      // TODO: Note missed optimization opportunity
-      // TODO: Should perform a small ADRP
-      FLAMINGO_DEBUG("Potentially missed optimization opportunity for near ADRP, imm: {}, target pc: {}", imm,
-                     GetFixupPC());
-      // This optimization fails sometimes:
-      // Orig: D flamingo|v0.1.0: Addr: 0x7b6d100 Value: 0xb000eee0, adrp x0, #0x994a000
-      // Fixup: D flamingo|v0.1.0: Addr: 0x7fb68fd0903c Value: 0xf0431de0, adrp x0, #0x7fb7160c8000
-
-      // // Close enough to emit an adrp.
-      // // Note that delta should be within +-4 GB
-      // constexpr uint32_t adrp_opcode = 0b10010000000000000000000000000000U;
-      // constexpr uint32_t reg_mask = 0b11111;
-      // // Imm is << 12 in parse of instruction
-      // delta >>= 12;
-      // // Get immlo
-      // uint32_t imm_lo = ((static_cast<uint32_t>(delta) & 3) << 29);
-      // // Get immhi
-      // uint32_t imm_hi = (static_cast<uint32_t>(delta) >> 2) << 5;
-      // Write(adrp_opcode | imm_lo | imm_hi | (reg_mask & reg));
-    }
-    // Too far to emit just an adr.
-    // LDR (used register), DATA OFFSET FOR IMM
-    WriteLdrWithData(imm, reg);
-  }
-
-  void WriteLdr(uint32_t inst, uint8_t reg, int64_t imm) {
+    std::array<uint32_t, 2> const words{ static_cast<uint32_t>(static_cast<uint64_t>(value) & UINT32_MAX),
+                                         static_cast<uint32_t>((static_cast<uint64_t>(value) >> 32) & UINT32_MAX) };
+    return AddLiteral(words);
+  }
+  // Adds a form for each way of loading literal with load (a literal load into the general purpose register reg),
+  // between before and after. With separate data, the literal may be out of range of an LDR literal, so an ADRP + LDR
+  // pair through reg is also added.
+  void AddLoadForms(Node& node, uint32_t load, uint8_t reg, Symbol literal, std::span<Op const> before,
+                    std::span<Op const> after) {
+    auto const add_form = [&](std::initializer_list<Op> ops) {
+      auto& form = node.forms.push_back({});
+      for (auto const& op : before) form.push_back(op);
+      for (auto const& op : ops) form.push_back(op);
+      for (auto const& op : after) form.push_back(op);
+    };
+    add_form({ { .inst = load, .reloc = Reloc::kImm19, .base = 0, .symbol = literal } });
+    if (SeparateData()) {
+      add_form({ { .inst = reg, .reloc = Reloc::kAdrp, .base = 0, .symbol = literal },
+                 { .inst = load, .reloc = Reloc::kPageOffset, .base = reg, .symbol = literal } });
+    }
+  }
+  // Adds the forms of a B (or a BL if link) to destination: the instruction itself, otherwise an LDR + BR (or BLR) of
+  // a scratch register, after before. A call may clobber x17, but a jump clobbers a register that is dead at its
+  // destination, if one is known to be.
+  void AddJumpForms(Node& node, bool link, int64_t destination, std::span<Op const> before = {}) {
+    auto const scratch = link ? flamingo::arm64::kDefaultScratchReg : ScratchFor(destination);
+    auto& near = node.forms.push_back({});
+    for (auto const& op : before) near.push_back(op);
+    near.push_back({ .inst = link ? bl_opcode : b_opcode,
+                     .reloc = Reloc::kImm26,
+                     .base = 0,
+                     .symbol = { SymbolKind::kAbsolute, destination } });
+    // We CAN emit a blr here because the pc + 4 for return will no longer be in the data section.
+    std::array const after{ Verbatim((link ? blr_opcode : br_opcode) | (static_cast<uint32_t>(scratch) << 5)) };
+    AddLoadForms(node, ldr_x_literal | scratch, scratch, AddLiteral(destination), before, after);
+  }
+
+  // Lowers a conditional branch (B.cond, CBZ or TBZ) to an address outside of the target.
+  void LowerCondBranch(Node& node, uint32_t inst, Reloc reloc, int64_t destination) {
+    node.forms.push_back({}).push_back(
+        { .inst = inst, .reloc = reloc, .base = 0, .symbol = { SymbolKind::kAbsolute, destination } });
+    if (!flamingo::arm64::HasInvertibleCondition(inst)) {
+      // B.al/B.nv always branch, so they are just a B
+      AddJumpForms(node, false, destination);
+      return;
+    }
+    // Otherwise, invert the condition and have it skip over an unconditional jump to the destination.
+    auto const first_jump = node.forms.size();
+    std::array const before{ Verbatim(flamingo::arm64::InvertCondition(inst)) };
+    AddJumpForms(node, false, destination, before);
+    // Now that each jump is known, point the inverted branch just past it
+    auto const imm_mask = reloc == Reloc::kImm14 ? imm14_mask : imm19_mask;
+    for (auto i = first_jump; i < node.forms.size(); i++) {
+      auto& form = node.forms[i];
+      auto const skip = static_cast<uint32_t>(form.size() * sizeof(uint32_t));
+      form[0].inst = (form[0].inst & ~imm_mask) | (((skip >> 2) << 5) & imm_mask);
+    }
+  }
+  // Lowers a literal load (of any kind), the target instruction at index idx, of the literal at literal_address.
+  void LowerLiteralLoad(Node& node, size_t idx, uint32_t inst, flamingo::arm64::DecodedInst const& decoded) {
     // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/LDR--literal---Load-Register--literal--
-    // 20 bits because signed range is only allowed
-    constexpr int64_t max_ldr_range = (1LL << 20);
-    if ((inst & 0xFF000000U) == 0xD8000000U) {
-      // This is a prefetch instruction.
-      // Lets just skip it.
+    auto const size = flamingo::arm64::LiteralSize(inst);
+    auto const literal = decoded.target;
+    // Prefetches have no size, as they never read anything we would need to preserve
+    auto const overlaps_target = size != 0 && literal < static_cast<int64_t>(target_end) &&
+                                 literal + size > static_cast<int64_t>(target_start);
+    bool const simd = decoded.kind == flamingo::arm64::InstKind::kLdrSimdLiteral;
+    if (overlaps_target) {
+      // The literal lives within the instructions we are about to overwrite, so it will not survive the hook.
+      // Snapshot its current value into our data section and load from there instead, with the same instruction.
+      std::array<uint32_t, 4> words{};
+      std::memcpy(words.data(), reinterpret_cast<void const*>(literal), size);
+      // The target may already be patched, so whatever part of the literal lies within it comes from our instructions
+      auto const start = std::max(literal, static_cast<int64_t>(target_start));
+      auto const end = std::min(literal + static_cast<int64_t>(size), static_cast<int64_t>(target_end));
+      std::memcpy(reinterpret_cast<char*>(words.data()) + (start - literal),
+                  reinterpret_cast<char const*>(target.data()) + (start - static_cast<int64_t>(target_start)),
+                  end - start);
+      FLAMINGO_DEBUG("Snapshotting {} byte literal at: 0x{:x} within fixup range", size, literal);
+      auto const symbol = AddLiteral(std::span<uint32_t const>(words.data(), size / sizeof(uint32_t)));
+      if (!simd) {
+        AddLoadForms(node, inst, decoded.reg, symbol, {}, {});
+        return;
+      }
+      node.forms.push_back({}).push_back({ .inst = inst, .reloc = Reloc::kImm19, .base = 0, .symbol = symbol });
+      if (SeparateData()) {
+        // SIMD/FP loads have no general purpose register to hold the page, so borrow one that is dead after the load,
+        // or spill x17 around the load if none is
+        auto const dead = DeadRegisterAt(idx + 1);
+        auto const base = dead.value_or(flamingo::arm64::kDefaultScratchReg);
+        auto& far = node.forms.push_back({});
+        if (!dead.has_value()) far.push_back(Verbatim(push_x17));
+        far.push_back({ .inst = base, .reloc = Reloc::kAdrp, .base = 0, .symbol = symbol });
+        far.push_back({ .inst = inst, .reloc = Reloc::kPageOffset, .base = base, .symbol = symbol });
+        if (!dead.has_value()) far.push_back(Verbatim(pop_x17));
+      }
       return;
     }
-    int64_t delta = imm - GetFixupPC();
-    if (std::llabs(delta) < max_ldr_range) {
-      // TODO: Should perform a small LDR
-      // constexpr uint32_t reg_mask = 0b11111;
-      FLAMINGO_DEBUG("Potentially missed optimization opportunity for near LDR, imm: {} target pc: {}", imm,
-                     GetFixupPC());
-    }
-
-    // Too far to emit an equivalent LDR
-    // Fallback to performing a direct memory write/read
-    // LDR (used register), DATA OFFSET FOR IMM
-    // TODO: Instead of assuming int64_t data at imm, use the size_mask and swap accordingly
-    // 4, 8, 16(?) for our sizes
-    // constexpr uint32_t size_mask = 0x40000000U;
-    WriteLdrWithData(*reinterpret_cast<int64_t*>(imm), reg);
-  }
-  template <bool imm_19>
-  void WriteCondBranch(uint32_t instruction, int64_t imm) {
-    uint32_t imm_mask;
-    if constexpr (imm_19) {
-      // Imm 19
-      constexpr uint32_t imm_mask_19 = 0b00000000111111111111111111100000;
-      imm_mask = imm_mask_19;
-    } else {
-      // Imm 14
-      constexpr uint32_t imm_mask_14 = 0b00000000000001111111111111100000;
-      imm_mask = imm_mask_14;
-    }
-    int64_t delta = imm - GetFixupPC();
-    // imm_mask >> 1 for maximum positive value
-    // << 2 because branch imms are << 2
-    // >> 5 because the mask is too high
-    if (std::llabs(delta) < (imm_mask >> 4)) {
-      // Small enough to optimize, just write the instruction
-      // But with the modified offset
-      // Delta should be >> 2 for branch imm
-      // Then << 5 to be in the correct location
-      Write((instruction & ~imm_mask) | (static_cast<uint32_t>((delta >> 2) << 5) & imm_mask));
+    // Close enough to load the literal directly, just re-encode the offset
+    node.forms.push_back({}).push_back(
+        { .inst = inst, .reloc = Reloc::kImm19, .base = 0, .symbol = { SymbolKind::kAbsolute, literal } });
+    if (decoded.kind == flamingo::arm64::InstKind::kLdrLiteral ||
+        decoded.kind == flamingo::arm64::InstKind::kLdrswLiteral) {
+      // Too far to load the literal directly, load its address and then load through it, so that we always read the
+      // live value.
+      std::array const after{ Verbatim(flamingo::arm64::EncodeLoadFromBase(inst, decoded.reg)) };
+      AddLoadForms(node, ldr_x_literal | decoded.reg, decoded.reg, AddLiteral(literal), {}, after);
+    } else if (auto const dead = DeadRegisterAt(idx + 1)) {
+      // SIMD/FP loads and prefetches have no general purpose register of their own to hold the address, so borrow one
+      // that is dead after the load.
+      std::array const after{ Verbatim(flamingo::arm64::EncodeLoadFromBase(inst, *dead)) };
+      AddLoadForms(node, ldr_x_literal | *dead, *dead, AddLiteral(literal), {}, after);
     } else {
-      // Otherwise, we need to write the same expression but with a known offset
-      // Specifically, write the instruction but with an offset of 8 (to skip the B we write later in this function)
-      // 2, because 8 >> 2 is 2
-      // << 5 to place in correct location for immediate
-      Write((instruction & ~imm_mask) | ((2 << 5) & imm_mask));
-      // 0xC to skip over: LDR x17, BR x17
-      // TODO: Instead of hardcoding the b and forcing an ldr + br data entry, for near immediates, we can ecode them
-      // closer
-
-      Write(get_b(0xC));
-      WriteLdrBrData(imm);
-    }
-  }
-
-  template <arm64_insn type>
-  bool TryDeferBranch(uint16_t i, int64_t dst, uint32_t inst) {
-    // If it is a branch, check to see if the target immediate would place us within our fixup range
-    // If so, we need to:
-    // - If the target is behind us, use the new target directly
-    // - If the target is in front of us, defer the write until later.
-    // We defer the write by basically writing the branch itself (since it must be a close branch)
-    // and then add its index (and its immediate mask and shift amount) to some set.
-    // Then, when we start the fixup for an instruction, we check the set to see if we should go back and fix the
-    // specified indices. To fix them, we simply walk all of the indices we wish to fix, and for each:
-    // - Current PC of instruction - &target[index] to replace
-    // - Use as argument for shift + mask?
-
-    // If we are within OUR fixup range, that's when things get interesting.
-    // TODO: If we are in SOME OTHER TRAMPOLINE'S fixup range, then we should use their call
-    using trait_t = BranchImmTypeTrait<type>;
-    constexpr uint32_t imm_mask = trait_t::imm_mask;
-    constexpr uint32_t lshift = trait_t::lshift;
-    constexpr uint32_t rshift = trait_t::rshift;
-    if (dst < static_cast<int64_t>(target_end) && dst >= static_cast<int64_t>(target_start)) {
-      FLAMINGO_DEBUG("Potentially deferring branch at: 0x{:x} because it is within: 0x{:x} and 0x{:x}", dst,
-                     target_start, target_end);
-      auto target_offset = (dst - target_start) / sizeof(uint32_t);
-      FLAMINGO_ASSERT(target_offset < target_to_fixups.size());
-      FLAMINGO_ASSERT(target_offset < branch_ref_map.size());
-      // Always emit the instruction with AN immediate that is valid.
-      // For forward references, we need to defer.
-      // This difference could be negative, but for those cases we will defer and overwrite.
-      auto fixup_difference = static_cast<uint32_t>(
-          get_untagged_pc(reinterpret_cast<uint64_t>(&fixup_writer.target.addr[fixup_writer.target_offset])) -
-          get_untagged_pc(reinterpret_cast<uint64_t>(&fixup_writer.target.addr[target_to_fixups[target_offset]])));
-      Write((inst & ~imm_mask) | ((fixup_difference >> rshift) << lshift));
-      if (target_offset > i) {
-        FLAMINGO_DEBUG("Deferring at: {} with target offset: 0x{:x}", i, target_offset);
-        // Need to defer.
-        // Deference SHOULD never cause the instruction being deferred to expand in size.
-        // It should always be possible to point the deferred instruction to the new one without emitting more
-        // instructions
-        branch_ref_map[target_offset].emplace_back(BranchReferenceTag{
-          .imm_mask = imm_mask,
-          .lshift = lshift,
-          .rshift = rshift,
-          .target_index = i,
-        });
-      }
-      return true;
+      // Without a register that is provably dead after the load, we cannot assume any is in the middle of a function,
+      // so spill x17 around the load.
+      std::array const before{ Verbatim(push_x17) };
+      std::array const after{ Verbatim(flamingo::arm64::EncodeLoadFromBase(inst, 17)), Verbatim(pop_x17) };
+      AddLoadForms(node, ldr_x_literal | 17U, 17, AddLiteral(literal), before, after);
+    }
+  }
+  // Returns true if any target instruction references the target instruction at index idx, most notably by branching
+  // to it.
+  [[nodiscard]] bool IsReferenced(size_t idx) const {
+    auto const address = static_cast<int64_t>(target_start + idx * sizeof(uint32_t));
+    for (size_t i = 0; i < target.size(); i++) {
+      auto const decoded =
+          flamingo::arm64::Decode(target[i], static_cast<int64_t>(target_start + i * sizeof(uint32_t)));
+      if (decoded.kind != flamingo::arm64::InstKind::kOther && decoded.target == address) return true;
     }
     return false;
   }
-  void PerformFixupFor(cs_insn const& inst, int i, uint32_t const* const current_inst_ptr) {
-    // Set the target map entry for this incoming instruction to the current offset of the output
-    target_to_fixups[i] = fixup_writer.target_offset;
-    switch (inst.id) {
-      // Handle fixups for branch immediate
-      case ARM64_INS_B: {
-        FLAMINGO_DEBUG("Fixing up B...");
-        auto dst = get_branch_immediate(inst);
-        if (!TryDeferBranch<ARM64_INS_B>(i, dst, *current_inst_ptr)) {
-          if (inst.detail->arm64.cc != ARM64_CC_INVALID) {
-            WriteCondBranch<true>(*current_inst_ptr, dst);
-          } else {
-            WriteB(dst);
-          }
-        }
-      } break;
-      case ARM64_INS_BL: {
-        FLAMINGO_DEBUG("Fixing up BL...");
-        auto dst = get_branch_immediate(inst);
-        if (!TryDeferBranch<ARM64_INS_BL>(i, dst, *current_inst_ptr)) {
-          WriteBl(dst);
+  // Returns how the target instruction after the one at index i consumes the page it forms, if the one at i is an ADRP
+  // that can be fused with it. Nothing may reference the second of the pair, or skipping the ADRP would be observable.
+  [[nodiscard]] std::optional<flamingo::arm64::PageOffsetUse> FusedUse(size_t i) const {
+    if (i + 1 >= target.size() || flamingo::arm64::Classify(target[i]) != flamingo::arm64::InstKind::kAdrp) {
+      return std::nullopt;
+    }
+    auto const use = flamingo::arm64::DecodePageOffsetUse(target[i + 1], static_cast<uint8_t>(target[i] & reg_mask));
+    if (!use.has_value() || IsReferenced(i + 1)) return std::nullopt;
+    return use;
+  }
+  // Lowers an ADRP along with the instruction after it that consumes the page (see FusedUse), preferring a single
+  // PC-relative operation on the final address over the pair.
+  void LowerFusedAdrp(Node& node, flamingo::arm64::DecodedInst const& adrp, uint32_t next,
+                      flamingo::arm64::PageOffsetUse use) {
+    auto const address = adrp.target + use.offset;
+    FLAMINGO_DEBUG("Fusing ADRP of x{} with: 0x{:x} into a reference to: 0x{:x}", adrp.reg, next, address);
+    auto const add_pair = [&] {
+      auto& pair = node.forms.push_back({});
+      pair.push_back(
+          { .inst = adrp.reg, .reloc = Reloc::kAdrp, .base = 0, .symbol = { SymbolKind::kAbsolute, adrp.target } });
+      pair.push_back(Verbatim(next));
+    };
+    if (use.literal_load == 0) {
+      // An ADR of the address, then the pair itself, then a literal holding the address
+      node.forms.push_back({}).push_back(
+          { .inst = adrp.reg, .reloc = Reloc::kAdr, .base = 0, .symbol = { SymbolKind::kAbsolute, address } });
+      add_pair();
+      AddLoadForms(node, ldr_x_literal | adrp.reg, adrp.reg, AddLiteral(address), {}, {});
+      return;
+    }
+    // A literal load straight from the address, then the pair itself, then a literal holding the address to load
+    // through, so that we always read the live value
+    node.forms.push_back({}).push_back(
+        { .inst = use.literal_load, .reloc = Reloc::kImm19, .base = 0, .symbol = { SymbolKind::kAbsolute, address } });
+    add_pair();
+    std::array const after{ Verbatim(flamingo::arm64::EncodeLoadFromBase(use.literal_load, adrp.reg)) };
+    AddLoadForms(node, ldr_x_literal | adrp.reg, adrp.reg, AddLiteral(address), {}, after);
+  }
+  // Lowers the target instruction at index i.
+  void LowerInstruction(Node& node, uint_fast16_t i) {
+    using flamingo::arm64::InstKind;
+    auto const inst = target[i];
+    auto const current_pc = static_cast<int64_t>(target_start + i * sizeof(uint32_t));
+    auto const decoded = flamingo::arm64::Decode(inst, current_pc);
+    FLAMINGO_DEBUG("Lowering inst: 0x{:x} at 0x{:x}: {}", inst, current_pc, flamingo::arm64::KindName(decoded.kind));
+    if (i > 0 && FusedUse(i - 1).has_value()) {
+      // Already lowered along with the ADRP before it
+      node.forms.push_back({});
+      return;
+    }
+    auto const dst = decoded.target;
+    Reloc branch_reloc = Reloc::kNone;
+    switch (decoded.kind) {
+      case InstKind::kB:
+      case InstKind::kBl:
+        branch_reloc = Reloc::kImm26;
+        break;
+      case InstKind::kBCond:
+      case InstKind::kCbz:
+        branch_reloc = Reloc::kImm19;
+        break;
+      case InstKind::kTbz:
+        branch_reloc = Reloc::kImm14;
+        break;
+      default:
+        break;
+    }
+    if (branch_reloc != Reloc::kNone && dst >= static_cast<int64_t>(target_start) &&
+        dst < static_cast<int64_t>(target_end)) {
+      // A branch to another target instruction branches to its fixups instead, with the same instruction
+      // TODO: If we are in SOME OTHER TRAMPOLINE'S fixup range, then we should use their call
+      auto const target_offset = (dst - static_cast<int64_t>(target_start)) / sizeof(uint32_t);
+      FLAMINGO_DEBUG("Branch at: {} refers to target index: {}", i, target_offset);
+      node.flow = decoded.kind == InstKind::kB ? Flow::kJump : Flow::kBranch;
+      node.destination = { SymbolKind::kLabel, static_cast<int64_t>(target_offset) };
+      node.forms.push_back({}).push_back({ .inst = inst,
+                                           .reloc = branch_reloc,
+                                           .base = 0,
+                                           .symbol = { SymbolKind::kLabel, static_cast<int64_t>(target_offset) } });
+      return;
+    }
+    if (branch_reloc != Reloc::kNone) {
+      node.flow = flamingo::arm64::IsTerminator(inst) ? Flow::kJump : Flow::kBranch;
+      node.destination = { SymbolKind::kAbsolute, dst };
+    }
+    switch (decoded.kind) {
+      case InstKind::kB:
+        AddJumpForms(node, false, dst);
+        break;
+      case InstKind::kBl:
+        AddJumpForms(node, true, dst);
+        break;
+      case InstKind::kBCond:
+      case InstKind::kCbz:
+      case InstKind::kTbz:
+        LowerCondBranch(node, inst, branch_reloc, dst);
+        break;
+      case InstKind::kLdrLiteral:
+      case InstKind::kLdrSimdLiteral:
+      case InstKind::kLdrswLiteral:
+      case InstKind::kPrfmLiteral:
+        LowerLiteralLoad(node, i, inst, decoded);
+        break;
+      case InstKind::kAdr:
+        // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/ADR--Form-PC-relative-address-?lang=en
+        node.forms.push_back({}).push_back(
+            { .inst = decoded.reg, .reloc = Reloc::kAdr, .base = 0, .symbol = { SymbolKind::kAbsolute, dst } });
+        AddLoadForms(node, ldr_x_literal | decoded.reg, decoded.reg, AddLiteral(dst), {}, {});
+        break;
+      case InstKind::kAdrp:
+        if (auto const use = FusedUse(i)) {
+          LowerFusedAdrp(node, decoded, target[i + 1], *use);
+          break;
         }
-      } break;
-
-      // Handle fixups for conditional branches
-      case ARM64_INS_CBNZ:
-      case ARM64_INS_CBZ: {
-        FLAMINGO_DEBUG("Fixing up CBNZ/CBZ...");
-        auto [reg, dst] = get_last_immediate(inst);
-        if (!TryDeferBranch<ARM64_INS_CBNZ>(i, dst, *current_inst_ptr)) {
-          WriteCondBranch<true>(*current_inst_ptr, dst);
+        // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/ADRP--Form-PC-relative-address-to-4KB-page-
+        node.forms.push_back({}).push_back(
+            { .inst = decoded.reg, .reloc = Reloc::kAdrp, .base = 0, .symbol = { SymbolKind::kAbsolute, dst } });
+        AddLoadForms(node, ldr_x_literal | decoded.reg, decoded.reg, AddLiteral(dst), {}, {});
+        break;
+      case InstKind::kOther:
+        node.flow = flamingo::arm64::IsTerminator(inst) ? Flow::kExit : Flow::kNext;
+        node.forms.push_back({}).push_back(Verbatim(inst));
+        break;
+    }
+  }
+  // Lowers every target instruction, and then the callback to the end of the target.
+  void Lower() {
+    for (uint_fast16_t i = 0; i < target.size(); i++) {
+      LowerInstruction(nodes.push_back({}), i);
+    }
+    auto& callback = nodes.push_back({});
+    callback.flow = Flow::kJump;
+    callback.destination = { SymbolKind::kAbsolute, static_cast<int64_t>(target_end) };
+    AddJumpForms(callback, false, static_cast<int64_t>(target_end));
+  }
+
+  // Follows the chain of unconditional branches starting at the target instruction at label, returning where it ends:
+  // the last label in the chain, and (if the chain ends by leaving the fixups) the absolute address it leaves to.
+  std::pair<int64_t, std::optional<int64_t>> FollowJumps(int64_t label) const {
+    // A chain longer than every node is a loop, in which case we stop anywhere along it
+    for (size_t steps = 0; steps < nodes.size(); steps++) {
+      auto const& node = nodes[label];
+      if (node.flow != Flow::kJump) break;
+      if (node.destination.kind != SymbolKind::kLabel) return { label, node.destination.value };
+      label = node.destination.value;
+    }
+    return { label, std::nullopt };
+  }
+  // Rewrites the lowered fixups to skip work that can never matter:
+  // - Branches to a B are threaded to the end of the chain of Bs. A B or BL may leave the fixups directly, but other
+  // branches are only threaded as far as the last B within the fixups, so that they keep their original encoding.
+  // - Nodes that nothing reaches from the first are dropped. Most notably, this is the callback after a RET or B.
+  // - A B to the next node that was not dropped is dropped, since it just falls through.
+  // Literals are only ever laid out while a chosen form loads them, so those that only dropped nodes loaded go too.
+  void Optimize() {
+    std::array<bool, kMaxInsts + 1> threaded{};
+    for (size_t i = 0; i < nodes.size(); i++) {
+      auto& node = nodes[i];
+      if (node.destination.kind != SymbolKind::kLabel) continue;
+      auto const [label, exit] = FollowJumps(node.destination.value);
+      auto const& form = node.forms[0];
+      bool const unconditional_branch = form[0].reloc == Reloc::kImm26;
+      if (exit.has_value() && unconditional_branch) {
+        FLAMINGO_DEBUG("Threading branch to target index: {} out to: 0x{:x}", node.destination.value, *exit);
+        bool const link = node.flow == Flow::kBranch;
+        node.forms.clear();
+        node.destination = { SymbolKind::kAbsolute, *exit };
+        AddJumpForms(node, link, *exit);
+        threaded[i] = true;
+      } else if (label != node.destination.value) {
+        FLAMINGO_DEBUG("Threading branch to target index: {} to target index: {}", node.destination.value, label);
+        node.destination.value = label;
+        node.forms[0][0].symbol = node.destination;
+        threaded[i] = true;
+      }
+    }
+    // Walk everything reachable from the start of the fixups, which is the only place they are ever entered from
+    std::array<bool, kMaxInsts + 1> reachable{};
+    std::array<size_t, kMaxInsts + 1> worklist{};
+    size_t pending = 0;
+    auto const reach = [&](size_t idx) {
+      if (idx >= nodes.size() || reachable[idx]) return;
+      reachable[idx] = true;
+      worklist[pending++] = idx;
+    };
+    reach(0);
+    while (pending != 0) {
+      auto const idx = worklist[--pending];
+      auto const& node = nodes[idx];
+      if (node.flow == Flow::kNext || node.flow == Flow::kBranch) reach(idx + 1);
+      if ((node.flow == Flow::kBranch || node.flow == Flow::kJump) && node.destination.kind == SymbolKind::kLabel) {
+        reach(node.destination.value);
+      }
+    }
+    auto const drop = [&](Node& node) {
+      node.forms.clear();
+      node.forms.push_back({});
+      node.flow = Flow::kNext;
+      node.destination = { SymbolKind::kAbsolute, 0 };
+    };
+    for (size_t i = 0; i < nodes.size(); i++) {
+      // Branches that were threaded only to be dropped anyway do not count
+      if (reachable[i]) {
+        stats.threaded_branches += threaded[i] ? 1 : 0;
+        continue;
+      }
+      FLAMINGO_DEBUG("Dropping unreachable fixup for target index: {}", i);
+      drop(nodes[i]);
+    }
+    for (size_t i = 0; i < nodes.size(); i++) {
+      auto& node = nodes[i];
+      if (node.flow != Flow::kJump || node.destination.kind != SymbolKind::kLabel) continue;
+      auto const label = static_cast<size_t>(node.destination.value);
+      if (label <= i || !std::all_of(nodes.begin() + i + 1, nodes.begin() + label,
+                                     [](Node const& skipped) { return skipped.forms[0].size() == 0; })) {
+        continue;
+      }
+      FLAMINGO_DEBUG("Dropping branch at target index: {} to the next fixup", i);
+      drop(node);
+    }
+  }
+  // Returns the number of bytes the current layout takes up, including data.
+  [[nodiscard]] uint_fast16_t LayoutSize() const {
+    size_t words = code_size;
+    if (SeparateData()) {
+      words += data_block.size();
+    } else if (data_block.size() != 0) {
+      words += data_block[data_block.size() - 1].actual_idx + 1;
+    }
+    return static_cast<uint_fast16_t>(words * sizeof(uint32_t));
+  }
+
+  // Lays out the chosen form of every node, followed by the data those forms load.
+  void Layout() {
+    uint_fast16_t offset = 0;
+    for (auto& node : nodes) {
+      node.offset = offset;
+      offset += node.Chosen().size();
+    }
+    code_size = offset;
+    // Data is only laid out for the literals that are loaded, in the order they are first loaded
+    data_block.clear();
+    std::array<size_t, kMaxLiterals> data_indices{};
+    std::array<bool, kMaxLiterals> loaded{};
+    for (auto const& node : nodes) {
+      for (auto const& op : node.Chosen()) {
+        if (op.symbol.kind != SymbolKind::kLiteral || loaded[op.symbol.value]) continue;
+        loaded[op.symbol.value] = true;
+        data_indices[op.symbol.value] = AddData(literals[op.symbol.value].Words());
+      }
+    }
+    auto const data_base = PcAt(code_size);
+    if (!SeparateData()) {
+      // Inline data directly follows the code, padded such that each entry is aligned
+      uint32_t idx = 0;
+      for (auto& data : data_block) {
+        auto const align_bytes = static_cast<int64_t>(data.alignment * sizeof(uint32_t));
+        while ((data_base + idx * static_cast<int64_t>(sizeof(uint32_t))) % align_bytes != 0) {
+          idx++;
         }
-      } break;
-      case ARM64_INS_TBNZ:
-      case ARM64_INS_TBZ: {
-        FLAMINGO_DEBUG("Fixing up TBNZ/TBZ...");
-        auto [reg, dst] = get_last_immediate(inst);
-        if (!TryDeferBranch<ARM64_INS_TBNZ>(i, dst, *current_inst_ptr)) {
-          WriteCondBranch<false>(*current_inst_ptr, dst);
+        data.actual_idx = idx++;
+      }
+    }
+    for (size_t i = 0; i < literals.size(); i++) {
+      if (!loaded[i]) continue;
+      literal_addresses[i] =
+          SeparateData() ? DataAddress(data_indices[i])
+                         : data_base + static_cast<int64_t>(data_block[data_indices[i]].actual_idx * sizeof(uint32_t));
+    }
+  }
+  // Relaxes every node to the smallest form that is in range of everything it references.
+  void Relax() {
+    for (bool grew = true; grew;) {
+      Layout();
+      grew = false;
+      for (size_t i = 0; i < nodes.size(); i++) {
+        auto& node = nodes[i];
+        auto const& form = node.Chosen();
+        bool in_range = true;
+        for (size_t j = 0; j < form.size() && in_range; j++) {
+          in_range = InRange(form[j], PcAt(node.offset + j));
         }
-      } break;
-
-      // Handle fixups for load literals
-      case ARM64_INS_LDR: {
-        FLAMINGO_DEBUG("Fixing up LDR...");
-        // TODO: Handle the case where an LDR would land in a fixup range, so we need to copy the raw values
-        constexpr uint32_t b_31 = 0b10000000000000000000000000000000;
-        constexpr uint32_t ldr_lit_opc_mask = 0b10111111000000000000000000000000;
-        if ((*current_inst_ptr & ldr_lit_opc_mask) == 0b00011000000000000000000000000000) {
-          // This is an ldr literal
-          // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/LDR--literal---Load-Register--literal--
-          auto [reg, dst] = get_second_immediate(inst);
-          WriteLdr(*current_inst_ptr, reg, dst);
-        } else if ((*current_inst_ptr & (ldr_lit_opc_mask & ~b_31)) == 0b00011100000000000000000000000000) {
-          // This is an ldr literal, SIMD
-          // https://developer.arm.com/documentation/ddi0596/2021-12/SIMD-FP-Instructions/LDR--literal--SIMD-FP---Load-SIMD-FP-Register--PC-relative-literal--
-          FLAMINGO_ABORT("LDR of the SIMD variant is not yet supported!");
-        } else {
-          // This is an LDR that doesn't need to be fixed up
-          FLAMINGO_DEBUG("Fixing up standard LDR...");
-          Write(*reinterpret_cast<uint32_t const*>(inst.bytes));
+        if (in_range) continue;
+        if (node.choice + 1U >= node.forms.size()) {
+          FLAMINGO_ABORT("Fixup for target index: {} at: 0x{:x} is out of range of what it references in every form!",
+                         i, PcAt(node.offset));
         }
-      } break;
-      case ARM64_INS_LDRSW: {
-        // This is an ldrsw literal
-        // See TODOs for LDR
-        // https://developer.arm.com/documentation/ddi0596/2021-12/Base-Instructions/LDRSW--literal---Load-Register-Signed-Word--literal--
-        FLAMINGO_ABORT("LDRSW fixup not yet supported!");
-      } break;
-
-      // Handle pc-relative loads
-      case ARM64_INS_ADR: {
-        FLAMINGO_DEBUG("Fixing up ADR...");
-        auto [reg, dst] = get_second_immediate(inst);
-        WriteAdr(reg, dst);
-      } break;
-      case ARM64_INS_ADRP: {
-        FLAMINGO_DEBUG("Fixing up ADRP...");
-        auto [reg, dst] = get_second_immediate(inst);
-        WriteAdrp(reg, dst);
-      } break;
-
-      // Otherwise, just write the instruction verbatim
-      default:
-        FLAMINGO_DEBUG("Fixing up UNKNOWN: {}...", inst.id);
-        Write(*reinterpret_cast<uint32_t const*>(inst.bytes));
-        break;
+        FLAMINGO_DEBUG("Relaxing fixup for target index: {} to form: {}", i, node.choice + 1U);
+        node.choice++;
+        grew = true;
+      }
+    }
+  }
+
+  // Writes the fixups for every instruction of the target, followed by the callback and data.
+  void Emit() {
+    // The final layout should look something like:
+    // - Instructions...
+    // - Callback
+    // - Data section...
+    if (std::none_of(target.begin(), target.end(), flamingo::arm64::IsPcRelative)) {
+      FLAMINGO_DEBUG("No PC-relative instructions at: 0x{:x}, copying {} instructions", target_start, target.size());
+      LayoutCopy();
+      Write();
+      return;
+    }
+    Lower();
+    // Relax once without optimizing, both to measure what optimizing saves and to fall back on if it saves nothing.
+    // Threading a B out of the fixups can cost more than it saves, if the B it skips is still reachable.
+    Relax();
+    auto const unoptimized_size = LayoutSize();
+    auto const unoptimized = nodes;
+    for (auto& node : nodes) {
+      node.choice = 0;
+    }
+    Optimize();
+    Relax();
+    if (LayoutSize() > unoptimized_size) {
+      FLAMINGO_DEBUG("Peephole optimizations grew fixups for: 0x{:x} from: {} bytes to: {}, discarding them",
+                     target_start, unoptimized_size, LayoutSize());
+      nodes = unoptimized;
+      stats = {};
+      Layout();
+    } else {
+      // Whatever was dropped would have been laid out as its chosen form without optimizing
+      for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].Chosen().size() != 0) continue;
+        stats.removed_insts = static_cast<uint16_t>(stats.removed_insts + unoptimized[i].Chosen().size());
+      }
+    }
+    stats.saved_bytes = static_cast<uint16_t>(unoptimized_size - LayoutSize());
+    Write();
+  }
+  // Lays out a target without any PC-relative instructions, which needs none of lowering's decoding or the peephole
+  // pass: it is copied as is, followed by the callback. Only what the peephole pass would drop for such a target is
+  // dropped, which is everything past its first terminator (including the callback), as nothing can reach it.
+  void LayoutCopy() {
+    for (auto const inst : target) {
+      nodes.push_back({}).forms.push_back({}).push_back(Verbatim(inst));
+    }
+    AddJumpForms(nodes.push_back({}), false, static_cast<int64_t>(target_end));
+    Relax();
+    auto const terminator = std::find_if(target.begin(), target.end(), flamingo::arm64::IsTerminator);
+    if (terminator == target.end()) return;
+    auto const uncopied_size = LayoutSize();
+    for (auto i = static_cast<size_t>(terminator - target.begin()) + 1; i < nodes.size(); i++) {
+      auto& node = nodes[i];
+      stats.removed_insts = static_cast<uint16_t>(stats.removed_insts + node.Chosen().size());
+      node.forms.clear();
+      node.forms.push_back({});
+      node.choice = 0;
+    }
+    Layout();
+    stats.saved_bytes = static_cast<uint16_t>(uncopied_size - LayoutSize());
+  }
+  // Writes the current layout: the chosen form of every node, followed by the data.
+  void Write() {
+    for (auto const& node : nodes) {
+      auto const& form = node.Chosen();
+      for (size_t j = 0; j < form.size(); j++) {
+        fixup_writer.Write(Encode(form[j], PcAt(node.offset + j)));
+      }
+    }
+    FLAMINGO_ASSERT(fixup_writer.target_offset == code_size);
+    if (SeparateData()) {
+      for (auto const& data : data_block) {
+        data_writer.Write(data.data);
+      }
+      return;
+    }
+    for (auto const& data : data_block) {
+      // Need to write 0s to pad
+      while (fixup_writer.target_offset < code_size + data.actual_idx) {
+        fixup_writer.Write(0U);
+      }
+      fixup_writer.Write(data.data);
     }
   }
 };
@@ -502,6 +920,7 @@ struct FixupContext {
 
 namespace flamingo {
 
+#if __has_include(<capstone/capstone.h>)
 csh getHandle() {
   static csh handle = 0;
   static bool init = false;
@@ -530,29 +949,144 @@ cs_insn debugInst(uint32_t const* inst) {
   }
   return {};
 }
+#endif
+
+void SetDataLayout(DataLayout layout) {
+  data_layout = layout;
+}
 
-void ShimTarget::WriteJump(void* address) {
+DataLayout GetDataLayout() {
+  return data_layout;
+}
+
+void SetPatchMode(PatchMode mode) {
+  patch_mode = mode;
+}
+
+PatchMode GetPatchMode() {
+  return patch_mode;
+}
+
+bool WriteProcMem(void* dst, void const* src, size_t size) {
+  if (proc_mem_unavailable) return false;
+  if (proc_mem_fd < 0) {
+    proc_mem_fd = ::open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+    if (proc_mem_fd < 0) {
+      FLAMINGO_DEBUG("Failed to open /proc/self/mem, falling back to mprotect. err: {}", std::strerror(errno));
+      proc_mem_unavailable = true;
+      return false;
+    }
+  }
+  // /proc/self/mem is addressed by untagged virtual address
+  auto const written = ::pwrite(proc_mem_fd, src, size, static_cast<off_t>(get_untagged_pc(dst)));
+  if (written != static_cast<ssize_t>(size)) {
+    FLAMINGO_DEBUG("Failed to write {} bytes to: {} via /proc/self/mem (wrote: {}). err: {}", size, fmt::ptr(dst),
+                   written, std::strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+PointerWrapper<uint32_t> AcquireVeneer(void const* near, void const* destination) {
+  auto const near_pc = get_untagged_pc(near);
+  auto const destination_pc = get_untagged_pc(destination);
+  for (auto& pooled : veneer_pool) {
+    if (pooled.destination != destination_pc) continue;
+    if (!flamingo::arm64::BranchInRange(near_pc, get_untagged_pc(pooled.veneer.addr.data()))) continue;
+    pooled.references++;
+    FLAMINGO_DEBUG("Sharing veneer at: {} to: {} ({} references)", fmt::ptr(pooled.veneer.addr.data()),
+                   fmt::ptr(destination), pooled.references);
+    return pooled.veneer;
+  }
+  // Literals must be aligned to 8 bytes, which our 16 byte alignment guarantees for the data at veneer[2]
+  constexpr uint_fast16_t veneer_alignment = 16;
+  auto veneer = AllocateNear(near, veneer_alignment, ShimTarget::kStubInstCount * sizeof(uint32_t),
+                             PageProtectionType::kExecute | PageProtectionType::kRead);
+  if (veneer.addr.empty()) {
+    FLAMINGO_DEBUG("No space for a veneer in range of: {}", fmt::ptr(near));
+    return veneer;
+  }
+  {
+    ProtectionWriter<uint32_t> writer(veneer);
+    constexpr uint32_t ldr_x17 = 0x58000051U;
+    writer.Write(ldr_x17);
+    constexpr uint32_t br_x17 = 0xD61F0220U;
+    writer.Write(br_x17);
+    auto const large_data = reinterpret_cast<uint64_t>(destination);
+    writer.Write(static_cast<uint32_t>(large_data & UINT32_MAX));
+    writer.Write(static_cast<uint32_t>((large_data >> 32) & UINT32_MAX));
+  }
+  FlushInstructionCache(veneer.addr.data(), veneer.addr.data() + veneer.addr.size());
+  FLAMINGO_DEBUG("Allocated veneer at: {} to: {}", fmt::ptr(veneer.addr.data()), fmt::ptr(destination));
+  veneer_pool.push_back({ .veneer = veneer, .destination = destination_pc, .references = 1 });
+  return veneer;
+}
+
+void ReleaseVeneer(PointerWrapper<uint32_t> veneer) {
+  if (veneer.addr.empty()) return;
+  auto const pooled = std::find_if(veneer_pool.begin(), veneer_pool.end(), [&](PooledVeneer const& entry) {
+    return entry.veneer.addr.data() == veneer.addr.data();
+  });
+  if (pooled == veneer_pool.end()) {
+    FLAMINGO_ABORT("Cannot release: {} as it is not a veneer!", fmt::ptr(veneer.addr.data()));
+  }
+  if (--pooled->references != 0) return;
+  FLAMINGO_DEBUG("Freeing veneer at: {}", fmt::ptr(veneer.addr.data()));
+  Deallocate(pooled->veneer);
+  veneer_pool.erase(pooled);
+}
+
+size_t VeneerCount() {
+  return veneer_pool.size();
+}
+
+bool ShimTarget::CanJumpTo(void const* address) const {
   FLAMINGO_ASSERT(!addr.empty());
-  // TODO: We also want to correctly report if we were near! Because if so, then we DON'T actually need to fixup all N
-  // instructions, but only need to do 1. So, the return from this should be a number of instructions that we will
-  // DEFINITELY need to fixup for our actual fixups call (if we wish to create fixups)
+  if (flamingo::arm64::BranchInRange(get_untagged_pc(addr.data()), get_untagged_pc(address))) return true;
+  // Veneers always load into x17
+  return addr.size() < kStubInstCount ? scratch_reg == flamingo::arm64::kDefaultScratchReg
+                                      : scratch_reg != kNoScratchReg;
+}
 
-  // The writer for ensuring correct permissions and also performing the write
-  ProtectionWriter<uint32_t> writer(*this);
-  WriteCallback(writer, reinterpret_cast<uint32_t*>(address));
+bool ShimTarget::WriteJump(void* address, PointerWrapper<uint32_t>& replaced_veneer) {
+  FLAMINGO_ASSERT(!addr.empty());
+  if (!CanJumpTo(address)) {
+    FLAMINGO_DEBUG("Cannot jump from: {} to: {} without clobbering a register that may be live", fmt::ptr(addr.data()),
+                   fmt::ptr(address));
+    return false;
+  }
+  auto const in_range = flamingo::arm64::BranchInRange(get_untagged_pc(addr.data()), get_untagged_pc(address));
+  auto previous_veneer = std::exchange(veneer, { std::span<uint32_t>{}, PageProtectionType::kNone });
+  if (addr.size() < kStubInstCount && !in_range) {
+    // We only have room for a single B at our target, but our destination is too far away for one.
+    // Branch through a veneer instead. Acquiring before releasing keeps a veneer we already share alive.
+    veneer = AcquireVeneer(addr.data(), address);
+    if (veneer.addr.empty()) {
+      veneer = previous_veneer;
+      return false;
+    }
+    address = veneer.addr.data();
+  }
+  {
+    // The writer for ensuring correct permissions and also performing the write
+    ProtectionWriter<uint32_t> writer(*this);
+    WriteCallback(writer, reinterpret_cast<uint32_t*>(address));
+  }
+  FlushInstructionCache(addr.data(), addr.data() + addr.size());
+  // Nothing can newly branch to the previous veneer now, though a thread may still be inside of it, so it is up to the
+  // caller to decide when to release it.
+  replaced_veneer = previous_veneer;
+  return true;
 }
 
 void ShimTarget::WriteCallback(ProtectionWriter<uint32_t>& writer, uint32_t const* target) {
   constexpr uint32_t branch_imm_mask = 0b00000011111111111111111111111111U;
   auto delta = get_untagged_pc(target) - get_untagged_pc(&writer.target.addr[writer.target_offset]);
   if (std::llabs(delta) > (branch_imm_mask << 1) + 1) {
-    // Too far for b. Emit a br instead.
-    // TODO: Allow for different registers other than just x17
-    // Note: If we change it here, we will also need to change it in the fixups too.
-    constexpr uint32_t ldr_x17 = 0x58000051U;
-    writer.Write(ldr_x17);
-    constexpr uint32_t br_x17 = 0xD61F0220U;
-    writer.Write(br_x17);
+    // Too far for b. Emit an ldr + br of our scratch register instead, loading the target from just after the br.
+    constexpr uint32_t ldr_literal_8 = ldr_x_literal | (2U << 5);
+    writer.Write(ldr_literal_8 | scratch_reg);
+    writer.Write(br_opcode | (static_cast<uint32_t>(scratch_reg) << 5));
     // And write the target
     auto large_data = reinterpret_cast<uint64_t>(target);
     writer.Write(static_cast<uint32_t>(large_data & (UINT32_MAX)));
@@ -568,101 +1102,69 @@ void ShimTarget::WriteCallback(ProtectionWriter<uint32_t>& writer, uint32_t cons
 
 void Fixups::CopyOriginalInsts() {
   FLAMINGO_ASSERT(!target.addr.empty());
-  original_instructions.resize(target.addr.size());
-  std::copy(target.addr.begin(), target.addr.end(), original_instructions.begin());
+  FLAMINGO_ASSERT(relocated_insts == 0 || relocated_insts >= target.addr.size());
+  // The instructions of a whole function past the patch are never written to, so they are read straight from memory
+  auto const original =
+      std::span<uint32_t const>(target.addr.data(), std::max<size_t>(target.addr.size(), relocated_insts));
+  original_instructions.assign(original.begin(), original.end());
 }
 
 void Fixups::PerformFixupsAndCallback() {
   FLAMINGO_ASSERT(!target.addr.empty());
   FLAMINGO_ASSERT(!fixup_inst_destination.addr.empty());
   // As a precondition to this call, we must ensure we copied over the original instructions
-  FLAMINGO_ASSERT(original_instructions.size() >= target.addr.size());
+  FLAMINGO_ASSERT(original_instructions.size() >= std::max<size_t>(target.addr.size(), relocated_insts));
   // TODO: It is not thread safe to perform hooks on the same page as other threads!
   // This is because we could have a fixup writer complete on one thread after the other has started.
   // So, we want to lock on hook creation to ensure no one else is doing any type of hook creation, ideally.
 
   // Make the FixupContext instance that we will use for performing fixups
-  FixupContext context(fixup_inst_destination, target.addr);
-
-  // Now, for each instruction at target
-  // Fix it up, maybe add an entry to the data block, maybe add an entry to the branch remapping
-  // Then, after that, write our callback to target.addr
-  // Finally, iterate our data ref tags and branch tags and edit the written fixups
-  // Flush our icache and protection is restored by the ProtectionWriter instance getting dtor'd
-  // The final layout should look something like:
-  // - Instructions...
-  // - Callback
-  // - Data section...
+  // Relocate from our copy of the original instructions, since the target itself may already be patched
+  // Liveness may look past the relocated instructions into the rest of the function, which we never write to
+  auto const relocated = RelocatedInstructions();
+  auto const following =
+      function_insts > relocated.size()
+          ? std::span<uint32_t const>(target.addr.data() + relocated.size(), function_insts - relocated.size())
+          : std::span<uint32_t const>{};
+  FixupContext context(fixup_inst_destination, fixup_data_destination, relocated, target.addr.data(), following);
+  context.Emit();
+  peephole_stats = context.stats;
+  FLAMINGO_DEBUG("Peephole pass removed: {} instructions and threaded: {} branches, saving: {} bytes",
+                 peephole_stats.removed_insts, peephole_stats.threaded_branches, peephole_stats.saved_bytes);
+  // Commit our writes (if they were buffered) and then flush the icache for our fixups in case they were already cached
+  // from another hook call
+  context.fixup_writer.Flush();
+  context.data_writer.Flush();
+  FlushInstructionCache(&fixup_inst_destination.addr[0],
+                        &fixup_inst_destination.addr[fixup_inst_destination.addr.size()]);
+}
 
-  cs_insn* insns = nullptr;
-  [[maybe_unused]] auto count = cs_disasm(
-      flamingo::getHandle(), reinterpret_cast<uint8_t const*>(&target.addr[0]), target.addr.size_bytes(),
-      static_cast<uint64_t>(get_untagged_pc(reinterpret_cast<uint64_t>(&target.addr[0]))), target.addr.size(), &insns);
-  // We should never try to write fixups for something that isn't a valid instruction
-  // However, sometimes capstone isn't the latest version or whatever, so we don't assert here
-  // FLAMINGO_ASSERT(count == target.addr.size());
-
-  for (uint_fast16_t i = 0; i < target.addr.size(); i++) {
-    // For each input instruction, perform a fixup on it
-    auto const& inst = insns[i];
-    auto current_inst_ptr = &target.addr[i];
-    FLAMINGO_DEBUG("Fixup for inst: 0x{:x} at {}: {} {}, id: {}", *current_inst_ptr, fmt::ptr(current_inst_ptr),
-                   fmt::string_view(inst.mnemonic, sizeof(inst.mnemonic)),
-                   fmt::string_view(inst.op_str, sizeof(inst.op_str)), static_cast<int>(inst.id));
-    // For this incoming instruction, check to see if we have any forward references on this
-    // If we do, for each, rewrite the target instruction with the adjusted value
-    for (auto const& tag : context.branch_ref_map[i]) {
-      // Current PC is GetFixupPC()
-      // The instruction we emit's PC is the map from target --> fixup
-      // This difference is always positive, since we are jumping FORWARD
-      auto difference = static_cast<uint32_t>(context.GetFixupPC()) -
-                        get_untagged_pc(reinterpret_cast<uint64_t>(
-                            &fixup_inst_destination.addr[context.target_to_fixups[tag.target_index]]));
-      FLAMINGO_DEBUG("Performing deferred write at: {}, rewriting: {} with difference: {}", i, tag.target_index,
-                     difference);
-      fixup_inst_destination.addr[context.target_to_fixups[tag.target_index]] =
-          (fixup_inst_destination.addr[context.target_to_fixups[tag.target_index]] & ~tag.imm_mask) |
-          (tag.imm_mask & ((difference >> tag.rshift) << tag.lshift));
-    }
-    context.PerformFixupFor(inst, i, current_inst_ptr);
-  }
-
-  // Free the disassembled instructions from before the fixups
-  cs_free(insns, target.addr.size());
-  // Now, write the callback after all of our fixups.
-  context.WriteCallback(&target.addr[target.addr.size()]);
-  // After we have written ALL of our fixups initially AND our callback, perform our second pass where we inject
-  // immediate offsets. Most specifically, for data. To do this, we first start by laying out our data section directly,
-  // and marking the start address as "base". Then, we compute offsets based off of base + data_index * sizeof(uint32_t)
-  // - &fixups[fixup_idx]
-  auto data_base = context.GetFixupPC();
-  for (auto& data : context.data_block) {
-    // Check our location for alignment
-    auto const align_bytes = (data.alignment * sizeof(uint32_t));
-    auto misalignment = context.GetFixupPC() % align_bytes;
-    if (misalignment != 0) {
-      FLAMINGO_DEBUG("MISALIGNED ADDRESS: {:#x} ALIGNING TO: {} REQUIRES: {} BYTES", context.GetFixupPC(), align_bytes,
-                     (align_bytes - misalignment));
-      // Need to write 0s to pad
-      for (size_t i = 0; i < (align_bytes - misalignment); i += sizeof(uint32_t)) {
-        context.Write(0U);
-      }
-    }
-    data.actual_idx = (context.GetFixupPC() - data_base) / sizeof(uint32_t);
-    context.Write(data.data);
-  }
-  for (auto const& tag : context.data_ref_tags) {
-    auto const actual_data_idx = context.data_block[tag.data_index].actual_idx;
-    int_fast16_t offset = static_cast<int_fast16_t>(data_base + actual_data_idx * sizeof(uint32_t) -
-                                                    get_untagged_pc(&fixup_inst_destination.addr[tag.fixup_index]));
-    FLAMINGO_DEBUG("ACTUAL DATA INDEX: {} FOR TAG AT FIXUP: {} OFFSET IN BYTES: {} AT: {}", actual_data_idx,
-                   tag.fixup_index, offset, data_base + actual_data_idx * sizeof(uint32_t));
-    fixup_inst_destination.addr[tag.fixup_index] = (fixup_inst_destination.addr[tag.fixup_index] & ~tag.imm_mask) |
-                                                   (tag.imm_mask & ((offset >> tag.rshift) << tag.lshift));
-  }
-  // Flush the icache for our fixups in case they were already cached from another hook call
-  __builtin___clear_cache(reinterpret_cast<char*>(&fixup_inst_destination.addr[0]),
-                          reinterpret_cast<char*>(&fixup_inst_destination.addr[fixup_inst_destination.addr.size()]));
+Fixups::Size Fixups::SizeFor(std::span<uint32_t const> target, void const* target_pc, bool separate_data) {
+  FLAMINGO_ASSERT(!target.empty());
+  // Perform the fixups into scratch memory, as if they were placed out of range of everything that the target
+  // references (and separate data were out of LDR literal range of the fixups). Far forms are never smaller than near
+  // forms, and data only grows as more is added to it, so no other placement can need more space.
+  std::array<uint32_t, FixupContext::kMaxCodeInsts> code{};
+  std::array<uint32_t, FixupContext::kMaxDataEntries> data{};
+  auto const scratch_protection = PageProtectionType::kRead | PageProtectionType::kWrite;
+  // Scratch memory is its own writable alias, so that the writers never change its protection
+  PointerWrapper<uint32_t> const code_ptr(code, scratch_protection, code.data());
+  PointerWrapper<uint32_t> const data_ptr(separate_data ? std::span<uint32_t>(data) : std::span<uint32_t>{},
+                                          scratch_protection, data.data());
+  // 1TB away is out of range of even an ADRP, whereas 2MB is only out of range of an LDR literal.
+  // Both are page aligned, so inline data is padded as it would be for any destination aligned to 16 bytes.
+  constexpr int64_t page_mask = ~0xFFFLL;
+  auto const fixup_pc = (get_untagged_pc(target_pc) & page_mask) + (1LL << 40);
+  auto const data_pc = fixup_pc + (1LL << 21);
+  FixupContext context(code_ptr, data_ptr, target, target_pc, fixup_pc, data_pc);
+  context.Emit();
+  auto const size = Size{
+    .code = static_cast<uint_fast16_t>(context.fixup_writer.target_offset * sizeof(uint32_t)),
+    .data = static_cast<uint_fast16_t>(context.data_writer.target_offset * sizeof(uint32_t)),
+  };
+  FLAMINGO_DEBUG("Fixups for: {} instructions at: {} need: {} code bytes and: {} data bytes", target.size(),
+                 fmt::ptr(target_pc), size.code, size.data);
+  return size;
 }
 
 void Fixups::Log() const {
@@ -670,24 +1172,14 @@ void Fixups::Log() const {
 }
 
 void Fixups::Uninstall() {
-  // To perform an uninstall, we just iterate over all of our original instructions and copy them all back to the target
-  ProtectionWriter<uint32_t> writer(target);
-  for (auto const inst : original_instructions) {
-    writer.Write(inst);
+  // To perform an uninstall, we just copy the original instructions of the patch back to the target
+  {
+    ProtectionWriter<uint32_t> writer(target);
+    for (auto const inst : std::span(original_instructions).first(target.addr.size())) {
+      writer.Write(inst);
+    }
   }
+  FlushInstructionCache(target.addr.data(), target.addr.data() + target.addr.size());
 }
 
-// TODO: We should consider an optimization where we have a location for fixup data instead of inling all fixups.
-// This would allow us to write out actual assembly verbatim and then have ldrs and whatnot for grabbing the data
-// This would save a few instructions per all of the fixups, since we wouldn't need to branch over the data
-// In addition, it would allow us to have a better time disassembling.
-// It also shouldn't cost us any space whatsoever
-// Though, if we perform any hooks AFTER the fact, we would need to properly expand both our data and our instruction
-// space and THAT could be somewhat tricky. Perhaps a full recompile for a hook is actually preferred, though, if we
-// know we need to leapfrog Since we would need to expand our trampoline and our original instructions regardless.
-// TODO: Consider a full recompile and permit late installations
-
-// If we have a fixup that has a ret, we need to avoid the callback after the ret potentially (though it would be
-// redundant anyways)
-
 }  // namespace flamingo
@@ -4,8 +4,12 @@
 #include <iterator>
 #include <list>
 #include <map>
+#include <optional>
 #include <span>
+#include <utility>
 #include <variant>
+#include <vector>
+#include "arm64-decoder.hpp"
 #include "fixups.hpp"
 #include "hook-data.hpp"
 #include "hook-installation-result.hpp"
@@ -25,6 +29,81 @@ using namespace flamingo;
 /// @brief The set of all targets hooked. An ordered map so we can perform large-scale walks by doing binary search.
 inline static std::map<TargetDescriptor, TargetData> targets;
 
+/// @brief The allocations of fixups that nothing can newly enter, but that a thread may still be executing (having
+/// entered them, or loaded the orig that pointed to them, before they were replaced). They are held back from the
+/// allocator until ReclaimRetiredFixups, since the next allocation of the same size would otherwise reuse them.
+struct RetiredFixups {
+  PointerWrapper<uint32_t> code;
+  PointerWrapper<uint32_t> data;
+  PointerWrapper<uint32_t> veneer;
+};
+std::vector<RetiredFixups> retired_fixups;
+
+/// @brief Takes the allocations (and, unless keep_veneer is set, the veneer) of fixups, which must no longer be
+/// reachable from the target or any orig, and retires them.
+void Retire(Fixups& fixups, bool keep_veneer = false) {
+  constexpr auto empty = [] { return PointerWrapper<uint32_t>(std::span<uint32_t>{}, PageProtectionType::kNone); };
+  RetiredFixups retired{
+    .code = std::exchange(fixups.fixup_inst_destination, empty()),
+    .data = std::exchange(fixups.fixup_data_destination, empty()),
+    .veneer = keep_veneer ? empty() : std::exchange(fixups.target.veneer, empty()),
+  };
+  if (retired.code.addr.empty() && retired.data.addr.empty() && retired.veneer.addr.empty()) return;
+  FLAMINGO_DEBUG("Retiring fixups at: {}", fmt::ptr(retired.code.addr.data()));
+  retired_fixups.push_back(retired);
+}
+
+/// @brief Writes a jump to address at target (see ShimTarget::WriteJump), retiring the veneer it no longer branches
+/// through, since a thread may still be inside of it.
+[[nodiscard]] bool WriteJump(ShimTarget& target, void* address) {
+  auto replaced = PointerWrapper<uint32_t>(std::span<uint32_t>{}, PageProtectionType::kNone);
+  if (!target.WriteJump(address, replaced)) return false;
+  if (replaced.addr.data() == target.veneer.addr.data()) {
+    // The target still branches through the same (shared) veneer, so only our extra reference is given back
+    ReleaseVeneer(replaced);
+  } else if (!replaced.addr.empty()) {
+    FLAMINGO_DEBUG("Retiring veneer at: {}", fmt::ptr(replaced.addr.data()));
+    retired_fixups.push_back(RetiredFixups{
+      .code = { std::span<uint32_t>{}, PageProtectionType::kNone },
+      .data = { std::span<uint32_t>{}, PageProtectionType::kNone },
+      .veneer = replaced,
+    });
+  }
+  return true;
+}
+
+/// @brief How a hooked target is patched. Installing onto it may recompile it (see TargetData::Recompile), which
+/// removing the hook does not undo, so a failed install restores it from this (see RestorePatch).
+struct PatchedTarget {
+  TargetDescriptor target;
+  uint16_t patch_size;
+  bool need_orig;
+  uint16_t method_num_insts;
+};
+
+PatchedTarget PatchOf(TargetDescriptor target, TargetData const& target_data) {
+  return PatchedTarget{
+    .target = target,
+    .patch_size = static_cast<uint16_t>(target_data.fixups.target.addr.size()),
+    .need_orig = target_data.metadata.metadata.need_orig,
+    .method_num_insts = target_data.metadata.method_num_insts,
+  };
+}
+
+/// @brief Recompiles target_data back to how it was patched before, once every hook installed since is removed.
+void RestorePatch(PatchedTarget const& previous, TargetData& target_data) {
+  target_data.metadata.method_num_insts = previous.method_num_insts;
+  if (previous.patch_size == target_data.fixups.target.addr.size() &&
+      previous.need_orig == target_data.metadata.metadata.need_orig) {
+    return;
+  }
+  FLAMINGO_DEBUG("Restoring the patch of: {} instructions at: {}", previous.patch_size,
+                 fmt::ptr(previous.target.target));
+  // The first hook could be reached by the previous patch before, so it still can be now
+  [[maybe_unused]] auto const recompiled = target_data.Recompile(previous.patch_size, previous.need_orig);
+  FLAMINGO_ASSERT(recompiled);
+}
+
 Result<std::list<HookInfo>::iterator, installation::TargetBadPriorities> find_suitable_priority_location_for(
     std::list<HookInfo>& hooks, HookMetadata const& hook_to_install) {
   using ResultT = Result<std::list<HookInfo>::iterator, installation::TargetBadPriorities>;
@@ -54,8 +133,7 @@ Result<std::list<HookInfo>::iterator, installation::TargetBadPriorities> find_su
 Result<std::monostate, installation::TargetMismatch> validate_install_metadata(TargetMetadata& existing,
                                                                                HookMetadata const& incoming) {
   using ResultT = Result<std::monostate, installation::TargetMismatch>;
-  // 1. Take the min of num_insts/verify they are equivalent
-  existing.method_num_insts = std::min(existing.method_num_insts, incoming.method_num_insts);
+  // 1. The min of num_insts is taken by the caller, once it knows whether the target needs to be recompiled for it
   // 2. Validate calling convention matches
   if (existing.convention != incoming.convention) {
     return ResultT::ErrAt<installation::MismatchTargetConv>(incoming, existing.convention);
@@ -81,6 +159,85 @@ Result<std::monostate, installation::TargetMismatch> validate_install_metadata(T
   return ResultT::Ok();
 }
 
+/// @brief Allocates exactly as much memory as the fixups need to relocate their original instructions, preferring
+/// memory near the target so that the callback is a single B. For DataLayout::kSeparate, data is allocated near the
+/// fixups, falling back to inline data if there is no space there.
+void AllocateFixups(Fixups& fixups) {
+  auto const target = fixups.RelocatedInstructions();
+  auto const allocate_code = [&](uint_fast16_t size) {
+    auto const protection = PageProtectionType::kExecute | PageProtectionType::kRead;
+    auto code = AllocateNear(fixups.target.addr.data(), kHookAlignment, size, protection);
+    if (code.addr.empty()) {
+      code = Allocate(kHookAlignment, size, protection);
+    }
+    return code;
+  };
+  if (GetDataLayout() == DataLayout::kSeparate) {
+    auto const size = Fixups::SizeFor(target, fixups.target.addr.data(), true);
+    auto code = allocate_code(size.code);
+    // Without any data, the fixups are the same as they would be inline
+    if (size.data == 0) {
+      fixups.fixup_inst_destination = code;
+      return;
+    }
+    auto data = AllocateNear(code.addr.data(), kHookAlignment, size.data, PageProtectionType::kRead);
+    if (!data.addr.empty()) {
+      fixups.fixup_inst_destination = code;
+      fixups.fixup_data_destination = data;
+      return;
+    }
+    // Inline data needs a differently sized allocation
+    Deallocate(code);
+  }
+  fixups.fixup_inst_destination = allocate_code(Fixups::SizeFor(target, fixups.target.addr.data(), false).code);
+}
+
+/// @brief Returns the address of ptr without the tag that may be in its upper byte, as decoding expects.
+int64_t UntaggedPc(void const* ptr) {
+  constexpr uint64_t tag_mask = ~(0xFFULL << 56U);
+  return static_cast<int64_t>(reinterpret_cast<uint64_t>(ptr) & tag_mask);
+}
+
+/// @brief The most instructions Install scans at a target to find the end of its function, and any branches back into
+/// its start.
+constexpr static uint16_t kMaxAnalyzedInsts = 1024;
+
+/// @brief Analyzes the function at target (see arm64::AnalyzeFunction), which the caller declared to be at least
+/// declared_insts long, scanning at most kMaxAnalyzedInsts and never past the end of readable memory.
+/// The whole function is scanned (not just the declared instructions), so that a branch from anywhere within it back
+/// into the patch is found.
+arm64::FunctionAnalysis AnalyzeTarget(void const* target, uint16_t declared_insts) {
+  auto const start = reinterpret_cast<uintptr_t>(target);
+  size_t num_insts = 0;
+  for (auto page = Page::PageAlign(start); num_insts < kMaxAnalyzedInsts; page += Page::PageSize) {
+    auto const protection = GetPageProtection(reinterpret_cast<void const*>(page));
+    if ((protection & PageProtectionType::kRead) == PageProtectionType::kNone) break;
+    num_insts = std::min<size_t>(kMaxAnalyzedInsts, (page + Page::PageSize - start) / sizeof(uint32_t));
+  }
+  auto const analysis = arm64::AnalyzeFunction(std::span(static_cast<uint32_t const*>(target), num_insts),
+                                               UntaggedPc(target), declared_insts);
+  FLAMINGO_DEBUG("Function at: {} has: {} instructions (of: {} scanned), the first: {} of which are safe to patch",
+                 fmt::ptr(target), analysis.num_insts, num_insts, analysis.safe_patch_size);
+  return analysis;
+}
+
+/// @brief Returns the number of instructions a target needs past its patch for an orig to return to: none without an
+/// orig, or when the whole function is relocated and the orig never returns into the target.
+uint16_t ReturnSize(bool need_orig, bool whole_function) {
+  return need_orig && !whole_function ? 1U : 0U;
+}
+
+/// @brief Returns a veneer through which a single B at target can reach destination, if it cannot reach it directly.
+/// Returns an empty PointerWrapper if a B can reach destination directly, and nullopt if no veneer could be found.
+std::optional<PointerWrapper<uint32_t>> VeneerFor(void const* target, void const* destination) {
+  if (arm64::BranchInRange(UntaggedPc(target), UntaggedPc(destination))) {
+    return PointerWrapper<uint32_t>(std::span<uint32_t>{}, PageProtectionType::kNone);
+  }
+  auto veneer = AcquireVeneer(target, destination);
+  if (veneer.addr.empty()) return std::nullopt;
+  return veneer;
+}
+
 }  // namespace
 
 namespace flamingo {
@@ -95,11 +252,54 @@ installation::Result Install(HookInfo&& hook) {
   if (hooked_target == targets.end()) {
     // To make the first hook, we need to create the TargetData
     // For leapfrog hooks, we need to do something special anyways.
-    // TODO: Support leapfrog hooks (where the installation space is fewer than 4U)
+    // We never patch past the end of the function, or over the destination of a branch from within it
+    auto const analysis = AnalyzeTarget(hook.target, hook.metadata.method_num_insts);
+    if (analysis.num_insts < hook.metadata.method_num_insts) {
+      FLAMINGO_DEBUG("Function at: {} ends after: {} instructions, fewer than the: {} it was declared to have",
+                     fmt::ptr(hook.target), analysis.num_insts, hook.metadata.method_num_insts);
+      hook.metadata.method_num_insts = analysis.num_insts;
+    }
+    // Tiny leaf functions may be relocated whole, if asked to, as long as we know where they end
+    auto& installation_metadata = hook.metadata.installation_metadata;
+    installation_metadata.relocate_whole_function =
+        installation_metadata.relocate_whole_function && !installation_metadata.is_midpoint &&
+        analysis.num_insts <= Fixups::kMaxFixupInstCount &&
+        arm64::IsRelocatableLeaf(std::span(static_cast<uint32_t const*>(hook.target), analysis.num_insts),
+                                 UntaggedPc(hook.target));
     // If we have an orig, we need to have an instruction to jump back to
-    auto const method_size = Fixups::kNormalFixupInstCount + (hook.orig_ptr != nullptr ? 1 : 0);
-    if (hook.metadata.method_num_insts < method_size) {
-      return installation::Result::ErrAt<installation::TargetTooSmall>(hook.metadata, method_size);
+    auto const orig_size = ReturnSize(hook.orig_ptr != nullptr, installation_metadata.relocate_whole_function);
+    if (hook.metadata.method_num_insts < Fixups::kNearFixupInstCount + orig_size) {
+      return installation::Result::ErrAt<installation::TargetTooSmall>(hook.metadata,
+                                                                        Fixups::kNearFixupInstCount + orig_size);
+    }
+    // Nothing makes x17 dead in the middle of a function, so a far jump there clobbers a register that provably is
+    auto scratch_reg = arm64::kDefaultScratchReg;
+    if (installation_metadata.is_midpoint) {
+      scratch_reg =
+          arm64::FindScratchRegister(std::span(static_cast<uint32_t const*>(hook.target), analysis.num_insts),
+                                     UntaggedPc(hook.target))
+              .value_or(ShimTarget::kNoScratchReg);
+      if (scratch_reg != ShimTarget::kNoScratchReg) {
+        FLAMINGO_DEBUG("Midpoint at: {} jumps through: x{}", fmt::ptr(hook.target), scratch_reg);
+      }
+    }
+    // If our hook is within branch range of our target (directly, or through a veneer), we only need to overwrite a
+    // single instruction. Veneers always clobber x17, so a midpoint where it may be live can only use a direct B.
+    auto const in_range = arm64::BranchInRange(UntaggedPc(hook.target), UntaggedPc(hook.hook_ptr));
+    auto const veneer = scratch_reg == arm64::kDefaultScratchReg || in_range
+                            ? VeneerFor(hook.target, hook.hook_ptr)
+                            : std::nullopt;
+    if (!veneer.has_value() && scratch_reg == ShimTarget::kNoScratchReg) {
+      FLAMINGO_DEBUG("No register is dead at midpoint: {}, so it cannot jump to: {}", fmt::ptr(hook.target),
+                     fmt::ptr(hook.hook_ptr));
+      return installation::Result::ErrAt<installation::TargetNoScratchRegister>(hook.metadata);
+    }
+    auto const patch_size = veneer.has_value() ? Fixups::kNearFixupInstCount : Fixups::kNormalFixupInstCount;
+    if (hook.metadata.method_num_insts < patch_size + orig_size || analysis.safe_patch_size < patch_size) {
+      FLAMINGO_DEBUG("Cannot patch: {} instructions at: {}, which has: {} instructions, the first: {} of them safely",
+                     patch_size, fmt::ptr(hook.target), hook.metadata.method_num_insts, analysis.safe_patch_size);
+      if (veneer.has_value()) ReleaseVeneer(*veneer);
+      return installation::Result::ErrAt<installation::TargetTooSmall>(hook.metadata, patch_size + orig_size);
     }
     // The initial protection of the page that holds the target
     auto target_initial_protection = PageProtectionType::kExecute | PageProtectionType::kRead;
@@ -110,6 +310,22 @@ installation::Result Install(HookInfo&& hook) {
         std::span<uint32_t>(reinterpret_cast<uint32_t*>(hook.target),
                             reinterpret_cast<uint32_t*>(hook.target) + hook.metadata.method_num_insts),
         target_initial_protection);
+    auto fixups = Fixups{
+      // Our fixup target is a subspan the same size as our install size
+      .target = { target_pointer.Subspan(patch_size) },
+      .fixup_inst_destination = { std::span<uint32_t>{}, PageProtectionType::kNone },
+    };
+    if (installation_metadata.relocate_whole_function) {
+      FLAMINGO_DEBUG("Relocating all: {} instructions of the function at: {}", analysis.num_insts,
+                     fmt::ptr(hook.target));
+      fixups.relocated_insts = analysis.num_insts;
+    }
+    // Fixups may clobber whichever registers are dead on their way back into the function
+    fixups.function_insts = analysis.num_insts;
+    fixups.target.scratch_reg = scratch_reg;
+    // Always copy over our original instructions to our .fixups instance
+    fixups.CopyOriginalInsts();
+    AllocateFixups(fixups);
     auto result = targets.emplace(
         target_info, TargetData{ .metadata =
                                      TargetMetadata{
@@ -117,24 +333,16 @@ installation::Result Install(HookInfo&& hook) {
                                        .convention = hook.metadata.convention,
                                        .metadata = hook.metadata.installation_metadata,
                                        .method_num_insts = hook.metadata.method_num_insts,
+                                       .safe_patch_size = analysis.safe_patch_size,
 #ifndef FLAMINGO_NO_REGISTRATION_CHECKS
                                        .parameter_info = hook.metadata.parameter_info,
                                        .return_info = hook.metadata.return_info,
 #endif
                                      },
-                                 .fixups = Fixups{
-                                   // Our fixup target is a subspan the same size as our install size
-                                   .target = { target_pointer.Subspan(Fixups::kNormalFixupInstCount) },
-                                   .fixup_inst_destination =
-                                       Allocate(kHookAlignment,
-                                                std::min(Page::PageSize, hook.metadata.method_num_insts *
-                                                                             sizeof(uint32_t) * kNumFixupsPerInst),
-                                                PageProtectionType::kExecute | PageProtectionType::kRead),
-                                 } });
+                                 .fixups = std::move(fixups) });
     auto& target_data = result.first->second;
+    if (veneer.has_value()) target_data.fixups.target.veneer = *veneer;
     hook.assign_orig(reinterpret_cast<void*>(&no_fixups));
-    // Always copy over our original instructions to our .fixups instance
-    target_data.fixups.CopyOriginalInsts();
     // If we want to make an orig, we fill it out now
     if (hook.metadata.installation_metadata.need_orig) {
       target_data.fixups.PerformFixupsAndCallback();
@@ -143,32 +351,63 @@ installation::Result Install(HookInfo&& hook) {
     // Add the hook itself to the set of hooks we have, taking ownership
     auto const hook_data_result = target_data.hooks.emplace(target_data.hooks.end(), std::move(hook));
     // Now actually INSTALL the hook at target to point to the first hook in target_data.hooks
-    target_data.fixups.target.WriteJump(hook_data_result->hook_ptr);
+    // This reuses the veneer we already hold, if we need one, so it cannot fail.
+    [[maybe_unused]] auto const written = WriteJump(target_data.fixups.target, hook_data_result->hook_ptr);
+    FLAMINGO_ASSERT(written);
     return installation::Result::Ok(flamingo::installation::Ok{ HookHandle{ .hook_location = hook_data_result } });
   }
-  auto installation_checks = validate_install_metadata(hooked_target->second.metadata, hook.metadata);
+  auto& target_data = hooked_target->second;
+  auto installation_checks = validate_install_metadata(target_data.metadata, hook.metadata);
   if (!installation_checks.has_value()) {
     return installation::Result::ErrAt<installation::TargetMismatch>(installation_checks.error());
   }
 
-  auto location_or_err = find_suitable_priority_location_for(hooked_target->second.hooks, hook.metadata);
+  auto location_or_err = find_suitable_priority_location_for(target_data.hooks, hook.metadata);
   if (!location_or_err.has_value()) {
     return installation::Result::ErrAt<installation::TargetBadPriorities>(location_or_err.error());
   }
   auto const location = location_or_err.value();
+  // 1. Recompile the target if the incoming hook needs an orig when none was needed so far, or if it knows the target
+  // to be smaller than our patch (and the orig that returns past it).
+  auto const num_insts = std::min(target_data.metadata.method_num_insts, hook.metadata.method_num_insts);
+  auto const need_orig = target_data.metadata.metadata.need_orig || hook.metadata.installation_metadata.need_orig;
+  auto const orig_size = ReturnSize(need_orig, target_data.metadata.metadata.relocate_whole_function);
+  auto const previous = PatchOf(hooked_target->first, target_data);
+  auto patch_size = previous.patch_size;
+  if (num_insts < patch_size + orig_size) {
+    // Only a single B (directly to the hook, or through a veneer) can fit
+    patch_size = Fixups::kNearFixupInstCount;
+    if (num_insts < patch_size + orig_size) {
+      return installation::Result::ErrAt<installation::TargetTooSmall>(hook.metadata, patch_size + orig_size);
+    }
+  }
+  if (need_orig != target_data.metadata.metadata.need_orig || patch_size != target_data.fixups.target.addr.size()) {
+    if (!target_data.Recompile(patch_size, need_orig)) {
+      return installation::Result::ErrAt<installation::TargetTooSmall>(hook.metadata,
+                                                                        Fixups::kNormalFixupInstCount + orig_size);
+    }
+  }
+  target_data.metadata.method_num_insts = num_insts;
   // 2. Assuming we found a reasonable location to install, insert our new hook before this location, and then adjust
   // those around us to match.
-  auto const hook_data_result = hooked_target->second.hooks.emplace(location, std::move(hook));
+  auto const hook_data_result = target_data.hooks.emplace(location, std::move(hook));
   // - This is done by looking to the left and right of our target iterator to insert at:
   // -- If left does not exist: Rewrite the jump from the target to us; else rewrite the left's orig final jump to us
-  if (hook_data_result == hooked_target->second.hooks.begin()) {
-    hooked_target->second.fixups.target.WriteJump(hook_data_result->hook_ptr);
+  if (hook_data_result == target_data.hooks.begin()) {
+    if (!target_data.JumpToFirstHook()) {
+      auto const metadata = hook_data_result->metadata;
+      target_data.hooks.erase(hook_data_result);
+      RestorePatch(previous, target_data);
+      return installation::Result::ErrAt<installation::TargetTooSmall>(
+          metadata, Fixups::kNormalFixupInstCount + ReturnSize(target_data.metadata.metadata.need_orig,
+                                                               target_data.metadata.metadata.relocate_whole_function));
+    }
   } else {
     std::prev(hook_data_result)->assign_orig(hook_data_result->hook_ptr);
   }
   // -- If right does not exist: OUR orig calls the overall fixups; else jump to their hook_ptr
-  if (std::next(hook_data_result) == hooked_target->second.hooks.end()) {
-    hook_data_result->assign_orig(hooked_target->second.fixups.fixup_inst_destination.addr.data());
+  if (std::next(hook_data_result) == target_data.hooks.end()) {
+    hook_data_result->assign_orig(target_data.fixups.fixup_inst_destination.addr.data());
   } else {
     hook_data_result->assign_orig(std::next(hook_data_result)->hook_ptr);
   }
@@ -176,6 +415,58 @@ installation::Result Install(HookInfo&& hook) {
   return installation::Result::Ok(flamingo::installation::Ok{ HookHandle{ .hook_location = hook_data_result } });
 }
 
+installation::BatchResult InstallBatch(std::span<HookInfo> hooks) {
+  // Install in order of target address, so that writes to the same page are made back to back
+  std::vector<size_t> order(hooks.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+    return reinterpret_cast<uintptr_t>(hooks[lhs].target) < reinterpret_cast<uintptr_t>(hooks[rhs].target);
+  });
+  // Targets that are already hooked are restored to how they were patched if the batch fails
+  std::vector<PatchedTarget> patched;
+  // Installs write to the orig of each hook, which we give back as we found it if the batch fails
+  std::vector<void*> origs(hooks.size(), nullptr);
+  for (auto const index : order) {
+    if (hooks[index].orig_ptr != nullptr) origs[index] = *hooks[index].orig_ptr;
+    auto const itr = targets.find(TargetDescriptor{ hooks[index].target });
+    if (itr == targets.end() || (!patched.empty() && patched.back().target.target == itr->first.target)) continue;
+    patched.push_back(PatchOf(itr->first, itr->second));
+  }
+  std::vector<std::pair<size_t, installation::Ok>> installed;
+  installed.reserve(hooks.size());
+  WriteBatch batch;
+  for (auto const index : order) {
+    // Each hook is installed from a copy, so that the caller still has every hook if the batch fails
+    auto result = Install(HookInfo(hooks[index]));
+    if (!result.has_value()) {
+      // Roll back everything we have installed so far, newest first
+      for (auto itr = installed.rbegin(); itr != installed.rend(); itr++) {
+        [[maybe_unused]] auto const uninstall_result = Uninstall(itr->second.returned_handle);
+        FLAMINGO_ASSERT(uninstall_result.has_value());
+      }
+      // Then recompile the targets that were hooked before back to how they were patched
+      for (auto const& previous : patched) {
+        RestorePatch(previous, targets.at(previous.target));
+      }
+      for (size_t i = 0; i < hooks.size(); i++) {
+        if (hooks[i].orig_ptr != nullptr) *hooks[i].orig_ptr = origs[i];
+      }
+      return installation::BatchResult::Err(installation::BatchError{ .index = index, .error = result.error() });
+    }
+    installed.emplace_back(index, result.value());
+  }
+  std::sort(installed.begin(), installed.end(),
+            [](auto const& lhs, auto const& rhs) { return lhs.first < rhs.first; });
+  std::vector<installation::Ok> results;
+  results.reserve(installed.size());
+  for (auto& [_, ok] : installed) {
+    results.push_back(ok);
+  }
+  return installation::BatchResult::Ok(std::move(results));
+}
+
 Result<bool, installation::Error> Reinstall(TargetDescriptor target) {
   using RetType = Result<bool, installation::Error>;
   auto itr = targets.find(target);
@@ -183,12 +474,23 @@ Result<bool, installation::Error> Reinstall(TargetDescriptor target) {
     return RetType::Ok(false);
   }
   // Reinstall the orig by calling PerformFixupsAndCallback() again (as needed)
-  itr->second.fixups.CopyOriginalInsts();
+  auto& fixups = itr->second.fixups;
+  fixups.CopyOriginalInsts();
   if (itr->second.metadata.metadata.need_orig) {
-    itr->second.fixups.PerformFixupsAndCallback();
+    // Our fixups were allocated for exactly the instructions we saw at install, which may have changed since
+    // The last orig still points to the old ones, and a thread may be inside of them, so they are retired, not freed
+    if (!fixups.Fits()) {
+      Retire(fixups, true);
+      AllocateFixups(fixups);
+      itr->second.hooks.back().assign_orig(fixups.fixup_inst_destination.addr.data());
+    }
+    fixups.PerformFixupsAndCallback();
   }
   // Perform the write of the jump to the first hook
-  itr->second.fixups.target.WriteJump(itr->second.hooks.begin()->hook_ptr);
+  if (!itr->second.JumpToFirstHook()) {
+    auto const& metadata = itr->second.hooks.front().metadata;
+    return RetType::ErrAt<installation::TargetTooSmall>(metadata, Fixups::kNormalFixupInstCount);
+  }
   // Note that we do NOT reconstruct all of the inner hook pointers between each hook.
   // This is done as a partial optimization, but at some point we should revisit this (and adjust the docstring comment
   // to match)
@@ -206,18 +508,29 @@ Result<bool, bool> Uninstall(HookHandle handle) {
   // 1. If it is the only hook, destroys the fixups, uninstalls the hook by replacing the original instructions. Note
   // that this also destroys leapfrog hooks.
   if (target_entry->second.hooks.size() == 1) {
-    target_entry->second.fixups.Uninstall();
-    // At this point the original memory at our target is restored, we are safe to clear out the target entry here and
-    // return
+    auto& fixups = target_entry->second.fixups;
+    fixups.Uninstall();
+    // At this point the original memory at our target is restored, so nothing can newly enter the fixups or the
+    // veneer. A thread may still be running inside of them though, or be about to call an orig it loaded earlier, and
+    // if they were freed now, the next install could reuse them for another target's fixups, which that thread would
+    // then run instead. So they are retired until ReclaimRetiredFixups.
+    Retire(fixups);
     // TODO: Invalidate leapfrog entries
-    // TODO: Cleanup whatever dangling pointers we would have here (the fixup pointer being one of them)
     targets.erase(target_entry);
     return RetType::Ok(false);
   }
   // 2. If this is the first hook in a set of many, rewrites the target to jump to the hook past this one. Note that
   // this MAY also break leapfrog hooks, if this hook was installed as a branch but the next hook needs to be larger.
   if (handle.hook_location == target_entry->second.hooks.begin()) {
-    target_entry->second.fixups.target.WriteJump(std::next(handle.hook_location)->hook_ptr);
+    // Take this hook out of the list (without invalidating it), so that the next hook is first
+    auto& hooks = target_entry->second.hooks;
+    std::list<HookInfo> removed;
+    removed.splice(removed.begin(), hooks, handle.hook_location);
+    if (!target_entry->second.JumpToFirstHook()) {
+      hooks.splice(hooks.begin(), removed, handle.hook_location);
+      return RetType::Err(true);
+    }
+    return RetType::Ok(true);
   }
   // 3. If this is the last hook, makes the previous hook's orig point to the fixups directly, or to the no_fixups
   // function.
@@ -262,4 +575,132 @@ Result<std::span<uint32_t const>, std::monostate> FixupPointerFor(TargetDescript
   return Result<std::span<uint32_t const>, std::monostate>::Err();
 }
 
-}  // namespace flamingo
\ No newline at end of file
+size_t ReclaimRetiredFixups() {
+  auto const reclaimed = retired_fixups.size();
+  for (auto const& retired : retired_fixups) {
+    Deallocate(retired.code);
+    Deallocate(retired.data);
+    ReleaseVeneer(retired.veneer);
+  }
+  retired_fixups.clear();
+  FLAMINGO_DEBUG("Reclaimed: {} retired fixups", reclaimed);
+  return reclaimed;
+}
+
+Result<PeepholeStats, std::monostate> PeepholeStatsFor(TargetDescriptor target) {
+  auto itr = targets.find(target);
+  if (itr != targets.end()) {
+    return Result<PeepholeStats, std::monostate>::Ok(itr->second.fixups.peephole_stats);
+  }
+  return Result<PeepholeStats, std::monostate>::Err();
+}
+
+bool TargetData::Recompile(uint16_t patch_size, bool need_orig) {
+  auto const old_patch_size = fixups.target.addr.size();
+  // Nothing can have entered our fixups if no orig was needed until now
+  auto const live = metadata.metadata.need_orig;
+  Fixups recompiled{
+    .target = { metadata.target.Subspan(patch_size) },
+    .fixup_inst_destination = { std::span<uint32_t>{}, PageProtectionType::kNone },
+  };
+  recompiled.relocated_insts = fixups.relocated_insts;
+  recompiled.function_insts = fixups.function_insts;
+  recompiled.target.scratch_reg = fixups.target.scratch_reg;
+  if (!hooks.empty() && !recompiled.target.CanJumpTo(hooks.front().hook_ptr)) {
+    return false;
+  }
+  // A single B may need a veneer to reach the first hook, but we can keep the one we have
+  if (patch_size == old_patch_size) {
+    recompiled.target.veneer =
+        std::exchange(fixups.target.veneer, { std::span<uint32_t>{}, PageProtectionType::kNone });
+  } else if (patch_size == Fixups::kNearFixupInstCount && !hooks.empty()) {
+    auto veneer = VeneerFor(metadata.target.addr.data(), hooks.front().hook_ptr);
+    if (!veneer.has_value()) {
+      return false;
+    }
+    recompiled.target.veneer = *veneer;
+  }
+  // We only ever patched over the instructions we have copies of, so any past those are still the originals
+  recompiled.original_instructions.resize(std::max<size_t>(patch_size, recompiled.relocated_insts));
+  for (size_t i = 0; i < recompiled.original_instructions.size(); i++) {
+    recompiled.original_instructions[i] =
+        i < fixups.original_instructions.size() ? fixups.original_instructions[i] : metadata.target.addr[i];
+  }
+  // Fixups that were never reachable can be rewritten in place, as long as they are large enough
+  recompiled.fixup_inst_destination = fixups.fixup_inst_destination;
+  recompiled.fixup_data_destination = fixups.fixup_data_destination;
+  if (!live && (!need_orig || recompiled.Fits())) {
+    FLAMINGO_DEBUG("Recompiling fixups for: {} in place", fmt::ptr(metadata.target.addr.data()));
+    fixups.fixup_inst_destination = { std::span<uint32_t>{}, PageProtectionType::kNone };
+    fixups.fixup_data_destination = { std::span<uint32_t>{}, PageProtectionType::kNone };
+  } else {
+    recompiled.fixup_inst_destination = { std::span<uint32_t>{}, PageProtectionType::kNone };
+    recompiled.fixup_data_destination = { std::span<uint32_t>{}, PageProtectionType::kNone };
+    AllocateFixups(recompiled);
+  }
+  if (need_orig) {
+    recompiled.PerformFixupsAndCallback();
+  }
+  FLAMINGO_DEBUG("Recompiled fixups for: {} from a patch of: {} to: {} instructions, at: {}",
+                 fmt::ptr(metadata.target.addr.data()), old_patch_size, patch_size,
+                 fmt::ptr(recompiled.fixup_inst_destination.addr.data()));
+  auto old = std::exchange(fixups, std::move(recompiled));
+  metadata.metadata.need_orig = need_orig;
+  // Our new fixups return past the new patch. When it grows, that is still intact until we patch over it, so the origs
+  // are re-pointed first. When it shrinks, the new patch is written and the instructions it no longer covers are
+  // restored first, since the old fixups return past all of them.
+  if (patch_size >= old_patch_size) {
+    RelinkOrigs();
+  }
+  if (patch_size != old_patch_size && !hooks.empty()) {
+    // This reuses the veneer we acquired above, if we need one, so it cannot fail
+    [[maybe_unused]] auto const written = WriteJump(fixups.target, hooks.front().hook_ptr);
+    FLAMINGO_ASSERT(written);
+  }
+  if (patch_size < old_patch_size) {
+    auto const tail = PointerWrapper<uint32_t>(metadata.target.addr.subspan(patch_size, old_patch_size - patch_size),
+                                               metadata.target.protection);
+    {
+      ProtectionWriter<uint32_t> writer(tail);
+      for (auto const inst : std::span(old.original_instructions).subspan(patch_size, tail.addr.size())) {
+        writer.Write(inst);
+      }
+    }
+    FlushInstructionCache(tail.addr.data(), tail.addr.data() + tail.addr.size());
+    RelinkOrigs();
+  }
+  // Now nothing can newly enter the old fixups or veneer. Relinking does not drain threads that loaded the old orig
+  // before it was re-pointed though, so they may still be inside of (or about to enter) the old fixups. As for
+  // uninstalls, they are retired until ReclaimRetiredFixups, rather than freed for the next install to reuse.
+  Retire(old);
+  return true;
+}
+
+bool TargetData::JumpToFirstHook() {
+  FLAMINGO_ASSERT(!hooks.empty());
+  if (WriteJump(fixups.target, hooks.front().hook_ptr)) {
+    return true;
+  }
+  // Our single B cannot reach the first hook, so we need room for a far jump instead
+  FLAMINGO_DEBUG("Growing the patch at: {} to reach: {}", fmt::ptr(metadata.target.addr.data()),
+                 fmt::ptr(hooks.front().hook_ptr));
+  auto const orig_size = ReturnSize(metadata.metadata.need_orig, metadata.metadata.relocate_whole_function);
+  if (metadata.method_num_insts < Fixups::kNormalFixupInstCount + orig_size ||
+      metadata.safe_patch_size < Fixups::kNormalFixupInstCount) {
+    return false;
+  }
+  return Recompile(Fixups::kNormalFixupInstCount, metadata.metadata.need_orig);
+}
+
+void TargetData::RelinkOrigs() {
+  for (auto itr = hooks.begin(); itr != hooks.end(); itr++) {
+    if (std::next(itr) != hooks.end()) {
+      itr->assign_orig(std::next(itr)->hook_ptr);
+    } else {
+      itr->assign_orig(metadata.metadata.need_orig ? fixups.fixup_inst_destination.addr.data()
+                                                   : reinterpret_cast<void*>(&no_fixups));
+    }
+  }
+}
+
+}  // namespace flamingo
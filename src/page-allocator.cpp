@@ -1,23 +1,70 @@
 // Make a page
 // Pages should have sizes and are otherwise 4kb
-// If we do some allocation and determine that we didnt need the full set of allocation for our
-// page, we want to give it back. For now, though, we should just allocate out the pages regardless
-// And call a function to finalize our allocation pool or something on the allocator
-// Note that in order to properly handle deallocation as well as finalization among other things, we need to handle:
-// 1. When an allocation is "complete", shrink the allocation
-// 2. Shrinking of allocations need to be done in such a way that future allocations are not broken. i.e. bump allocator
-// 3. Deallocations need to be done in such a way that full pages are not destroyed
+// Allocations are grouped into heaps, one per protection (and per near region for near allocations).
+// Each heap bump allocates out of its current page, and keeps a free list per size class for reuse.
+// Sizes are rounded up to a granule, so each size class holds blocks of exactly the same size. Reusing a block of the
+// same size, and bumping, are cheap, but neither allocation nor deallocation is O(1) in general:
+// 1. Allocation pops from the free list of its size class if it is not empty, otherwise bumps the current page, and
+// otherwise splits a block from a larger size class, scanning up to every (kNumSizeClasses) larger class for one
+// 2. Free lists are not eagerly cleaned up, so popping may first skip (and drop) stale entries, each at most once
+// 3. When the current page is too full for an allocation, its tail is freed as a block of its own size class
+// and a new page is mapped to bump from
+// 4. Deallocation coalesces the block with any free neighbors in its page, which is O(log n) in the number of free
+// blocks in that page, and pushes the result back to the free list of its size class (or back to the bump pointer, if
+// it is at the end of the current page)
+// 5. Pages that no longer have any live allocations are unmapped
+// Executable (but not writable) pages are backed by a memfd that is mapped twice: once with the requested protection,
+// and once as read/write elsewhere. All writes go through the read/write alias, so the executable mapping never has to
+// be mprotect'd. If memfds are not supported, we fall back to anonymous pages (and writes mprotect as usual).
+// Near allocations within a loaded module may also be served from its code caves: padding in the pages of its
+// executable segments that lies outside of every segment. Such pages are borrowed, they are never mapped or unmapped by
+// us, and only their caves are ever handed out. They are for reach, not memory: writing to one still dirties a page.
 #include "page-allocator.hpp"
 #include <fmt/format.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cinttypes>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include "util.hpp"
 
 namespace {
+#ifdef MAP_FIXED_NOREPLACE
+constexpr int kMapFixedNoReplace = MAP_FIXED_NOREPLACE;
+#else
+// Older kernels ignore unknown flags, so a plain hint is the best we can do. We validate the result regardless.
+constexpr int kMapFixedNoReplace = 0;
+#endif
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+constexpr int kPunchHole = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+#else
+constexpr int kPunchHole = 0;
+#endif
+
+/// @brief The maximum number of free regions we will attempt to mmap before giving up on a near allocation.
+constexpr auto kMaxNearMapAttempts = 16U;
+
+/// @brief All allocations are rounded up to a multiple of this size, which is also the largest supported alignment.
+constexpr uint_fast16_t kGranuleSize = 16;
+/// @brief The number of size classes, one per granule multiple up to a full page.
+constexpr size_t kNumSizeClasses = flamingo::Page::PageSize / kGranuleSize;
+
 constexpr auto AlignUp(auto offset, auto alignment) {
-  // We can't align to a size that is greater than our allocation
-  __builtin_assume(alignment < flamingo::Page::PageSize);
   // Alignment must be a power of 2
   __builtin_assume((alignment != 0) && ((alignment & (alignment - 1)) == 0));
   if (offset % alignment != 0) {
@@ -26,57 +73,774 @@ constexpr auto AlignUp(auto offset, auto alignment) {
   return offset;
 }
 
+/// @brief Returns the size class index for a (granule aligned) size.
+constexpr size_t SizeClassFor(uint_fast16_t aligned_size) {
+  return (aligned_size / kGranuleSize) - 1;
+}
+
+struct Heap;
+
+/// @brief Allocator bookkeeping for a single mapped page.
+struct PageState {
+  flamingo::Page page;
+  /// @brief The heap this page belongs to.
+  Heap* owner;
+  /// @brief The number of bytes currently handed out from this page.
+  uint_fast16_t live_size{ 0 };
+  /// @brief Free blocks within [0, page.used_size), as offset -> size. Adjacent free blocks are always coalesced.
+  std::map<uint_fast16_t, uint_fast16_t> free_blocks{};
+  /// @brief The read/write alias of this page if it is dual mapped, otherwise nullptr.
+  void* alias{ nullptr };
+  /// @brief The offset of this page within the dual mapping file, if it is dual mapped.
+  off_t file_offset{ -1 };
+  /// @brief True if this page belongs to a loaded module and was not mapped by us. Only the code caves within it (which
+  /// start out in free_blocks) are allocated from, and it is never unmapped.
+  bool borrowed{ false };
+};
+
+/// @brief A block carved out of a page.
+struct Block {
+  PageState* page;
+  void* ptr;
+};
+
+/// @brief A set of pages with the same protection that allocations are bump allocated from, with free lists per size
+/// class for reuse.
+struct Heap {
+  flamingo::PageProtectionType protection;
+  /// @brief For near heaps, all pages are within kNearRange / 2 of this address. 0 for heaps that may be anywhere.
+  uintptr_t anchor;
+  /// @brief The page we are currently bump allocating from, or nullptr if we need a new one.
+  PageState* current{ nullptr };
+  /// @brief Free blocks, indexed by size class. Entries may be stale (coalesced away, reallocated, or on a page that
+  /// has since been unmapped), so they are validated against their page's free_blocks when popped.
+  std::array<std::vector<void*>, kNumSizeClasses> free_lists{};
+};
+
+/// @brief Holds all of the allocator state.
+struct AllocatorState {
+  /// @brief All heaps we have made, we expect very few of these (one per protection per near region).
+  std::vector<std::unique_ptr<Heap>> heaps;
+  /// @brief All pages we have mapped, by address. Node based, so PageState pointers are stable.
+  std::unordered_map<uintptr_t, PageState> pages;
+  /// @brief The total number of bytes ever deallocated.
+  size_t total_freed_bytes{ 0 };
+  /// @brief The total number of pages we have given back to the OS.
+  size_t released_pages{ 0 };
+  /// @brief The memfd backing all dual mapped pages. -1 if we have not made it yet, or if dual mapping is unsupported.
+  int dual_map_fd{ -1 };
+  /// @brief Set once we know we cannot dual map, so that we don't keep trying.
+  bool dual_map_unsupported{ false };
+  /// @brief The current size of dual_map_fd.
+  off_t dual_map_size{ 0 };
+  /// @brief Page sized offsets within dual_map_fd that are no longer mapped and may be reused.
+  std::vector<off_t> free_file_offsets{};
+  /// @brief The last known protection of every page we have looked at or protected, by page address.
+  std::unordered_map<uintptr_t, flamingo::PageProtectionType> page_protections{};
+  /// @brief The [start, end) of every module whose code caves have been claimed.
+  std::vector<std::pair<uintptr_t, uintptr_t>> scanned_modules{};
+  /// @brief The total number of bytes claimed from code caves.
+  size_t code_cave_bytes{ 0 };
+};
+
+/// @brief Everything deferred by the currently open WriteBatch(es).
+struct BatchState {
+  uint_fast16_t depth{ 0 };
+  // Pages made writable within the batch, mapped to the protection to restore them to
+  std::map<uintptr_t, flamingo::PageProtectionType> pages_to_restore{};
+  // [begin, end) ranges to flush the icache for
+  std::vector<std::pair<uintptr_t, uintptr_t>> flush_ranges{};
+};
+BatchState batch;
+
 // We don't want to rely on the dlopen constructor calling this, we will allocate it on first call to Allocate.
 // Hence, it's a pointer that we directly manage.
-std::unordered_multimap<flamingo::PageProtectionType, flamingo::Page>* all_pages;
+AllocatorState* state;
+
+AllocatorState& GetState() {
+  if (state == nullptr) {
+    state = new AllocatorState{};
+  }
+  return *state;
+}
+
+PageState* FindPage(void const* ptr) {
+  auto& pages = GetState().pages;
+  auto itr = pages.find(flamingo::Page::PageAlign(reinterpret_cast<uintptr_t>(ptr)));
+  return itr == pages.end() ? nullptr : &itr->second;
+}
+
+void* PointerAt(PageState& page, uint_fast16_t offset) {
+  return &static_cast<uint8_t*>(page.page.ptr)[offset];
+}
+
+bool IsNear(uintptr_t lhs, uintptr_t rhs, int64_t range) {
+  auto const delta = static_cast<int64_t>(lhs - rhs);
+  return std::llabs(delta) <= range;
+}
+
+/// @brief Walks /proc/self/maps, calling f with the [start, end) and protection of each mapping, in ascending address
+/// order. f may return true to stop walking early. Returns false if the maps could not be read.
+template <class F>
+bool ForEachMapping(F&& f) {
+  auto* maps = std::fopen("/proc/self/maps", "r");
+  if (maps == nullptr) {
+    FLAMINGO_DEBUG("Failed to open /proc/self/maps: {}", std::strerror(errno));
+    return false;
+  }
+  char line[256];
+  // Lines with long paths may be split across multiple reads, only the start of a line holds the range.
+  bool at_line_start = true;
+  while (std::fgets(line, sizeof(line), maps) != nullptr) {
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    char perms[5]{};
+    if (at_line_start && std::sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %4s", &start, &end, perms) == 3) {
+      auto protection = flamingo::PageProtectionType::kNone;
+      if (perms[0] == 'r') protection |= flamingo::PageProtectionType::kRead;
+      if (perms[1] == 'w') protection |= flamingo::PageProtectionType::kWrite;
+      if (perms[2] == 'x') protection |= flamingo::PageProtectionType::kExecute;
+      if (f(start, end, protection)) break;
+    }
+    at_line_start = std::strchr(line, '\n') != nullptr;
+  }
+  std::fclose(maps);
+  return true;
+}
+
+/// @brief Finds unmapped space within range of near and maps a page there with the provided protection.
+/// Returns nullptr if no page could be mapped in range.
+void* MapPageNear(uintptr_t near, int64_t range, flamingo::PageProtectionType protection) {
+  constexpr auto page_size = static_cast<uintptr_t>(flamingo::Page::PageSize);
+  auto const unsigned_range = static_cast<uintptr_t>(range);
+  // The window of page-aligned addresses we are allowed to place a page at. Avoid the zero page entirely.
+  uintptr_t const low =
+      near > unsigned_range + page_size ? flamingo::Page::PageAlign(near - unsigned_range) + page_size : page_size;
+  uintptr_t const high =
+      near < UINTPTR_MAX - unsigned_range ? flamingo::Page::PageAlign(near + unsigned_range) : UINTPTR_MAX;
+  // Collect the closest candidate page from each free gap that intersects our window
+  std::vector<uintptr_t> candidates;
+  auto add_gap = [&](uintptr_t gap_start, uintptr_t gap_end) {
+    gap_start = std::max(gap_start, low);
+    gap_end = std::min(gap_end, high);
+    if (gap_end <= gap_start || gap_end - gap_start < page_size) return;
+    if (gap_end <= near) {
+      // Gap is below us, take the highest page
+      candidates.push_back(flamingo::Page::PageAlign(gap_end - page_size));
+    } else if (gap_start >= near) {
+      // Gap is above us, take the lowest page
+      candidates.push_back(gap_start);
+    } else {
+      // Gap contains us, take our own page if we can
+      candidates.push_back(std::min(flamingo::Page::PageAlign(near), flamingo::Page::PageAlign(gap_end - page_size)));
+    }
+  };
+  uintptr_t previous_end = 0;
+  if (!ForEachMapping([&](uintptr_t start, uintptr_t end, flamingo::PageProtectionType) {
+        add_gap(previous_end, start);
+        previous_end = std::max(previous_end, end);
+        return false;
+      })) {
+    return nullptr;
+  }
+  add_gap(previous_end, high);
+  auto distance = [near](uintptr_t candidate) { return candidate > near ? candidate - near : near - candidate; };
+  std::sort(candidates.begin(), candidates.end(),
+            [&](uintptr_t lhs, uintptr_t rhs) { return distance(lhs) < distance(rhs); });
+  if (candidates.size() > kMaxNearMapAttempts) {
+    candidates.resize(kMaxNearMapAttempts);
+  }
+  for (auto const candidate : candidates) {
+    auto* ptr = ::mmap(reinterpret_cast<void*>(candidate), page_size, static_cast<int>(protection),
+                       MAP_PRIVATE | MAP_ANONYMOUS | kMapFixedNoReplace, -1, 0);
+    if (ptr == MAP_FAILED) {
+      FLAMINGO_DEBUG("Failed to map near page at: {:#x} for: {:#x}. err: {}", candidate, near, std::strerror(errno));
+      continue;
+    }
+    // The kernel may have treated our address as a hint only, so ensure we actually landed in range.
+    if (!IsNear(reinterpret_cast<uintptr_t>(ptr), near, range)) {
+      ::munmap(ptr, page_size);
+      continue;
+    }
+    return ptr;
+  }
+  return nullptr;
+}
+
+/// @brief Returns true if pages of this protection should be dual mapped.
+bool ShouldDualMap(flamingo::PageProtectionType protection) {
+  return (protection & flamingo::PageProtectionType::kExecute) == flamingo::PageProtectionType::kExecute &&
+         (protection & flamingo::PageProtectionType::kWrite) == flamingo::PageProtectionType::kNone;
+}
+
+/// @brief Returns the memfd to use for dual mapping, creating it if needed. Returns -1 if memfds are not supported.
+int GetDualMapFd() {
+  auto& allocator = GetState();
+  if (allocator.dual_map_fd >= 0 || allocator.dual_map_unsupported) return allocator.dual_map_fd;
+#ifdef SYS_memfd_create
+  // Call the syscall directly, since older libcs (and bionic below API 30) do not expose memfd_create.
+  constexpr unsigned int kMemfdCloexec = 1U;
+  allocator.dual_map_fd = static_cast<int>(::syscall(SYS_memfd_create, "flamingo-trampolines", kMemfdCloexec));
+#endif
+  if (allocator.dual_map_fd < 0) {
+    FLAMINGO_DEBUG("Failed to make memfd for dual mapping, falling back to mprotect. err: {}", std::strerror(errno));
+    allocator.dual_map_fd = -1;
+    allocator.dual_map_unsupported = true;
+  }
+  return allocator.dual_map_fd;
+}
+
+/// @brief Marks dual mapping as unsupported, used when the OS lets us make a memfd but not map it how we want.
+void DisableDualMapping([[maybe_unused]] char const* reason) {
+  auto& allocator = GetState();
+  FLAMINGO_DEBUG("Failed to {} for dual mapping, falling back to mprotect. err: {}", reason, std::strerror(errno));
+  allocator.dual_map_unsupported = true;
+}
+
+/// @brief Replaces the (freshly mapped, anonymous) page at page.page.ptr with a page of the dual mapping file, and maps
+/// a read/write alias of it. If anything fails, the page is left (or restored) as an anonymous page and dual mapping is
+/// disabled.
+void DualMapPage(PageState& page) {
+  auto const fd = GetDualMapFd();
+  if (fd < 0) return;
+  auto& allocator = GetState();
+  off_t file_offset = allocator.dual_map_size;
+  if (!allocator.free_file_offsets.empty()) {
+    file_offset = allocator.free_file_offsets.back();
+  } else if (::ftruncate(fd, allocator.dual_map_size + flamingo::Page::PageSize) != 0) {
+    return DisableDualMapping("grow memfd");
+  }
+  // Map the alias first, so that a failure here does not disturb our page
+  auto* alias = ::mmap(nullptr, flamingo::Page::PageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, file_offset);
+  if (alias == MAP_FAILED) {
+    return DisableDualMapping("map writable alias");
+  }
+  // We own the page we are mapping over, so MAP_FIXED is safe here.
+  auto* ptr = ::mmap(page.page.ptr, flamingo::Page::PageSize, static_cast<int>(page.page.protection),
+                     MAP_SHARED | MAP_FIXED, fd, file_offset);
+  if (ptr == MAP_FAILED) {
+    ::munmap(alias, flamingo::Page::PageSize);
+    DisableDualMapping("map executable view");
+    // A failed MAP_FIXED may have unmapped our page already, so put it back.
+    ptr = ::mmap(page.page.ptr, flamingo::Page::PageSize, static_cast<int>(page.page.protection),
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (ptr == MAP_FAILED) {
+      FLAMINGO_ABORT("Failed to restore page at: {} after failing to dual map it. err: {}", fmt::ptr(page.page.ptr),
+                     std::strerror(errno));
+    }
+    return;
+  }
+  if (file_offset == allocator.dual_map_size) {
+    allocator.dual_map_size += flamingo::Page::PageSize;
+  } else {
+    allocator.free_file_offsets.pop_back();
+  }
+  page.alias = alias;
+  page.file_offset = file_offset;
+}
+
+/// @brief Maps a new page for the provided heap, placing it near the heap's anchor if it has one.
+/// Returns nullptr if a near page could not be mapped. Aborts if a far page could not be mapped.
+PageState* MapPageFor(Heap& heap) {
+  void* ptr = nullptr;
+  if (heap.anchor != 0) {
+    ptr = MapPageNear(heap.anchor, flamingo::kNearRange / 2, heap.protection);
+    if (ptr == nullptr) return nullptr;
+  } else {
+    ptr = ::mmap(nullptr, flamingo::Page::PageSize, static_cast<int>(heap.protection), MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0);
+    if (ptr == MAP_FAILED) {
+      // Log error on page allocation!
+      FLAMINGO_ABORT("Failed to allocate page of size: {} with protection: {}. err: {}", flamingo::Page::PageSize,
+                     static_cast<int>(heap.protection), std::strerror(errno));
+    }
+  }
+  auto& page = GetState()
+                   .pages
+                   .emplace(reinterpret_cast<uintptr_t>(ptr),
+                            PageState{ .page = { .ptr = ptr, .used_size = 0, .protection = heap.protection },
+                                       .owner = &heap })
+                   .first->second;
+  if (ShouldDualMap(heap.protection)) {
+    DualMapPage(page);
+  }
+  flamingo::RecordPageProtection(ptr, flamingo::Page::PageSize, heap.protection);
+  FLAMINGO_DEBUG("Allocated fixup page with ptr: {} (writable alias: {}) with protection: {}", fmt::ptr(ptr),
+                 fmt::ptr(page.alias), static_cast<int>(heap.protection));
+  return &page;
+}
+
+/// @brief Gives a page with no live allocations back to the OS. Free list entries on this page become stale.
+void UnmapPage(PageState& page) {
+  FLAMINGO_ASSERT(page.live_size == 0 && !page.borrowed);
+  FLAMINGO_DEBUG("Releasing empty fixup page with ptr: {}", fmt::ptr(page.page.ptr));
+  if (::munmap(page.page.ptr, flamingo::Page::PageSize) != 0) {
+    FLAMINGO_ABORT("Failed to unmap page at: {}. err: {}", fmt::ptr(page.page.ptr), std::strerror(errno));
+  }
+  flamingo::ForgetPageProtections(page.page.ptr, flamingo::Page::PageSize);
+  auto& allocator = GetState();
+  if (page.alias != nullptr) {
+    ::munmap(page.alias, flamingo::Page::PageSize);
+    // Give the memory back as well, the offset itself is reused for the next dual mapped page.
+    if (kPunchHole != 0) {
+      ::fallocate(allocator.dual_map_fd, kPunchHole, page.file_offset, flamingo::Page::PageSize);
+    }
+    allocator.free_file_offsets.push_back(page.file_offset);
+  }
+  allocator.released_pages++;
+  allocator.pages.erase(reinterpret_cast<uintptr_t>(page.page.ptr));
+}
+
+/// @brief Marks [offset, offset + size) of the page as free, coalescing it with any neighboring free blocks.
+/// If the coalesced block ends at the bump pointer of the heap's current page, it is given back to the bump pointer.
+/// Otherwise, it is pushed onto the free list of its size class.
+void ReleaseBlock(PageState& page, uint_fast16_t offset, uint_fast16_t size) {
+  auto& blocks = page.free_blocks;
+  auto next = blocks.lower_bound(offset);
+  if (next != blocks.end() && next->first < offset + size) {
+    FLAMINGO_ABORT("Double free of block at: {} with size: {}!", PointerAt(page, offset), size);
+  }
+  if (next != blocks.end() && next->first == offset + size) {
+    size += next->second;
+    next = blocks.erase(next);
+  }
+  if (next != blocks.begin()) {
+    auto const prev = std::prev(next);
+    if (prev->first + prev->second > offset) {
+      FLAMINGO_ABORT("Double free of block at: {} with size: {}!", PointerAt(page, offset), size);
+    }
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      blocks.erase(prev);
+    }
+  }
+  if (&page == page.owner->current && offset + size == page.page.used_size) {
+    page.page.used_size = offset;
+    return;
+  }
+  blocks.emplace(offset, size);
+  page.owner->free_lists[SizeClassFor(size)].push_back(PointerAt(page, offset));
+}
+
+/// @brief Attempts to pop a valid free block from the provided size class and carve aligned_size out of it.
+Block TakeFreeBlock(Heap& heap, size_t size_class, uint_fast16_t aligned_size) {
+  auto& free_list = heap.free_lists[size_class];
+  while (!free_list.empty()) {
+    auto* ptr = free_list.back();
+    free_list.pop_back();
+    auto* page = FindPage(ptr);
+    if (page == nullptr || page->owner != &heap) continue;
+    auto const offset = static_cast<uint_fast16_t>(static_cast<uint8_t*>(ptr) - static_cast<uint8_t*>(page->page.ptr));
+    auto const block = page->free_blocks.find(offset);
+    if (block == page->free_blocks.end() || SizeClassFor(block->second) != size_class) continue;
+    auto const block_size = block->second;
+    page->free_blocks.erase(block);
+    page->live_size += aligned_size;
+    // Split off whatever we don't need
+    if (block_size > aligned_size) {
+      ReleaseBlock(*page, offset + aligned_size, block_size - aligned_size);
+    }
+    return { page, ptr };
+  }
+  return { nullptr, nullptr };
+}
+
+/// @brief Allocates a block of exactly aligned_size out of the provided heap.
+/// Returns a null Block if the heap needed a new page but could not map one.
+Block AllocateFrom(Heap& heap, uint_fast16_t aligned_size) {
+  auto const size_class = SizeClassFor(aligned_size);
+  // Reuse a freed block of exactly our size class, if we have one
+  if (auto block = TakeFreeBlock(heap, size_class, aligned_size); block.ptr != nullptr) {
+    return block;
+  }
+  // Otherwise, bump allocate from our current page
+  if (heap.current != nullptr && flamingo::Page::PageSize - heap.current->page.used_size >= aligned_size) {
+    auto* ptr = PointerAt(*heap.current, heap.current->page.used_size);
+    heap.current->page.used_size += aligned_size;
+    heap.current->live_size += aligned_size;
+    return { heap.current, ptr };
+  }
+  // Otherwise, split a larger freed block
+  for (auto larger = size_class + 1; larger < kNumSizeClasses; larger++) {
+    if (auto block = TakeFreeBlock(heap, larger, aligned_size); block.ptr != nullptr) {
+      return block;
+    }
+  }
+  // Otherwise, we need a new page
+  auto* page = MapPageFor(heap);
+  if (page == nullptr) return { nullptr, nullptr };
+  auto* retired = std::exchange(heap.current, page);
+  if (retired != nullptr) {
+    // Retire the previous page, making its tail reusable so that it isn't wasted
+    auto const used_size = std::exchange(retired->page.used_size, flamingo::Page::PageSize);
+    if (used_size < flamingo::Page::PageSize) {
+      ReleaseBlock(*retired, used_size, flamingo::Page::PageSize - used_size);
+    }
+    if (retired->live_size == 0) {
+      UnmapPage(*retired);
+    }
+  }
+  page->page.used_size = aligned_size;
+  page->live_size = aligned_size;
+  return { page, page->page.ptr };
+}
+
+/// @brief Finds (or makes) the heap for the provided protection and anchor. An anchor of 0 means the far heap.
+Heap& HeapFor(flamingo::PageProtectionType protection, uintptr_t near) {
+  auto& heaps = GetState().heaps;
+  for (auto& heap : heaps) {
+    if (heap->protection != protection) continue;
+    if (near == 0 ? heap->anchor == 0 : (heap->anchor != 0 && IsNear(heap->anchor, near, flamingo::kNearRange / 2))) {
+      return *heap;
+    }
+  }
+  return *heaps.emplace_back(std::make_unique<Heap>(Heap{ .protection = protection, .anchor = near }));
+}
+
+/// @brief A loaded module, as its PT_LOAD segments, each as a [start, end) in memory.
+struct Module {
+  std::vector<std::pair<uintptr_t, uintptr_t>> segments{};
+  std::vector<std::pair<uintptr_t, uintptr_t>> executable_segments{};
+};
+
+/// @brief Returns the module that addr lies within, or a Module with no segments if it is not within any.
+Module FindModule(uintptr_t addr) {
+  struct Search {
+    uintptr_t addr;
+    Module module;
+  } search{ .addr = addr, .module = {} };
+  dl_iterate_phdr(
+      [](dl_phdr_info* info, size_t, void* data) {
+        auto& search = *static_cast<Search*>(data);
+        auto const loads = std::span(info->dlpi_phdr, info->dlpi_phnum);
+        auto const contains = [&](ElfW(Phdr) const& phdr) {
+          auto const start = info->dlpi_addr + phdr.p_vaddr;
+          return phdr.p_type == PT_LOAD && search.addr >= start && search.addr < start + phdr.p_memsz;
+        };
+        if (std::none_of(loads.begin(), loads.end(), contains)) return 0;
+        for (auto const& phdr : loads) {
+          if (phdr.p_type != PT_LOAD) continue;
+          std::pair<uintptr_t, uintptr_t> const segment{ info->dlpi_addr + phdr.p_vaddr,
+                                                         info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz };
+          search.module.segments.push_back(segment);
+          if ((phdr.p_flags & PF_X) != 0) {
+            search.module.executable_segments.push_back(segment);
+          }
+        }
+        // Stop iterating, we found our module
+        return 1;
+      },
+      &search);
+  return search.module;
+}
+
+/// @brief The smallest run of padding that is used as a code cave. Shorter runs are more likely to be something other
+/// than linker fill, and too small for most fixups anyways.
+constexpr uintptr_t kMinCaveSize = 4 * kGranuleSize;
+
+/// @brief Returns true if word is padding that a linker may fill gaps in executable segments with: zero fill (as GNU
+/// ld uses), or the trap instruction fill used by lld. Other UDFs are not fill, so they are never treated as padding.
+bool IsPaddingWord(uint32_t word) {
+  constexpr uint32_t kLldTrapFill = 0xd4d4d4d4U;
+  return word == 0 || word == kLldTrapFill;
+}
+
+/// @brief Calls f with every granule aligned [start, end) run of padding words within [begin, end) of readable memory
+/// that is at least kMinCaveSize long.
+template <class F>
+void ForEachPaddingRun(uintptr_t begin, uintptr_t end, F&& f) {
+  auto const* words = reinterpret_cast<uint32_t const*>(AlignUp(begin, sizeof(uint32_t)));
+  auto const* const words_end = reinterpret_cast<uint32_t const*>(end & ~(sizeof(uint32_t) - 1));
+  while (words < words_end) {
+    auto const* run_end = std::find_if_not(words, words_end, IsPaddingWord);
+    auto const run_start = AlignUp(reinterpret_cast<uintptr_t>(words), static_cast<uintptr_t>(kGranuleSize));
+    auto const aligned_run_end = reinterpret_cast<uintptr_t>(run_end) & ~static_cast<uintptr_t>(kGranuleSize - 1);
+    if (aligned_run_end >= run_start + kMinCaveSize) {
+      f(run_start, aligned_run_end);
+    }
+    words = std::find_if(run_end, words_end, IsPaddingWord);
+  }
+}
+
+/// @brief Makes the free block [start, end) of a module's page available to the near heap of the page's protection.
+/// The block must lie within a single page, outside of every segment of its module.
+void AddCodeCave(uintptr_t start, uintptr_t end, flamingo::PageProtectionType protection) {
+  auto const page_addr = flamingo::Page::PageAlign(start);
+  auto& heap = HeapFor(protection, start);
+  auto& page = GetState()
+                   .pages
+                   .try_emplace(page_addr,
+                                PageState{ .page = { .ptr = reinterpret_cast<void*>(page_addr),
+                                                     .used_size = flamingo::Page::PageSize,
+                                                     .protection = protection },
+                                           .owner = &heap,
+                                           .borrowed = true })
+                   .first->second;
+  // Two caves on the same page always share a protection, and thus a heap
+  FLAMINGO_ASSERT(page.borrowed && page.owner == &heap);
+  FLAMINGO_DEBUG("Found code cave at: {:#x} with size: {}", start, end - start);
+  GetState().code_cave_bytes += end - start;
+  ReleaseBlock(page, static_cast<uint_fast16_t>(start - page_addr), static_cast<uint_fast16_t>(end - start));
+}
+
+/// @brief The first time a near allocation is made within a loaded module, hands its code caves out to the near heaps.
+/// A code cave is any run of padding in the pages of an executable segment that lies outside of every segment of the
+/// module, and is therefore never used by the module itself. Padding within segments is left alone, since there is no
+/// telling it apart from literal data.
+/// Note that caves do not save memory: the first write to a cave makes a private copy of the module's page, which is
+/// as much dirty memory as mapping a page of our own (though every cave on that page shares it). What they save is
+/// address space near the module, where a page of our own may not fit. Cave pages are also never dual mapped, so
+/// writes to them change the protection of the module's page (see ProtectionWriter), as writes to hook targets do.
+void ClaimCodeCaves(uintptr_t near) {
+  auto& allocator = GetState();
+  if (std::any_of(allocator.scanned_modules.begin(), allocator.scanned_modules.end(),
+                  [near](auto const& range) { return near >= range.first && near < range.second; })) {
+    return;
+  }
+  auto const module = FindModule(near);
+  if (module.segments.empty()) return;
+  std::pair<uintptr_t, uintptr_t> module_range{ UINTPTR_MAX, 0 };
+  for (auto const& [start, end] : module.segments) {
+    module_range = { std::min(module_range.first, start), std::max(module_range.second, end) };
+  }
+  allocator.scanned_modules.push_back(module_range);
+  constexpr auto page_size = static_cast<uintptr_t>(flamingo::Page::PageSize);
+  for (auto const& [segment_start, segment_end] : module.executable_segments) {
+    // The page before the start of the segment, and the page after its end, are mapped along with the segment
+    std::array<std::pair<uintptr_t, uintptr_t>, 2> const slack{ {
+        { flamingo::Page::PageAlign(segment_start), segment_start },
+        { segment_end, AlignUp(segment_end, page_size) },
+    } };
+    for (auto const& [start, end] : slack) {
+      if (start == end) continue;
+      if (std::any_of(module.segments.begin(), module.segments.end(),
+                      [&](auto const& segment) { return segment.first < end && segment.second > start; })) {
+        continue;
+      }
+      auto const protection = flamingo::GetPageProtection(reinterpret_cast<void const*>(start));
+      auto const readable_executable = flamingo::PageProtectionType::kRead | flamingo::PageProtectionType::kExecute;
+      if ((protection & readable_executable) != readable_executable) continue;
+      ForEachPaddingRun(start, end, [&](uintptr_t run_start, uintptr_t run_end) {
+        AddCodeCave(run_start, run_end, protection);
+      });
+    }
+  }
+}
+
+/// @brief Validates the parameters of an allocation and returns the size it should be rounded up to.
+uint_fast16_t AlignedSizeFor(uint_fast16_t alignment, uint_fast16_t size) {
+  if (alignment > kGranuleSize || size > flamingo::Page::PageSize) {
+    FLAMINGO_ABORT("Cannot allocate size: {} with alignment: {}! Allocations must be <= {} and aligned <= {}", size,
+                   alignment, flamingo::Page::PageSize, kGranuleSize);
+  }
+  return AlignUp(std::max<uint_fast16_t>(size, 1), kGranuleSize);
+}
+
+flamingo::PointerWrapper<uint32_t> MakeAllocation(Block block, uint_fast16_t size,
+                                                  flamingo::PageProtectionType protection) {
+  if (block.ptr == nullptr) {
+    return flamingo::PointerWrapper<uint32_t>(std::span<uint32_t>{}, protection);
+  }
+  auto* start = static_cast<uint32_t*>(block.ptr);
+  uint32_t* writable = nullptr;
+  if (block.page->alias != nullptr) {
+    auto const offset = static_cast<uint8_t*>(block.ptr) - static_cast<uint8_t*>(block.page->page.ptr);
+    writable = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(block.page->alias) + offset);
+  }
+  return flamingo::PointerWrapper<uint32_t>(std::span<uint32_t>(start, start + size / sizeof(uint32_t)), protection,
+                                            writable);
+}
 }  // namespace
 
 namespace flamingo {
 
 PointerWrapper<uint32_t> Allocate(uint_fast16_t alignment, uint_fast16_t size, PageProtectionType protection) {
-  // We assume that size is never > the size of a Page
   // Note: This is NOT a thread safe allocator (for now)
-  __builtin_assume(size <= Page::PageSize);
-  if (all_pages == nullptr) {
-    all_pages = new std::unordered_multimap<PageProtectionType, Page>{};
-  }
-  // We allocate first by trying to find a matching page that has space
-  for (auto& [perms, page] : *all_pages) {
-    if (perms == protection) {
-      // If we match the protection bits we set
-      // Check to see if we have enough free space for an allocation
-      auto start_offset = AlignUp(page.used_size, alignment);
-      if (Page::PageSize - start_offset >= size) {
-        // We have enough space to allocate within an existing page
-        page.used_size = start_offset + size;
-        return PointerWrapper(
-            std::span<uint32_t>{
-              reinterpret_cast<uint32_t*>(&reinterpret_cast<uint8_t*>(page.ptr)[start_offset]),
-              reinterpret_cast<uint32_t*>(&reinterpret_cast<uint8_t*>(page.ptr)[start_offset + size]) },
-            protection);
-      }
-    }
+  auto const aligned_size = AlignedSizeFor(alignment, size);
+  // The far heap can always map a new page (or aborts), so this never fails.
+  return MakeAllocation(AllocateFrom(HeapFor(protection, 0), aligned_size), size, protection);
+}
+
+PointerWrapper<uint32_t> AllocateNear(void const* near, uint_fast16_t alignment, uint_fast16_t size,
+                                      PageProtectionType protection) {
+  auto const aligned_size = AlignedSizeFor(alignment, size);
+  // 0 is reserved for the far heap, and nothing is ever near it anyways
+  auto const near_addr = std::max<uintptr_t>(reinterpret_cast<uintptr_t>(near), Page::PageSize);
+  ClaimCodeCaves(near_addr);
+  auto const block = AllocateFrom(HeapFor(protection, near_addr), aligned_size);
+  if (block.ptr == nullptr) {
+    FLAMINGO_DEBUG("Could not find any free space near: {} for size: {}", fmt::ptr(near), size);
   }
-  // No page exists that has matching permissions and has enough space
-  // Make one.
-  void* ptr;
-  if (::posix_memalign(&ptr, Page::PageSize, Page::PageSize) != 0) {
-    // Log error on memalign allocation!
-    FLAMINGO_ABORT("Failed to allocate page of size: {} for size: {} with protection: {}. err: {}", Page::PageSize,
-                   size, static_cast<int>(protection), std::strerror(errno));
+  return MakeAllocation(block, size, protection);
+}
+
+void Deallocate(PointerWrapper<uint32_t> allocation) {
+  if (allocation.addr.empty()) return;
+  auto* page = FindPage(allocation.addr.data());
+  if (page == nullptr) {
+    FLAMINGO_ABORT("Cannot deallocate: {} with size: {} as it was not allocated by flamingo!",
+                   fmt::ptr(allocation.addr.data()), allocation.addr.size_bytes());
+  }
+  uint_fast16_t const aligned_size = std::max<uint_fast16_t>(AlignUp(allocation.addr.size_bytes(), kGranuleSize),
+                                                             kGranuleSize);
+  auto const offset = static_cast<uint_fast16_t>(reinterpret_cast<uint8_t*>(allocation.addr.data()) -
+                                                 static_cast<uint8_t*>(page->page.ptr));
+  FLAMINGO_ASSERT(page->live_size >= aligned_size);
+  page->live_size -= aligned_size;
+  GetState().total_freed_bytes += aligned_size;
+  ReleaseBlock(*page, offset, aligned_size);
+  // Once a page has nothing left in it, give it back (unless we are still bump allocating from it, or it isn't ours)
+  if (page->live_size == 0 && page != page->owner->current && !page->borrowed) {
+    UnmapPage(*page);
+  }
+}
+
+PageProtectionType GetPageProtection(void const* ptr) {
+  auto const page = Page::PageAlign(reinterpret_cast<uintptr_t>(ptr));
+  auto& protections = GetState().page_protections;
+  if (auto itr = protections.find(page); itr != protections.end()) {
+    return itr->second;
   }
-  // Mark full page for protection
-  if (::mprotect(ptr, Page::PageSize, static_cast<int>(protection)) != 0) {
+  // First time seeing this page, so find out what it actually is
+  auto protection = PageProtectionType::kNone;
+  bool found = false;
+  ForEachMapping([&](uintptr_t start, uintptr_t end, PageProtectionType mapping_protection) {
+    if (page < start || page >= end) return false;
+    protection = mapping_protection;
+    found = true;
+    return true;
+  });
+  if (!found) {
+    // Either /proc/self/maps is unreadable or the page is not mapped, either way, don't remember a guess.
+    FLAMINGO_DEBUG("Could not find protection for page: {:#x}", page);
+    return protection;
+  }
+  return protections.emplace(page, protection).first->second;
+}
+
+void ProtectPages(void const* ptr, size_t size, PageProtectionType protection) {
+  // If we have nothing in the address, don't bother protecting
+  if (size == 0) return;
+  auto const first_page = Page::PageAlign(reinterpret_cast<uintptr_t>(ptr));
+  auto const end = reinterpret_cast<uintptr_t>(ptr) + size;
+  bool unchanged = true;
+  for (auto page = first_page; page < end && unchanged; page += Page::PageSize) {
+    unchanged = GetPageProtection(reinterpret_cast<void const*>(page)) == protection;
+  }
+  if (unchanged) return;
+  if (::mprotect(reinterpret_cast<void*>(first_page), end - first_page, static_cast<int>(protection)) != 0) {
     // Log error on mprotect!
-    FLAMINGO_ABORT("Failed to mark allocated page at: {} with permissions: {}. err: {}", fmt::ptr(ptr),
-                   static_cast<int>(protection), std::strerror(errno));
-  }
-  auto const page = all_pages->emplace(protection, Page{ .ptr = ptr, .used_size = size, .protection = protection });
-  FLAMINGO_DEBUG("Allocated fixup page with ptr: {} with size: {}", fmt::ptr(ptr), size);
-  return PointerWrapper(
-      std::span<uint32_t>{ reinterpret_cast<uint32_t*>(&reinterpret_cast<uint8_t*>(page->second.ptr)[0]),
-                           reinterpret_cast<uint32_t*>(&reinterpret_cast<uint8_t*>(page->second.ptr)[size]) },
-      protection);
+    FLAMINGO_ABORT("Failed to mark ptr at: {} (page aligned: {:#x}) with size: {} with permissions: {}. err: {}",
+                   fmt::ptr(ptr), first_page, end - first_page, static_cast<int>(protection), std::strerror(errno));
+  }
+  RecordPageProtection(reinterpret_cast<void const*>(first_page), end - first_page, protection);
+}
+
+void RecordPageProtection(void const* ptr, size_t size, PageProtectionType protection) {
+  auto& protections = GetState().page_protections;
+  auto const end = reinterpret_cast<uintptr_t>(ptr) + size;
+  for (auto page = Page::PageAlign(reinterpret_cast<uintptr_t>(ptr)); page < end; page += Page::PageSize) {
+    protections.insert_or_assign(page, protection);
+  }
+}
+
+void ForgetPageProtections(void const* ptr, size_t size) {
+  auto& protections = GetState().page_protections;
+  auto const start = reinterpret_cast<uintptr_t>(ptr);
+  auto const end = start + size;
+  for (auto page = Page::PageAlign(start); page < end; page += Page::PageSize) {
+    protections.erase(page);
+    // The memory is going away, so an open batch must not touch it either
+    batch.pages_to_restore.erase(page);
+  }
+  std::erase_if(batch.flush_ranges, [&](auto const& range) { return range.first < end && range.second > start; });
+}
+
+WriteBatch::WriteBatch() {
+  batch.depth++;
+}
+
+WriteBatch::~WriteBatch() {
+  if (--batch.depth != 0) return;
+  // Flush the icache over merged ranges
+  auto& ranges = batch.flush_ranges;
+  std::sort(ranges.begin(), ranges.end());
+  for (size_t i = 0; i < ranges.size();) {
+    auto [begin, end] = ranges[i];
+    for (i++; i < ranges.size() && ranges[i].first <= end; i++) {
+      end = std::max(end, ranges[i].second);
+    }
+    __builtin___clear_cache(reinterpret_cast<char*>(begin), reinterpret_cast<char*>(end));
+  }
+  ranges.clear();
+  // Restore each page, merging runs of adjacent pages that share an original protection into one mprotect
+  auto& pages = batch.pages_to_restore;
+  for (auto itr = pages.begin(); itr != pages.end();) {
+    auto const [start, protection] = *itr;
+    auto end = start + Page::PageSize;
+    for (itr++; itr != pages.end() && itr->first == end && itr->second == protection; itr++) {
+      end += Page::PageSize;
+    }
+    ProtectPages(reinterpret_cast<void const*>(start), end - start, protection);
+  }
+  pages.clear();
+}
+
+PageProtectionType BeginPageWrite(uintptr_t page) {
+  if (batch.depth != 0) {
+    // If this batch already made this page writable, the protection we see now is not the original one
+    if (auto itr = batch.pages_to_restore.find(page); itr != batch.pages_to_restore.end()) {
+      return itr->second;
+    }
+  }
+  auto const original = GetPageProtection(reinterpret_cast<void const*>(page));
+  ProtectPages(reinterpret_cast<void const*>(page), Page::PageSize, original | PageProtectionType::kWrite);
+  if (batch.depth != 0) {
+    batch.pages_to_restore.emplace(page, original);
+  }
+  return original;
+}
+
+void EndPageWrite(uintptr_t page, PageProtectionType original) {
+  // Within a batch, the page is restored when the batch ends
+  if (batch.depth != 0) return;
+  ProtectPages(reinterpret_cast<void const*>(page), Page::PageSize, original);
+}
+
+void FlushInstructionCache(void const* begin, void const* end) {
+  if (batch.depth != 0) {
+    batch.flush_ranges.emplace_back(reinterpret_cast<uintptr_t>(begin), reinterpret_cast<uintptr_t>(end));
+    return;
+  }
+  __builtin___clear_cache(reinterpret_cast<char*>(const_cast<void*>(begin)),
+                          reinterpret_cast<char*>(const_cast<void*>(end)));
+}
+
+AllocatorStats GetAllocatorStats() {
+  auto& allocator = GetState();
+  AllocatorStats stats{
+    .mapped_pages = 0,
+    .live_bytes = 0,
+    .free_bytes = 0,
+    .unused_bytes = 0,
+    .total_freed_bytes = allocator.total_freed_bytes,
+    .released_pages = allocator.released_pages,
+    .dual_mapped_pages = 0,
+    .code_cave_bytes = allocator.code_cave_bytes,
+  };
+  for (auto const& [_, page] : allocator.pages) {
+    stats.live_bytes += page.live_size;
+    // Borrowed pages are not ours, so only the bytes handed out from them count
+    if (page.borrowed) continue;
+    stats.mapped_pages++;
+    stats.dual_mapped_pages += page.alias != nullptr ? 1 : 0;
+    stats.unused_bytes += Page::PageSize - page.page.used_size;
+    for (auto const& [_, size] : page.free_blocks) {
+      stats.free_bytes += size;
+    }
+  }
+  return stats;
 }
 
 }  // namespace flamingo
@@ -1,7 +1,11 @@
+#include <array>
 #include <cstdint>
 #include <span>
 #include <utility>
+#include <variant>
+#include "arm64-decoder.hpp"
 #include "calling-convention.hpp"
+#include "fixups.hpp"
 #include "hook-data.hpp"
 #include "hook-metadata.hpp"
 #include "installer.hpp"
@@ -23,6 +27,27 @@ auto perform_far_hook_test(uintptr_t hook_location, std::span<uint8_t> to_hook)
                    hook_span);
 }
 
+// Validates that target was patched with a single B to a near stub, which performs a far jump to destination.
+void validate_near_stub(std::span<uint32_t> target, uintptr_t destination, std::string_view test_name) {
+  uint32_t const* stub = nullptr;
+  {
+    TestWrapper validator(target, test_name);
+    print_decode_loop(target);
+    stub = validator.expect_b_any();
+    // Only a single instruction is patched, the rest of the target is untouched
+    validator.expect_opc(ARM64_INS_STP);
+  }
+  std::span<uint32_t const> stub_span(stub, flamingo::ShimTarget::kStubInstCount);
+  TestWrapper validator(stub_span, fmt::format("{} (stub)", test_name));
+  print_decode_loop(stub_span);
+  // Callback (ldr x17, DATA[0]; br x17)
+  validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, round_up8(&stub[2]));
+  validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+  // Data validation
+  // Check callback point is valid
+  validator.expect_big_data(destination);
+}
+
 void test_simple_hook() {
   // Boilerplate for the test wrapper
   uintptr_t hook_function_to_call = 0x12345678;
@@ -41,23 +66,16 @@ void test_simple_hook() {
     init_hook.expect_opc(ARM64_INS_ADD);
   }
   auto hook_target_far = perform_far_hook_test(hook_function_to_call, to_hook);
+  // Free whatever earlier tests retired, so that only this target's fixups are retired below
+  flamingo::ReclaimRetiredFixups();
+  auto const stats_before = flamingo::GetAllocatorStats();
   auto result = flamingo::Install(
       flamingo::HookInfo{ (void (*)())hook_function_to_call, hook_target_far.data(), (void (**)()) nullptr });
   if (!result.has_value()) {
     ERROR("Installation result failed, index: {}", result.error());
   }
-  // Validate target looks good (should call hook_function_to_call)
-  {
-    TestWrapper validator(hook_target_far, "Far hook no fixups");
-    print_decode_loop(hook_target_far);
-    // Callback (ldr x17, DATA[0]; br x17)
-    validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
-          round_up8(&hook_target_far[2]));
-    validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
-    // Data validation
-    // Check callback point is valid
-    validator.expect_big_data(hook_function_to_call);
-  }
+  // Validate target looks good (should call hook_function_to_call through a near stub)
+  validate_near_stub(hook_target_far, hook_function_to_call, "Near hook no fixups");
   // Uninstall the hook and ensure the data returns to its natural state
   {
     auto uninstall_result = flamingo::Uninstall(result.value().returned_handle);
@@ -75,6 +93,26 @@ void test_simple_hook() {
     validate_uninstall.expect_opc(ARM64_INS_STP);
     validate_uninstall.expect_opc(ARM64_INS_ADD);
   }
+  // Uninstalling should have retired the fixups, so nothing else reuses them while a thread may still be in them
+  {
+    auto const stats_after = flamingo::GetAllocatorStats();
+    if (stats_after.live_bytes <= stats_before.live_bytes) {
+      ERROR("Uninstall should have kept the fixups for the target allocated! Live bytes before: {} after: {}",
+            stats_before.live_bytes, stats_after.live_bytes);
+    }
+  }
+  // Reclaiming should give them back
+  {
+    if (flamingo::ReclaimRetiredFixups() != 1) {
+      ERROR("Expected to reclaim exactly the fixups of the uninstalled target at: {}",
+            fmt::ptr(hook_target_far.data()));
+    }
+    auto const stats_after = flamingo::GetAllocatorStats();
+    if (stats_after.live_bytes != stats_before.live_bytes) {
+      ERROR("Reclaiming should have freed all allocations for the target! Live bytes before: {} after: {}",
+            stats_before.live_bytes, stats_after.live_bytes);
+    }
+  }
 }
 
 void test_hook_with_orig() {
@@ -109,17 +147,24 @@ void test_hook_with_orig() {
     }
     TestWrapper fixups(fixup_result.value(), "Fixup data");
     print_decode_loop(fixup_result.value());
+    // Only the single patched instruction needs to be fixed up
     fixups.expect_opc(ARM64_INS_STR);
-    fixups.expect_opc(ARM64_INS_STP);
-    fixups.expect_opc(ARM64_INS_STP);
-    fixups.expect_opc(ARM64_INS_STP);
-    // Callback (ldr x17, DATA[0]; br x17)
-    fixups.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
-          round_up8(&fixup_result.value()[6]));
-    fixups.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
-    // Data validation
-    // Check callback point is valid
-    fixups.expect_big_data(reinterpret_cast<uint64_t>(&hook_target_far[4]));
+    // Callback (fixups are allocated near the target)
+    fixups.expect_b(&hook_target_far[1]);
+  }
+  // Straight-line fixups leave the peephole pass nothing to remove
+  {
+    auto stats = flamingo::PeepholeStatsFor(flamingo::TargetDescriptor(hook_target_far.data()));
+    if (!stats.has_value()) {
+      ERROR("Failed to get peephole stats for target: {}", fmt::ptr(hook_target_far.data()));
+    }
+    if (stats.value().removed_insts != 0 || stats.value().threaded_branches != 0 || stats.value().saved_bytes != 0) {
+      ERROR("Expected no peephole savings, got: {} removed, {} threaded, {} bytes saved", stats.value().removed_insts,
+            stats.value().threaded_branches, stats.value().saved_bytes);
+    }
+    if (flamingo::PeepholeStatsFor(flamingo::TargetDescriptor(&to_hook[0])).has_value()) {
+      ERROR("Expected no peephole stats for unhooked target: {}", fmt::ptr(&to_hook[0]));
+    }
   }
 }
 
@@ -149,18 +194,8 @@ void test_multi_hook() {
   if (!result.has_value()) {
     ERROR("Installation result for hook 2 failed, index: {}", result.error().index());
   }
-  // Validate target looks good (should call hook_function_to_call_2)
-  {
-    TestWrapper validator(hook_target_far, "Far hook no fixups");
-    print_decode_loop(hook_target_far);
-    // Callback (ldr x17, DATA[0]; br x17)
-    validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
-          round_up8(&hook_target_far[2]));
-    validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
-    // Data validation
-    // Check callback point is valid
-    validator.expect_big_data(hook_function_to_call_2);
-  }
+  // Validate target looks good (should call hook_function_to_call_2 through the same near stub)
+  validate_near_stub(hook_target_far, hook_function_to_call_2, "Near hook multiple hooks");
   // Hook 2's orig pointer should refer to hook 1's target
   if ((uintptr_t)orig_two != hook_function_to_call) {
     ERROR("Hook 2 should call hook 1 as part of hook 2's orig call! Instead, hook 2's orig is: 0x{:x}", (uintptr_t)orig_two);
@@ -182,10 +217,654 @@ void test_multi_hook() {
     ERROR("Hook 2 should fixups for the target as part of hook 2's orig call! Instead, hook 2's orig is: 0x{:x} and the fixups are: {}", (uintptr_t)orig_two, fmt::ptr(fixup_result.value().data()));
   }
 }
+void test_small_near_hook() {
+  // Boilerplate for the test wrapper
+  uintptr_t hook_function_to_call = 0x12345678;
+  void* fixup_result_ptr = nullptr;
+  static uint8_t to_hook[]{ 0xf7, 0x0f, 0x1c, 0xf8, 0xf6, 0x57, 0x01, 0xa9, 0xf4, 0x4f, 0x02, 0xa9, 0xfd, 0x7b, 0x03,
+                            0xa9, 0xfd, 0xc3, 0x00, 0x91, 0x48, 0x18, 0x40, 0xf9, 0x16, 0xd4, 0x42, 0xa9, 0xf3, 0x03,
+                            0x02, 0xaa, 0xf4, 0x03, 0x01, 0xaa, 0x17, 0x01, 0x40, 0xf9, 0xe8, 0xba, 0x44, 0x39 };
+  // A hook with an orig on a target that only has 2 instructions to work with.
+  // This is too small for a far hook, but a near hook only needs to overwrite a single instruction.
+  auto hook_target_far = perform_far_hook_test(hook_function_to_call, to_hook);
+  auto result = flamingo::Install(flamingo::HookInfo{
+    reinterpret_cast<void*>(hook_function_to_call), hook_target_far.data(), &fixup_result_ptr, 2,
+    flamingo::CallingConvention::Cdecl, flamingo::HookNameMetadata{ .name = "small" }, flamingo::HookPriority{},
+    flamingo::InstallationMetadata{ .need_orig = true, .is_midpoint = false, .write_prot = false } });
+  if (!result.has_value()) {
+    ERROR("Installation result failed: {}", result.error());
+  }
+  validate_near_stub(hook_target_far, hook_function_to_call, "Near hook small target");
+  {
+    auto fixup_result = flamingo::FixupPointerFor(flamingo::TargetDescriptor(hook_target_far.data()));
+    if (!fixup_result.has_value()) {
+      ERROR("Failed to get fixup pointer for target: {}", fmt::ptr(hook_target_far.data()));
+    }
+    TestWrapper fixups(fixup_result.value(), "Near hook small target fixups");
+    print_decode_loop(fixup_result.value());
+    fixups.expect_opc(ARM64_INS_STR);
+    // Callback
+    fixups.expect_b(&hook_target_far[1]);
+  }
+  if (fixup_result_ptr != flamingo::FixupPointerFor(flamingo::TargetDescriptor(hook_target_far.data())).value().data()) {
+    ERROR("Orig should point to the fixups! Instead, orig is: {}", fixup_result_ptr);
+  }
+  auto uninstall_result = flamingo::Uninstall(result.value().returned_handle);
+  if (!uninstall_result.has_value()) {
+    ERROR("Failed to uninstall: failure mode: {}", uninstall_result.error());
+  }
+  TestWrapper validate_uninstall(hook_target_far, "Near hook small target after uninstall");
+  print_decode_loop(hook_target_far);
+  validate_uninstall.expect_opc(ARM64_INS_STR);
+  validate_uninstall.expect_opc(ARM64_INS_STP);
+}
+
+void test_analyzed_function_size() {
+  uintptr_t hook_function_to_call = 0x12345678;
+  void* fixup_result_ptr = nullptr;
+  // ret; stp x29, x30, [sp, #-0x10]!; mov x29, sp
+  static uint8_t to_hook[]{ 0xc0, 0x03, 0x5f, 0xd6, 0xfd, 0x7b, 0xbf, 0xa9, 0xfd, 0x03, 0x00, 0x91 };
+  auto hook_target_far = perform_far_hook_test(hook_function_to_call, to_hook);
+  // The function ends at its first instruction, so there is nothing for an orig to return to, whatever we are told
+  auto result = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, hook_target_far.data(), (void (**)()) &fixup_result_ptr });
+  if (result.has_value() || !std::holds_alternative<flamingo::installation::TargetTooSmall>(result.error())) {
+    ERROR("Installing a hook with an orig onto a function with a single instruction should fail with: {}",
+          "TargetTooSmall");
+  }
+  if (std::get<flamingo::installation::TargetTooSmall>(result.error()).actual_num_insts != 1) {
+    ERROR("Function should have been found to have a single instruction, not: {}",
+          std::get<flamingo::installation::TargetTooSmall>(result.error()).actual_num_insts);
+  }
+  // Without an orig, only the single instruction is patched
+  result = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, hook_target_far.data(), (void (**)()) nullptr });
+  if (!result.has_value()) {
+    ERROR("Installation result failed: {}", result.error());
+  }
+  auto const metadata = flamingo::MetadataFor(flamingo::TargetDescriptor(hook_target_far.data()));
+  if (metadata.value().method_num_insts != 1) {
+    ERROR("Target should have a single instruction, not: {}", metadata.value().method_num_insts);
+  }
+  validate_near_stub(hook_target_far.first(2), hook_function_to_call, "Analyzed function size");
+  if (!flamingo::Uninstall(result.value().returned_handle).has_value()) {
+    ERROR("Failed to uninstall hook at: {}", fmt::ptr(hook_target_far.data()));
+  }
+  // A branch back into the start of the function from past its declared size still limits the patch
+  // stp x29, x30, [sp, #-0x10]!; mov x29, sp; nop; nop; nop; nop; b.ne #-0x14; ret
+  static uint8_t to_hook_loop[]{ 0xfd, 0x7b, 0xbf, 0xa9, 0xfd, 0x03, 0x00, 0x91, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20,
+                                 0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0x61, 0xff, 0xff, 0x54,
+                                 0xc0, 0x03, 0x5f, 0xd6 };
+  auto hook_target_loop = perform_far_hook_test(hook_function_to_call, to_hook_loop);
+  result = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, hook_target_loop.data(), (void (**)()) nullptr });
+  if (!result.has_value()) {
+    ERROR("Installation result failed: {}", result.error());
+  }
+  auto const loop_metadata = flamingo::MetadataFor(flamingo::TargetDescriptor(hook_target_loop.data()));
+  if (loop_metadata.value().safe_patch_size != 1) {
+    ERROR("Only the first instruction should be safe to patch, not: {}", loop_metadata.value().safe_patch_size);
+  }
+  if (!flamingo::Uninstall(result.value().returned_handle).has_value()) {
+    ERROR("Failed to uninstall hook at: {}", fmt::ptr(hook_target_loop.data()));
+  }
+}
+
+void test_recompile_for_orig() {
+  uintptr_t hook_function_to_call = 0x12345678;
+  uintptr_t hook_function_to_call_2 = 0x12345679;
+  void* orig_two = nullptr;
+  static uint8_t to_hook[]{ 0xf7, 0x0f, 0x1c, 0xf8, 0xf6, 0x57, 0x01, 0xa9, 0xf4, 0x4f, 0x02, 0xa9, 0xfd, 0x7b, 0x03,
+                            0xa9, 0xfd, 0xc3, 0x00, 0x91, 0x48, 0x18, 0x40, 0xf9, 0x16, 0xd4, 0x42, 0xa9, 0xf3, 0x03,
+                            0x02, 0xaa, 0xf4, 0x03, 0x01, 0xaa, 0x17, 0x01, 0x40, 0xf9, 0xe8, 0xba, 0x44, 0x39 };
+  // The first hook has no orig, so its fixups are never written
+  auto hook_target_far = perform_far_hook_test(hook_function_to_call, to_hook);
+  auto result = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, hook_target_far.data(), (void (**)()) nullptr });
+  if (!result.has_value()) {
+    ERROR("Installation result failed: {}", result.error());
+  }
+  // A hook that knows the target is smaller than it is and needs an orig cannot fit past our patch
+  {
+    auto too_small = flamingo::Install(flamingo::HookInfo{
+      reinterpret_cast<void*>(hook_function_to_call_2), hook_target_far.data(), &orig_two, 1,
+      flamingo::CallingConvention::Cdecl, flamingo::HookNameMetadata{ .name = "too small" }, flamingo::HookPriority{},
+      flamingo::InstallationMetadata{ .need_orig = true, .is_midpoint = false, .write_prot = false } });
+    if (too_small.has_value() ||
+        !std::holds_alternative<flamingo::installation::TargetTooSmall>(too_small.error())) {
+      ERROR("Installing a hook with an orig onto a single instruction should fail with: {}", "TargetTooSmall");
+    }
+    auto const metadata = flamingo::MetadataFor(flamingo::TargetDescriptor(hook_target_far.data()));
+    if (metadata.value().method_num_insts != flamingo::HookInfo::kDefaultNumInsts ||
+        metadata.value().metadata.need_orig) {
+      ERROR("A failed install should not change the target, but it has: {} instructions",
+            metadata.value().method_num_insts);
+    }
+  }
+  // The final hook needs an orig, which must recompile the fixups
+  auto second_hook = flamingo::Install(flamingo::HookInfo{
+    reinterpret_cast<void*>(hook_function_to_call_2), hook_target_far.data(), &orig_two,
+    flamingo::HookInfo::kDefaultNumInsts, flamingo::CallingConvention::Cdecl,
+    flamingo::HookNameMetadata{ .name = "final" }, flamingo::HookPriority{ .is_final = true },
+    flamingo::InstallationMetadata{ .need_orig = true, .is_midpoint = false, .write_prot = false } });
+  if (!second_hook.has_value()) {
+    ERROR("Installation result for hook 2 failed: {}", second_hook.error());
+  }
+  // The first hook is still called first, through the same patch
+  validate_near_stub(hook_target_far, hook_function_to_call, "Recompile for orig");
+  auto const fixup_result = flamingo::FixupPointerFor(flamingo::TargetDescriptor(hook_target_far.data()));
+  if (!fixup_result.has_value()) {
+    ERROR("Failed to get fixup pointer for target: {}", fmt::ptr(hook_target_far.data()));
+  }
+  if (orig_two != fixup_result.value().data()) {
+    ERROR("Orig should point to the recompiled fixups! Instead, orig is: {}", orig_two);
+  }
+  {
+    TestWrapper fixups(fixup_result.value(), "Recompile for orig fixups");
+    print_decode_loop(fixup_result.value());
+    fixups.expect_opc(ARM64_INS_STR);
+    // Callback
+    fixups.expect_b(&hook_target_far[1]);
+  }
+  if (!flamingo::Uninstall(second_hook.value().returned_handle).has_value() ||
+      !flamingo::Uninstall(result.value().returned_handle).has_value()) {
+    ERROR("Failed to uninstall hooks at: {}", fmt::ptr(hook_target_far.data()));
+  }
+  TestWrapper validate_uninstall(hook_target_far, "Recompile for orig after uninstall");
+  validate_uninstall.expect_opc(ARM64_INS_STR);
+  validate_uninstall.expect_opc(ARM64_INS_STP);
+}
+
+void test_proc_mem_patching() {
+  uintptr_t hook_function_to_call = 0x12345678;
+  static uint8_t to_hook[]{ 0xf7, 0x0f, 0x1c, 0xf8, 0xf6, 0x57, 0x01, 0xa9, 0xf4, 0x4f, 0x02, 0xa9, 0xfd, 0x7b, 0x03,
+                            0xa9, 0xfd, 0xc3, 0x00, 0x91, 0x48, 0x18, 0x40, 0xf9, 0x16, 0xd4, 0x42, 0xa9, 0xf3, 0x03,
+                            0x02, 0xaa, 0xf4, 0x03, 0x01, 0xaa, 0x17, 0x01, 0x40, 0xf9, 0xe8, 0xba, 0x44, 0x39 };
+  // Same as the simplest hook, but the target is patched via /proc/self/mem
+  flamingo::SetPatchMode(flamingo::PatchMode::kProcMem);
+  auto hook_target_far = perform_far_hook_test(hook_function_to_call, to_hook);
+  auto result = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, hook_target_far.data(), (void (**)()) nullptr });
+  if (!result.has_value()) {
+    ERROR("Installation result failed, index: {}", result.error());
+  }
+  validate_near_stub(hook_target_far, hook_function_to_call, "Near hook via /proc/self/mem");
+  auto uninstall_result = flamingo::Uninstall(result.value().returned_handle);
+  if (!uninstall_result.has_value()) {
+    ERROR("Failed to uninstall: failure mode: {}", uninstall_result.error());
+  }
+  flamingo::SetPatchMode(flamingo::PatchMode::kProtect);
+  TestWrapper validate_uninstall(hook_target_far, "After uninstall via /proc/self/mem, return to original");
+  validate_uninstall.expect_opc(ARM64_INS_STR);
+  validate_uninstall.expect_opc(ARM64_INS_STP);
+  validate_uninstall.expect_opc(ARM64_INS_STP);
+  validate_uninstall.expect_opc(ARM64_INS_STP);
+  validate_uninstall.expect_opc(ARM64_INS_ADD);
+}
+
+void test_page_protection_cache() {
+  // Two pages with differing protections, with a write that straddles both of them
+  auto* pages = static_cast<uint32_t*>(
+      mmap(nullptr, PAGE_SIZE * 2, PROT_READ | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+  mprotect(&pages[PAGE_SIZE / sizeof(uint32_t)], PAGE_SIZE, PROT_READ);
+  auto const rx = flamingo::PageProtectionType::kRead | flamingo::PageProtectionType::kExecute;
+  auto const r = flamingo::PageProtectionType::kRead;
+  auto* straddle = &pages[PAGE_SIZE / sizeof(uint32_t) - 2];
+  TestWrapper validator(std::span<uint32_t const>(straddle, 4), "Page protection cache");
+  if (flamingo::GetPageProtection(pages) != rx || flamingo::GetPageProtection(&straddle[2]) != r) {
+    ERROR("Protections should have been read from maps! Got: {} and {}",
+          static_cast<int>(flamingo::GetPageProtection(pages)),
+          static_cast<int>(flamingo::GetPageProtection(&straddle[2])));
+  }
+  {
+    // The writer's declared protection is intentionally wrong, the real ones should be restored regardless
+    flamingo::ProtectionWriter<uint32_t> writer(
+        flamingo::PointerWrapper<uint32_t>(std::span<uint32_t>(straddle, 4), flamingo::PageProtectionType::kNone));
+    for (uint32_t i = 0; i < 4; i++) {
+      writer.Write(0xd503201fU);
+    }
+  }
+  if (flamingo::GetPageProtection(pages) != rx || flamingo::GetPageProtection(&straddle[2]) != r) {
+    ERROR("Original protections should have been restored! Got: {} and {}",
+          static_cast<int>(flamingo::GetPageProtection(pages)),
+          static_cast<int>(flamingo::GetPageProtection(&straddle[2])));
+  }
+  for (int i = 0; i < 4; i++) {
+    validator.expect_opc(ARM64_INS_NOP);
+  }
+  flamingo::ForgetPageProtections(pages, PAGE_SIZE * 2);
+  munmap(pages, PAGE_SIZE * 2);
+}
+
+void test_install_batch() {
+  uintptr_t hook_function_to_call = 0x12345678;
+  static uint8_t to_hook[]{ 0xf7, 0x0f, 0x1c, 0xf8, 0xf6, 0x57, 0x01, 0xa9, 0xf4, 0x4f, 0x02, 0xa9, 0xfd, 0x7b, 0x03,
+                            0xa9, 0xfd, 0xc3, 0x00, 0x91, 0x48, 0x18, 0x40, 0xf9, 0x16, 0xd4, 0x42, 0xa9, 0xf3, 0x03,
+                            0x02, 0xaa, 0xf4, 0x03, 0x01, 0xaa, 0x17, 0x01, 0x40, 0xf9, 0xe8, 0xba, 0x44, 0x39 };
+  auto first_target = perform_far_hook_test(hook_function_to_call, to_hook);
+  auto second_target = perform_far_hook_test(hook_function_to_call, to_hook);
+  // A successful batch installs everything, returning results in the order of the batch
+  {
+    std::array hooks{
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, second_target.data(), (void (**)()) nullptr },
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, first_target.data(), (void (**)()) nullptr },
+    };
+    auto result = flamingo::InstallBatch(hooks);
+    if (!result.has_value()) {
+      ERROR("Batch installation failed at index: {}: {}", result.error().index, result.error().error);
+    }
+    validate_near_stub(first_target, hook_function_to_call, "Batch install first target");
+    validate_near_stub(second_target, hook_function_to_call, "Batch install second target");
+    if (result.value().size() != 2 || result.value()[0].returned_handle.hook_location->target != second_target.data()) {
+      ERROR("Batch results should be in the order of the batch! Got {} results", result.value().size());
+    }
+    for (auto const& ok : result.value()) {
+      if (!flamingo::Uninstall(ok.returned_handle).has_value()) {
+        ERROR("Failed to uninstall batch installed hook at: {}", fmt::ptr(ok.returned_handle.hook_location->target));
+      }
+    }
+  }
+  // A failing batch installs nothing
+  {
+    std::array hooks{
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, first_target.data(), (void (**)()) nullptr },
+      flamingo::HookInfo{ reinterpret_cast<void*>(hook_function_to_call), second_target.data(), nullptr, 0,
+                          flamingo::CallingConvention::Cdecl, flamingo::HookNameMetadata{ .name = "too small" },
+                          flamingo::HookPriority{},
+                          flamingo::InstallationMetadata{ .need_orig = false, .is_midpoint = false, .write_prot = false } },
+    };
+    auto result = flamingo::InstallBatch(hooks);
+    if (result.has_value()) {
+      ERROR("Batch installation should have failed on a target that is too small! Target: {}",
+            fmt::ptr(second_target.data()));
+    }
+    if (result.error().index != 1 ||
+        !std::holds_alternative<flamingo::installation::TargetTooSmall>(result.error().error)) {
+      ERROR("Batch installation failed for the wrong reason, at index: {}: {}", result.error().index,
+            result.error().error);
+    }
+    TestWrapper validate_rollback(first_target, "Failed batch rolls back");
+    validate_rollback.expect_opc(ARM64_INS_STR);
+    validate_rollback.expect_opc(ARM64_INS_STP);
+    if (!flamingo::OriginalInstsFor(flamingo::TargetDescriptor(first_target.data())).empty()) {
+      ERROR("Rolled back target: {} should no longer be hooked!", fmt::ptr(first_target.data()));
+    }
+  }
+  // A failing batch restores the targets it recompiled, and leaves the hooks and their origs as they were
+  {
+    auto existing = flamingo::Install(
+        flamingo::HookInfo{ (void (*)())hook_function_to_call, first_target.data(), (void (**)()) nullptr });
+    if (!existing.has_value()) {
+      ERROR("Installation result failed: {}", existing.error());
+    }
+    void* orig = nullptr;
+    std::array hooks{
+      flamingo::HookInfo{ reinterpret_cast<void*>(hook_function_to_call), first_target.data(), &orig,
+                          flamingo::HookInfo::kDefaultNumInsts, flamingo::CallingConvention::Cdecl,
+                          flamingo::HookNameMetadata{ .name = "needs orig" }, flamingo::HookPriority{},
+                          flamingo::InstallationMetadata{ .need_orig = true, .is_midpoint = false, .write_prot = false } },
+      flamingo::HookInfo{ reinterpret_cast<void*>(hook_function_to_call), first_target.data(), nullptr, 0,
+                          flamingo::CallingConvention::Cdecl, flamingo::HookNameMetadata{ .name = "too small" },
+                          flamingo::HookPriority{},
+                          flamingo::InstallationMetadata{ .need_orig = false, .is_midpoint = false, .write_prot = false } },
+    };
+    auto result = flamingo::InstallBatch(hooks);
+    if (result.has_value() || result.error().index != 1) {
+      ERROR("Batch installation should have failed on the hook that is too small for: {}",
+            fmt::ptr(first_target.data()));
+    }
+    auto const metadata = flamingo::MetadataFor(flamingo::TargetDescriptor(first_target.data()));
+    if (!metadata.has_value() || metadata.value().metadata.need_orig ||
+        metadata.value().method_num_insts != flamingo::HookInfo::kDefaultNumInsts) {
+      ERROR("A failed batch should have restored the target: {}", fmt::ptr(first_target.data()));
+    }
+    validate_near_stub(first_target, hook_function_to_call, "Failed batch restores recompiled target");
+    if (orig != nullptr || hooks[0].orig_ptr != &orig || hooks[1].metadata.name_info.name != "too small") {
+      ERROR("A failed batch should have left its hooks unchanged, but the orig is: {}", orig);
+    }
+    if (!flamingo::Uninstall(existing.value().returned_handle).has_value()) {
+      ERROR("Failed to uninstall hook at: {}", fmt::ptr(first_target.data()));
+    }
+  }
+}
+
+void test_shared_veneer() {
+  // A destination no other test hooks to, so that no veneer to it is already pooled
+  uintptr_t hook_function_to_call = 0x23456780;
+  static uint8_t to_hook[]{ 0xf7, 0x0f, 0x1c, 0xf8, 0xf6, 0x57, 0x01, 0xa9, 0xf4, 0x4f, 0x02, 0xa9, 0xfd, 0x7b, 0x03,
+                            0xa9, 0xfd, 0xc3, 0x00, 0x91, 0x48, 0x18, 0x40, 0xf9, 0x16, 0xd4, 0x42, 0xa9, 0xf3, 0x03,
+                            0x02, 0xaa, 0xf4, 0x03, 0x01, 0xaa, 0x17, 0x01, 0x40, 0xf9, 0xe8, 0xba, 0x44, 0x39 };
+  flamingo::ReclaimRetiredFixups();
+  auto const initial_veneers = flamingo::VeneerCount();
+  auto first_target = perform_far_hook_test(hook_function_to_call, to_hook);
+  auto second_target = perform_far_hook_test(hook_function_to_call, to_hook);
+  auto first = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, first_target.data(), (void (**)()) nullptr });
+  auto second = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, second_target.data(), (void (**)()) nullptr });
+  if (!first.has_value() || !second.has_value()) {
+    ERROR("Installation result failed for one of: {} or {}", fmt::ptr(first_target.data()),
+          fmt::ptr(second_target.data()));
+  }
+  validate_near_stub(first_target, hook_function_to_call, "Shared veneer first target");
+  validate_near_stub(second_target, hook_function_to_call, "Shared veneer second target");
+  uint32_t const* first_veneer = TestWrapper(first_target, "Shared veneer first branch").expect_b_any();
+  uint32_t const* second_veneer = TestWrapper(second_target, "Shared veneer second branch").expect_b_any();
+  // Both targets were allocated near each other, so a veneer that one of them can reach, so can the other
+  if (flamingo::arm64::BranchInRange(reinterpret_cast<int64_t>(second_target.data()),
+                                     reinterpret_cast<int64_t>(first_veneer))) {
+    if (first_veneer != second_veneer) {
+      ERROR("Targets should share the veneer at: {}, but the second uses: {}", fmt::ptr(first_veneer),
+            fmt::ptr(second_veneer));
+    }
+    if (flamingo::VeneerCount() != initial_veneers + 1) {
+      ERROR("A single veneer should have been pooled, but there are: {}", flamingo::VeneerCount() - initial_veneers);
+    }
+  }
+  // A shared veneer must outlive the first uninstall
+  if (!flamingo::Uninstall(first.value().returned_handle).has_value()) {
+    ERROR("Failed to uninstall hook at: {}", fmt::ptr(first_target.data()));
+  }
+  validate_near_stub(second_target, hook_function_to_call, "Shared veneer after first uninstall");
+  if (!flamingo::Uninstall(second.value().returned_handle).has_value()) {
+    ERROR("Failed to uninstall hook at: {}", fmt::ptr(second_target.data()));
+  }
+  // Retired fixups hold on to their veneers until they are reclaimed
+  if (flamingo::VeneerCount() == initial_veneers) {
+    ERROR("The veneers should be held until their fixups are reclaimed, but: {} remain", flamingo::VeneerCount());
+  }
+  flamingo::ReclaimRetiredFixups();
+  if (flamingo::VeneerCount() != initial_veneers) {
+    ERROR("Every veneer should have been released, but: {} remain", flamingo::VeneerCount() - initial_veneers);
+  }
+}
+
+void test_replaced_veneer() {
+  // Destinations no other test hooks to, so that neither veneer is shared
+  uintptr_t hook_function_to_call = 0x34567890;
+  uintptr_t hook_function_to_call_2 = 0x34567894;
+  static uint8_t to_hook[]{ 0xf7, 0x0f, 0x1c, 0xf8, 0xf6, 0x57, 0x01, 0xa9, 0xf4, 0x4f, 0x02, 0xa9, 0xfd, 0x7b, 0x03,
+                            0xa9, 0xfd, 0xc3, 0x00, 0x91, 0x48, 0x18, 0x40, 0xf9, 0x16, 0xd4, 0x42, 0xa9, 0xf3, 0x03,
+                            0x02, 0xaa, 0xf4, 0x03, 0x01, 0xaa, 0x17, 0x01, 0x40, 0xf9, 0xe8, 0xba, 0x44, 0x39 };
+  flamingo::ReclaimRetiredFixups();
+  auto const initial_veneers = flamingo::VeneerCount();
+  auto hook_target_far = perform_far_hook_test(hook_function_to_call, to_hook);
+  auto first = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, hook_target_far.data(), (void (**)()) nullptr });
+  if (!first.has_value()) {
+    ERROR("Installation result failed: {}", first.error());
+  }
+  // The second hook is called first, so the target branches through a veneer to it instead
+  auto second = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call_2, hook_target_far.data(), (void (**)()) nullptr });
+  if (!second.has_value()) {
+    ERROR("Installation result for hook 2 failed: {}", second.error());
+  }
+  validate_near_stub(hook_target_far, hook_function_to_call_2, "Replaced veneer");
+  // A thread may still be inside of the veneer to the first hook, so it must not be freed yet
+  if (flamingo::VeneerCount() != initial_veneers + 2) {
+    ERROR("The replaced veneer should be held until it is reclaimed! Veneers: {} expected: {}",
+          flamingo::VeneerCount(), initial_veneers + 2);
+  }
+  if (!flamingo::Uninstall(second.value().returned_handle).has_value() ||
+      !flamingo::Uninstall(first.value().returned_handle).has_value()) {
+    ERROR("Failed to uninstall hooks at: {}", fmt::ptr(hook_target_far.data()));
+  }
+  flamingo::ReclaimRetiredFixups();
+  if (flamingo::VeneerCount() != initial_veneers) {
+    ERROR("Every veneer should have been released, but: {} remain", flamingo::VeneerCount() - initial_veneers);
+  }
+}
+
+void test_midpoint_scratch_register() {
+  // A destination no other test hooks to, so that no veneer to it is already pooled
+  uintptr_t hook_function_to_call = 0x45678900;
+  auto const midpoint_hook = [&](std::span<uint32_t> target) {
+    return flamingo::Install(flamingo::HookInfo{
+      reinterpret_cast<void*>(hook_function_to_call), target.data(), nullptr, flamingo::HookInfo::kDefaultNumInsts,
+      flamingo::CallingConvention::Cdecl, flamingo::HookNameMetadata{ .name = "midpoint" }, flamingo::HookPriority{},
+      flamingo::InstallationMetadata{ .need_orig = false, .is_midpoint = true, .write_prot = false } });
+  };
+  // x17 is live at the midpoint, but x16 is dead, so the far jump goes through x16 (and never a veneer)
+  // mov x16, x17; nop; nop; nop; br x16
+  static uint8_t to_hook[]{ 0xf0, 0x03, 0x11, 0xaa, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5,
+                            0x1f, 0x20, 0x03, 0xd5, 0x00, 0x02, 0x1f, 0xd6 };
+  auto hook_target_far = perform_far_hook_test(hook_function_to_call, to_hook);
+  auto result = midpoint_hook(hook_target_far);
+  if (!result.has_value()) {
+    ERROR("Installation result failed: {}", result.error());
+  }
+  {
+    TestWrapper validator(hook_target_far, "Midpoint far jump");
+    print_decode_loop(hook_target_far);
+    constexpr uint32_t ldr_x16_literal_8 = 0x58000050U;
+    constexpr uint32_t br_x16 = 0xD61F0200U;
+    if (hook_target_far[0] != ldr_x16_literal_8 || hook_target_far[1] != br_x16) {
+      ERROR("Midpoint should jump through the dead x16, but starts with: 0x{:x} 0x{:x}", hook_target_far[0],
+            hook_target_far[1]);
+    }
+  }
+  if (!flamingo::Uninstall(result.value().returned_handle).has_value()) {
+    ERROR("Failed to uninstall hook at: {}", fmt::ptr(hook_target_far.data()));
+  }
+  // A hook in range of a single B needs no register. One that is called before it, needs an orig and knows the target
+  // is too small for the far jump that x16 allows recompiles the target for its orig, but then cannot jump to itself,
+  // so it must restore the target as it was.
+  {
+    auto near = flamingo::Install(flamingo::HookInfo{
+      reinterpret_cast<void*>(hook_target_far.data() + 1024), hook_target_far.data(), nullptr,
+      flamingo::HookInfo::kDefaultNumInsts, flamingo::CallingConvention::Cdecl,
+      flamingo::HookNameMetadata{ .name = "near midpoint" }, flamingo::HookPriority{},
+      flamingo::InstallationMetadata{ .need_orig = false, .is_midpoint = true, .write_prot = false } });
+    if (!near.has_value()) {
+      ERROR("Installation result failed: {}", near.error());
+    }
+    void* orig = nullptr;
+    auto far = flamingo::Install(flamingo::HookInfo{
+      reinterpret_cast<void*>(hook_function_to_call), hook_target_far.data(), &orig, 4,
+      flamingo::CallingConvention::Cdecl, flamingo::HookNameMetadata{ .name = "far midpoint" },
+      flamingo::HookPriority{},
+      flamingo::InstallationMetadata{ .need_orig = true, .is_midpoint = true, .write_prot = false } });
+    if (far.has_value()) {
+      ERROR("Installing a far hook onto a midpoint patched with a single B should fail at: {}",
+            fmt::ptr(hook_target_far.data()));
+    }
+    auto const metadata = flamingo::MetadataFor(flamingo::TargetDescriptor(hook_target_far.data()));
+    if (metadata.value().metadata.need_orig ||
+        metadata.value().method_num_insts != flamingo::HookInfo::kDefaultNumInsts) {
+      ERROR("A failed install should have restored the target, but it has: {} instructions",
+            metadata.value().method_num_insts);
+    }
+    TestWrapper validator(hook_target_far, "Midpoint restored after failed install");
+    validator.expect_b(hook_target_far.data() + 1024);
+    validator.expect_opc(ARM64_INS_NOP);
+    if (!flamingo::Uninstall(near.value().returned_handle).has_value()) {
+      ERROR("Failed to uninstall hook at: {}", fmt::ptr(hook_target_far.data()));
+    }
+  }
+  // Nothing is dead at the midpoint, so there is no way to reach a far hook from it without clobbering a live register
+  // mov x0, x17; nop; nop; nop; br x0
+  static uint8_t to_hook_live[]{ 0xe0, 0x03, 0x11, 0xaa, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5,
+                                 0x1f, 0x20, 0x03, 0xd5, 0x00, 0x00, 0x1f, 0xd6 };
+  auto hook_target_live = perform_far_hook_test(hook_function_to_call, to_hook_live);
+  result = midpoint_hook(hook_target_live);
+  if (result.has_value() ||
+      !std::holds_alternative<flamingo::installation::TargetNoScratchRegister>(result.error())) {
+    ERROR("Installing a far midpoint hook where x17 is live should fail with: {}", "TargetNoScratchRegister");
+  }
+  TestWrapper validate_untouched(hook_target_live, "Midpoint without a dead register");
+  validate_untouched.expect_opc(ARM64_INS_MOV);
+  validate_untouched.expect_opc(ARM64_INS_NOP);
+}
+
+void test_exact_fixup_size() {
+  uintptr_t hook_function_to_call = 0x12345678;
+  void* fixup_result_ptr;
+  // stp x29, x30, [sp, #-0x10]!; mov x29, sp; sub sp, sp, #0x20; str x19, [sp]; ret
+  static uint8_t to_hook[]{ 0xfd, 0x7b, 0xbf, 0xa9, 0xfd, 0x03, 0x00, 0x91, 0xff, 0x83, 0x00,
+                            0xd1, 0xf3, 0x03, 0x00, 0xf9, 0xc0, 0x03, 0x5f, 0xd6 };
+  auto hook_target_far = perform_far_hook_test(hook_function_to_call, to_hook);
+  auto result = flamingo::Install(
+      flamingo::HookInfo{ (void (*)())hook_function_to_call, hook_target_far.data(), (void (**)()) &fixup_result_ptr });
+  if (!result.has_value()) {
+    ERROR("Installation result failed, index: {}", result.error().index());
+  }
+  auto const fixups = flamingo::FixupPointerFor(flamingo::TargetDescriptor(hook_target_far.data()));
+  if (!fixups.has_value()) {
+    ERROR("Failed to get fixup pointer for target: {}", fmt::ptr(hook_target_far.data()));
+  }
+  // None of the original instructions reference the PC, so they are sized the same wherever they are
+  auto const original = flamingo::OriginalInstsFor(flamingo::TargetDescriptor(hook_target_far.data()));
+  auto const size = flamingo::Fixups::SizeFor(original, false);
+  if (fixups.value().size_bytes() != size.code) {
+    ERROR("Fixups for: {} instructions should be exactly: {} bytes, got: {}", original.size(), size.code,
+          fixups.value().size_bytes());
+  }
+  fmt::print("Fixups for {} instructions take {} bytes\n", original.size(), size.code);
+  if (!flamingo::Uninstall(result.value().returned_handle).has_value()) {
+    ERROR("Failed to uninstall hook at: {}", fmt::ptr(hook_target_far.data()));
+  }
+}
+
+void test_whole_function_relocation() {
+  uintptr_t hook_function_to_call = 0x12345678;
+  void* fixup_result_ptr;
+  // ldr w8, [x0, #0x10]; add w0, w8, #1; cmp w0, #5; sub w0, w0, #2; ret
+  static uint8_t leaf[]{ 0x08, 0x10, 0x40, 0xb9, 0x00, 0x05, 0x00, 0x11, 0x1f, 0x14,
+                         0x00, 0x71, 0x00, 0x08, 0x00, 0x51, 0xc0, 0x03, 0x5f, 0xd6 };
+  // ldr w8, [x0, #0x10]; add w0, w8, #1; bl #0x100; sub w0, w0, #2; ret
+  static uint8_t non_leaf[]{ 0x08, 0x10, 0x40, 0xb9, 0x00, 0x05, 0x00, 0x11, 0x40, 0x00,
+                             0x00, 0x94, 0x00, 0x08, 0x00, 0x51, 0xc0, 0x03, 0x5f, 0xd6 };
+  auto const install = [&](std::span<uint32_t> target) {
+    auto result = flamingo::Install(flamingo::HookInfo{
+      (void (*)())hook_function_to_call, target.data(), (void (**)()) &fixup_result_ptr,
+      flamingo::InstallationMetadata{
+          .need_orig = true, .is_midpoint = false, .write_prot = false, .relocate_whole_function = true } });
+    if (!result.has_value()) {
+      ERROR("Installation result failed, index: {}", result.error().index());
+    }
+    auto const fixups = flamingo::FixupPointerFor(flamingo::TargetDescriptor(target.data()));
+    if (!fixups.has_value()) {
+      ERROR("Failed to get fixup pointer for target: {}", fmt::ptr(target.data()));
+    }
+    print_decode_loop(fixups.value());
+    return std::pair{ result.value().returned_handle, fixups.value() };
+  };
+  {
+    auto hook_target_far = perform_far_hook_test(hook_function_to_call, leaf);
+    auto const [handle, fixups] = install(hook_target_far);
+    if (!flamingo::MetadataFor(flamingo::TargetDescriptor(hook_target_far.data()))
+             .value()
+             .metadata.relocate_whole_function) {
+      ERROR("Leaf function at: {} should have been relocated whole", fmt::ptr(hook_target_far.data()));
+    }
+    // The whole function is copied, and it returns by itself, so there is no callback into the target
+    TestWrapper validator(fixups, "Whole function relocation");
+    validator.expect_opc(ARM64_INS_LDR);
+    validator.expect_opc(ARM64_INS_ADD);
+    validator.expect_opc(ARM64_INS_CMP);
+    validator.expect_opc(ARM64_INS_SUB);
+    validator.expect_opc(ARM64_INS_RET);
+    if (fixups.size() != 5) {
+      ERROR("Fixups for a whole function of: 5 instructions should be exactly as large, got: {}", fixups.size());
+    }
+    if (!flamingo::Uninstall(handle).has_value()) {
+      ERROR("Failed to uninstall hook at: {}", fmt::ptr(hook_target_far.data()));
+    }
+  }
+  {
+    auto hook_target_far = perform_far_hook_test(hook_function_to_call, non_leaf);
+    auto const [handle, fixups] = install(hook_target_far);
+    if (flamingo::MetadataFor(flamingo::TargetDescriptor(hook_target_far.data()))
+            .value()
+            .metadata.relocate_whole_function) {
+      ERROR("Function at: {} makes a call, so it should not have been relocated whole",
+            fmt::ptr(hook_target_far.data()));
+    }
+    // Only the patch is relocated, and the fixups return into the target
+    TestWrapper validator(fixups, "Non-leaf function relocation");
+    validator.expect_opc(ARM64_INS_LDR);
+    validator.expect_b(&hook_target_far[1]);
+    if (!flamingo::Uninstall(handle).has_value()) {
+      ERROR("Failed to uninstall hook at: {}", fmt::ptr(hook_target_far.data()));
+    }
+  }
+}
+
+void test_dual_mapped_allocation() {
+  auto const protection = flamingo::PageProtectionType::kExecute | flamingo::PageProtectionType::kRead;
+  auto allocation = flamingo::Allocate(16, 4 * sizeof(uint32_t), protection);
+  TestWrapper validator(allocation.addr, "Dual mapped allocation");
+  if (!allocation.IsDualMapped()) {
+    // Not all kernels (or sandboxes) permit memfds, in which case we expect to fall back to mprotect instead
+    if (flamingo::GetAllocatorStats().dual_mapped_pages != 0) {
+      ERROR("Executable allocation at: {} should have been dual mapped!", fmt::ptr(allocation.addr.data()));
+    }
+    fmt::print("memfd dual mapping is not supported, skipping alias checks\n");
+  }
+  {
+    // Writes go through the alias, and must be visible at the executable address without changing its protection
+    flamingo::ProtectionWriter<uint32_t> writer(allocation);
+    writer.Write(0xd503201fU);
+    writer.Write(0xd65f03c0U);
+  }
+  validator.expect_opc(ARM64_INS_NOP);
+  validator.expect_opc(ARM64_INS_RET);
+  flamingo::Deallocate(allocation);
+}
+
+void test_code_cave_allocation() {
+  auto const protection = flamingo::PageProtectionType::kExecute | flamingo::PageProtectionType::kRead;
+  auto const stats_before = flamingo::GetAllocatorStats();
+  // Our own executable is a loaded module, the end of whose executable segment is almost always followed by padding
+  auto const* near = reinterpret_cast<void const*>(&test_code_cave_allocation);
+  auto allocation = flamingo::AllocateNear(near, 16, 4 * sizeof(uint32_t), protection);
+  if (allocation.addr.empty()) {
+    ERROR("Failed to allocate near: {}", fmt::ptr(near));
+  }
+  auto const stats = flamingo::GetAllocatorStats();
+  if (stats.code_cave_bytes == stats_before.code_cave_bytes) {
+    fmt::print("No code caves found near: {}, skipping code cave checks\n", fmt::ptr(near));
+    flamingo::Deallocate(allocation);
+    return;
+  }
+  if (stats.mapped_pages != stats_before.mapped_pages || allocation.IsDualMapped()) {
+    ERROR("Allocation at: {} should have come from a code cave, not a new page!", fmt::ptr(allocation.addr.data()));
+  }
+  TestWrapper validator(allocation.addr, "Code cave allocation");
+  {
+    flamingo::ProtectionWriter<uint32_t> writer(allocation);
+    writer.Write(0xd503201fU);
+    writer.Write(0xd65f03c0U);
+  }
+  validator.expect_opc(ARM64_INS_NOP);
+  validator.expect_opc(ARM64_INS_RET);
+  flamingo::Deallocate(allocation);
+  // The cave is not ours to unmap, it just goes back to being free
+  auto const stats_after = flamingo::GetAllocatorStats();
+  if (stats_after.live_bytes != stats_before.live_bytes || stats_after.mapped_pages != stats_before.mapped_pages) {
+    ERROR("Deallocating a code cave allocation should leave: {} live bytes, not: {}", stats_before.live_bytes,
+          stats_after.live_bytes);
+  }
+}
+
 }  // namespace
 
 int main() {
   test_simple_hook();
   test_hook_with_orig();
   test_multi_hook();
+  test_small_near_hook();
+  test_recompile_for_orig();
+  test_analyzed_function_size();
+  test_exact_fixup_size();
+  test_whole_function_relocation();
+  test_dual_mapped_allocation();
+  test_code_cave_allocation();
+  test_proc_mem_patching();
+  test_page_protection_cache();
+  test_install_batch();
+  test_shared_veneer();
+  test_replaced_veneer();
+  test_midpoint_scratch_register();
 }
@@ -5,13 +5,18 @@
 #include <fmt/format.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <optional>
 #include <span>
+#include <string_view>
+#include <vector>
 
+#include "../shared/arm64-decoder.hpp"
 #include "../shared/fixups.hpp"
 #include "../shared/page-allocator.hpp"
 #include "capstone/capstone.h"
@@ -51,7 +56,8 @@ static auto perform_near_hook_test(std::span<uint8_t> to_hook) {
   return trampoline_data;
 }
 
-static decltype(auto) test_far(std::span<uint32_t> target, [[maybe_unused]] uint32_t const* callback) {
+static decltype(auto) test_far(std::span<uint32_t> target, [[maybe_unused]] uint32_t const* callback,
+                               uint16_t function_insts) {
   constexpr size_t hookSizeNumInsts = 5;
   constexpr size_t trampolineSize = 32;
   // We allocate the page with r-x perms, we will mark it as writable when we do the writes and otherwise put it back to
@@ -66,6 +72,7 @@ static decltype(auto) test_far(std::span<uint32_t> target, [[maybe_unused]] uint
       std::span(actual_target.begin(), actual_target.begin() + hookSizeNumInsts - 1),
       flamingo::PageProtectionType::kExecute | flamingo::PageProtectionType::kRead } },
     .fixup_inst_destination = fixup_ptr,
+    .function_insts = function_insts,
   };
   printf("TRAMPOLINE: %p\n", &fixup_ptr.addr[0]);
   // Attempt to write a hook from target --> callback (just for testing purposes)
@@ -75,13 +82,13 @@ static decltype(auto) test_far(std::span<uint32_t> target, [[maybe_unused]] uint
   return fixups;
 }
 
-static auto perform_far_hook_test(std::span<uint8_t> to_hook) {
+static auto perform_far_hook_test(std::span<uint8_t> to_hook, uint16_t function_insts = 0) {
   std::span<uint32_t> hook_span = std::span<uint32_t>(reinterpret_cast<uint32_t*>(&to_hook[0]),
                                                       reinterpret_cast<uint32_t*>(&to_hook[to_hook.size()]));
   printf("TO HOOK: %p\n", to_hook.data());
   print_decode_loop(hook_span);
   puts("TEST FAR...");
-  auto fixups = test_far(hook_span, (uint32_t const*)(0xDEADBEEFBAADF00DULL));
+  auto fixups = test_far(hook_span, (uint32_t const*)(0xDEADBEEFBAADF00DULL), function_insts);
   // Use 20 here as a reasonable guesstimate
   print_decode_loop(fixups.fixup_inst_destination.addr);
   puts("HOOKED:");
@@ -129,6 +136,117 @@ static void test_no_fixups() {
   }
 }
 
+static void test_decoder() {
+  puts("Testing decoder");
+  using flamingo::arm64::InstKind;
+  struct Case {
+    uint32_t inst;
+    InstKind kind;
+  };
+  static constexpr std::array<Case, 16> cases{ {
+    { 0x17FFFFFFU, InstKind::kB },              // b #-4
+    { 0x94000010U, InstKind::kBl },             // bl #0x40
+    { 0x54FFFFE1U, InstKind::kBCond },          // b.ne #-4
+    { 0xB4000040U, InstKind::kCbz },            // cbz x0, #8
+    { 0x35FFFFE1U, InstKind::kCbz },            // cbnz w1, #-4
+    { 0x37000068U, InstKind::kTbz },            // tbnz w8, #0, #0xc
+    { 0x58000051U, InstKind::kLdrLiteral },     // ldr x17, #8
+    { 0x18000040U, InstKind::kLdrLiteral },     // ldr w0, #8
+    { 0x98000040U, InstKind::kLdrswLiteral },   // ldrsw x0, #8
+    { 0xD8000040U, InstKind::kPrfmLiteral },    // prfm pldl1keep, #8
+    { 0x9C000040U, InstKind::kLdrSimdLiteral }, // ldr q0, #8
+    { 0x10000040U, InstKind::kAdr },            // adr x0, #8
+    { 0xB000EEE0U, InstKind::kAdrp },           // adrp x0, #0x1ddd000
+    { 0xF9401848U, InstKind::kOther },          // ldr x8, [x2, #0x30]
+    { 0xB9800040U, InstKind::kOther },          // ldrsw x0, [x2]
+    { 0xD61F0220U, InstKind::kOther },          // br x17
+  } };
+  // Decode at a page-misaligned pc, so ADRP's page rounding is exercised
+  static std::array<uint32_t, cases.size()> insts{};
+  for (size_t i = 0; i < cases.size(); i++) {
+    insts[i] = cases[i].inst;
+  }
+  auto handle = flamingo::getHandle();
+  for (size_t i = 0; i < cases.size(); i++) {
+    auto const pc = reinterpret_cast<int64_t>(&insts[i]);
+    auto const decoded = flamingo::arm64::Decode(insts[i], pc);
+    if (decoded.kind != cases[i].kind) {
+      ERROR("Mismatched kind for: {:#x}\n Expected: {}\n Got: {}", insts[i],
+            flamingo::arm64::KindName(cases[i].kind), flamingo::arm64::KindName(decoded.kind));
+    }
+    if (decoded.kind == InstKind::kOther) continue;
+    // The decoded target must match what capstone believes the last immediate is
+    cs_insn* inst = nullptr;
+    auto count = cs_disasm(handle, reinterpret_cast<uint8_t const*>(&insts[i]), sizeof(uint32_t),
+                           static_cast<uint64_t>(pc), 1, &inst);
+    if (count != 1) {
+      ERROR("Capstone failed to disassemble: {:#x}", insts[i]);
+    }
+    auto const& ops = inst->detail->arm64;
+    auto const expected = ops.operands[ops.op_count - 1].imm;
+    if (decoded.target != expected) {
+      ERROR("Mismatched target for: {} {}\n Expected: {:#x}\n Got: {:#x}", inst->mnemonic, inst->op_str, expected,
+            decoded.target);
+    }
+    cs_free(inst, count);
+  }
+  puts("---Passed test: decoder");
+}
+
+static void test_function_analysis() {
+  puts("Testing function analysis");
+  constexpr uint32_t nop = 0xD503201FU;
+  constexpr uint32_t ret = 0xD65F03C0U;
+  struct Case {
+    std::string_view name;
+    std::vector<uint32_t> insts;
+    uint16_t num_insts;
+    uint16_t safe_patch_size;
+    uint16_t declared_insts{ 0 };
+  };
+  std::array<Case, 7> const cases{ {
+    { "straight line", { nop, nop, ret, nop }, 3, 3 },
+    // b.ne #-0xc (to index 2)
+    { "loop into patch", { nop, nop, nop, nop, nop, 0x54FFFFA1U, ret }, 7, 2 },
+    // cbz x0, #0x10 (past the first ret)
+    { "branch past ret", { 0xB4000080U, nop, ret, nop, nop, ret, nop }, 6, 6 },
+    // blr x8; b #8; udf #0; nop; udf #0
+    { "blr and udf", { 0xD63F0100U, 0x14000002U, 0x00000000U, nop, 0x00000000U }, 5, 5 },
+    // b . (to index 1)
+    { "branch to self", { nop, 0x14000000U, nop }, 2, 1 },
+    // A word of 0 may be data, so it only ends the function past where the caller declared it to
+    { "udf past declared", { nop, 0x00000000U, nop, ret }, 2, 2, 1 },
+    { "udf within declared", { nop, 0x00000000U, nop, ret }, 4, 4, 4 },
+  } };
+  for (auto const& c : cases) {
+    auto const analysis = flamingo::arm64::AnalyzeFunction(c.insts, reinterpret_cast<int64_t>(c.insts.data()),
+                                                           c.declared_insts);
+    if (analysis.num_insts != c.num_insts || analysis.safe_patch_size != c.safe_patch_size) {
+      ERROR("Mismatched analysis for: {}\n Expected: {} instructions, {} safe\n Got: {} instructions, {} safe", c.name,
+            c.num_insts, c.safe_patch_size, analysis.num_insts, analysis.safe_patch_size);
+    }
+  }
+  puts("---Passed test: function analysis");
+}
+
+static void test_bcond_within_hook() {
+  puts("Testing b.cond within hook");
+  // b.eq #8; nop; nop; nop
+  static uint8_t to_hook[]{ 0x40, 0x00, 0x00, 0x54, 0x1f, 0x20, 0x03, 0xd5,
+                            0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5 };
+  {
+    auto results = perform_near_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook b.cond within hook");
+    // The forward reference must be rewritten as an imm19, keeping the condition intact
+    fixup_validator.expect_b(&results.fixup_inst_destination.addr[2]);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback
+    fixup_validator.expect_b(&results.target.addr[4]);
+  }
+}
+
 static void test_bls_tbzs_within_hook() {
   puts("Testing bls/tbzs");
   static uint8_t to_hook[]{ 0x68, 0x00, 0x00, 0x37, 0xe0, 0x03, 0x17, 0xaa, 0x52, 0x3e, 0xfd, 0x97,
@@ -210,26 +328,553 @@ static void test_ldr_ldrb_tbnz_bl() {
     TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook ldr/ldrb/tbnz/bl");
     fixup_validator.expect_opc(ARM64_INS_LDR);
     fixup_validator.expect_opc(ARM64_INS_LDRB);
-    // TBNZ should jump over the following instruction if taken
+    // TBNZ is inverted into a TBZ, which skips over the following far branch call if not taken
     fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM, ARM64_OP_IMM>(
-        ARM64_INS_TBNZ, ARM64_REG_W8, 0, (int64_t)&results.fixup_inst_destination.addr[4]);
-    // B instruction should jump to skip the following far branch call
-    fixup_validator.expect_b(&results.fixup_inst_destination.addr[6]);
+        ARM64_INS_TBZ, ARM64_REG_W8, 0, (int64_t)&results.fixup_inst_destination.addr[5]);
     // Far branch call is given by an ldr x17, DATA[0]; br x17
     fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
-                                                           round_up8(&results.fixup_inst_destination.addr[9]));
+                                                           round_up8(&results.fixup_inst_destination.addr[8]));
     fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
     fixup_validator.expect_opc(ARM64_INS_MOV);
     // Callback (ldr x17, DATA[1]; br x17)
     fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
-                                                           round_up8(&results.fixup_inst_destination.addr[11]));
+                                                           round_up8(&results.fixup_inst_destination.addr[10]));
     fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
     // Data validation
     // Branch destination for tbnz taken should be hook[5]
     fixup_validator.expect_big_data((uint64_t)&results.target.addr[5]);
     // Check callback point is valid
     fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
+    // Everything is out of range of our fixups, so the sizing pass is exact
+    auto const written = round_up8(&results.fixup_inst_destination.addr[10]) + 8 -
+                         reinterpret_cast<int64_t>(results.fixup_inst_destination.addr.data());
+    auto const size = flamingo::Fixups::SizeFor(results.target.addr, false);
+    if (static_cast<int64_t>(size.code) != written || size.data != 0) {
+      ERROR("Mismatched fixup size, expected: {} code bytes, got: {} code bytes and: {} data bytes", written, size.code,
+            size.data);
+    }
+  }
+}
+
+static void test_cond_branch_inversion() {
+  puts("Testing conditional branch inversion");
+  // cbz x0, #-0x100000; nop; nop; nop; ret
+  // The cbz is out of imm19 range from the fixups, so it is inverted to skip over a jump to its destination
+  static uint8_t to_hook[]{ 0x00, 0x00, 0x80, 0xb4, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20,
+                            0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6 };
+  {
+    TestWrapper init_hook(to_hook, "conditional branch inversion");
+    init_hook.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_CBZ, ARM64_REG_X0,
+                                                     (int64_t)&init_hook.data[0] - 0x100000);
+  }
+  {
+    auto results = perform_near_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook conditional branch inversion");
+    // The destination is within B range, so cbnz x0, +8; b DEST
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_CBNZ, ARM64_REG_X0,
+                                                           (int64_t)&results.fixup_inst_destination.addr[2]);
+    fixup_validator.expect_ops<ARM64_OP_IMM>(ARM64_INS_B, (int64_t)results.target.addr.data() - 0x100000);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback
+    fixup_validator.expect_b(&results.target.addr[4]);
+  }
+  {
+    auto results = perform_far_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook conditional branch inversion");
+    // The destination is out of B range, so cbnz x0, +0xC; ldr x17, DATA[0]; br x17
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_CBNZ, ARM64_REG_X0,
+                                                           (int64_t)&results.fixup_inst_destination.addr[3]);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
+                                                           round_up8(&results.fixup_inst_destination.addr[8]));
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback (ldr x17, DATA[1]; br x17)
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
+                                                           round_up8(&results.fixup_inst_destination.addr[10]));
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+    // Data validation
+    fixup_validator.expect_big_data((uint64_t)results.target.addr.data() - 0x100000);
+    fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
+  }
+}
+
+static void test_ldr_literal() {
+  puts("Testing ldr literal");
+  // ldr x0, #0x20; ldr w1, #4; nop; ldr d2, #0x14; ret; (data...)
+  static uint8_t to_hook[]{ 0x00, 0x01, 0x00, 0x58, 0x21, 0x00, 0x00, 0x18, 0x1f, 0x20, 0x03, 0xd5, 0xa2, 0x00,
+                            0x00, 0x5c, 0xc0, 0x03, 0x5f, 0xd6, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                            0x00, 0x00, 0x00, 0x00, 0x44, 0x33, 0x22, 0x11, 0x88, 0x77, 0x66, 0x55 };
+  {
+    TestWrapper init_hook(to_hook, "ldr literal");
+    init_hook.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X0, (int64_t)&init_hook.data[8]);
+    init_hook.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_W1, (int64_t)&init_hook.data[2]);
+    init_hook.expect_opc(ARM64_INS_NOP);
+    init_hook.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_D2, (int64_t)&init_hook.data[8]);
+  }
+  {
+    auto results = perform_near_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook ldr literal");
+    // In range literals are loaded from their original location
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X0,
+                                                           (int64_t)&results.target.addr[8]);
+    // Literals within the hooked instructions are snapshotted, as they are overwritten by the hook
+    // LDR w1, DATA[0]
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_W1,
+                                                           (int64_t)&results.fixup_inst_destination.addr[5]);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_D2,
+                                                           (int64_t)&results.target.addr[8]);
+    // Callback
+    fixup_validator.expect_b(&results.target.addr[4]);
+    // Data validation
+    // Snapshot of the nop
+    fixup_validator.expect_data(0xd503201fU);
+  }
+  {
+    auto results = perform_far_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook ldr literal");
+    auto const literal_address = round_up8(&results.fixup_inst_destination.addr[10]);
+    auto const snapshot_address = literal_address + 8;
+    auto const callback_address = round_up8(reinterpret_cast<uint32_t*>(snapshot_address + 4));
+    // Out of range literals are loaded through their address, so that we read the live value
+    // LDR x0, DATA[0]; LDR x0, [x0]
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X0, literal_address);
+    fixup_validator.expect_opc(ARM64_INS_LDR);
+    // LDR w1, DATA[1]
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_W1, snapshot_address);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // SIMD literals are loaded through a spilled x17, sharing the address with the first load
+    // STR x17, [sp, #-16]!; LDR x17, DATA[0]; LDR d2, [x17]; LDR x17, [sp], #16
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_STR, ARM64_REG_X17);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, literal_address);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_LDR, ARM64_REG_D2);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_LDR, ARM64_REG_X17);
+    // Callback (ldr x17, DATA[2]; br x17)
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, callback_address);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+    // Data validation
+    fixup_validator.expect_big_data((uint64_t)&results.target.addr[8]);
+    fixup_validator.expect_data(0xd503201fU);
+    fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
+  }
+}
+
+static void test_ldrsw_literal() {
+  puts("Testing ldrsw literal");
+  // ldrsw x3, #0x20; nop; nop; nop; ret; (data...)
+  static uint8_t to_hook[]{ 0x03, 0x01, 0x00, 0x98, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20,
+                            0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                            0x00, 0x00, 0x00, 0x00, 0xfe, 0xff, 0xff, 0xff };
+  {
+    TestWrapper init_hook(to_hook, "ldrsw literal");
+    init_hook.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDRSW, ARM64_REG_X3, (int64_t)&init_hook.data[8]);
+  }
+  {
+    auto results = perform_near_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook ldrsw literal");
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDRSW, ARM64_REG_X3,
+                                                           (int64_t)&results.target.addr[8]);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback
+    fixup_validator.expect_b(&results.target.addr[4]);
+  }
+  {
+    auto results = perform_far_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook ldrsw literal");
+    auto const literal_address = round_up8(&results.fixup_inst_destination.addr[7]);
+    // LDR x3, DATA[0]; LDRSW x3, [x3]
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X3, literal_address);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_LDRSW, ARM64_REG_X3);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback (ldr x17, DATA[1]; br x17)
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, literal_address + 8);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+    // Data validation
+    fixup_validator.expect_big_data((uint64_t)&results.target.addr[8]);
+    fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
+  }
+}
+
+static void test_simd_literal() {
+  puts("Testing simd literal");
+  // ldr s2, #0x20; ldr q3, #0x1c; nop; nop; ret; (data...)
+  static uint8_t to_hook[]{ 0x02, 0x01, 0x00, 0x1c, 0xe3, 0x00, 0x00, 0x9c, 0x1f, 0x20, 0x03, 0xd5,
+                            0x1f, 0x20, 0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6, 0x00, 0x00, 0x00, 0x00,
+                            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x3f,
+                            0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x40, 0x40, 0x00, 0x00, 0x80, 0x40 };
+  {
+    TestWrapper init_hook(to_hook, "simd literal");
+    init_hook.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_S2, (int64_t)&init_hook.data[8]);
+    init_hook.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_Q3, (int64_t)&init_hook.data[8]);
+  }
+  {
+    auto results = perform_near_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook simd literal");
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_S2,
+                                                           (int64_t)&results.target.addr[8]);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_Q3,
+                                                           (int64_t)&results.target.addr[8]);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback
+    fixup_validator.expect_b(&results.target.addr[4]);
+  }
+  {
+    auto results = perform_far_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook simd literal");
+    auto const literal_address = round_up8(&results.fixup_inst_destination.addr[12]);
+    // STR x17, [sp, #-16]!; LDR x17, DATA[0]; LDR s2, [x17]; LDR x17, [sp], #16
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_STR, ARM64_REG_X17);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, literal_address);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_LDR, ARM64_REG_S2);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_LDR, ARM64_REG_X17);
+    // Both literals share a single address in the data section
+    // STR x17, [sp, #-16]!; LDR x17, DATA[0]; LDR q3, [x17]; LDR x17, [sp], #16
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_STR, ARM64_REG_X17);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, literal_address);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_LDR, ARM64_REG_Q3);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_LDR, ARM64_REG_X17);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback (ldr x17, DATA[1]; br x17)
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, literal_address + 8);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+    // Data validation
+    fixup_validator.expect_big_data((uint64_t)&results.target.addr[8]);
+    fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
+  }
+}
+
+static void test_prfm_literal() {
+  puts("Testing prfm literal");
+  // prfm pldl1keep, #0x20; nop; nop; nop; ret
+  static uint8_t to_hook[]{ 0x00, 0x01, 0x00, 0xd8, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20,
+                            0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6 };
+  auto const expect_prefetch_of = [](std::span<uint32_t const> fixups, size_t idx, uint32_t const* expected) {
+    auto const decoded = flamingo::arm64::Decode(fixups[idx], reinterpret_cast<int64_t>(&fixups[idx]));
+    if (decoded.kind != flamingo::arm64::InstKind::kPrfmLiteral || decoded.target != (int64_t)expected) {
+      ERROR("Mismatched PRFM at index: {}\n Expected: {}\n Got: {:#x}", idx, fmt::ptr(expected), decoded.target);
+    }
+  };
+  {
+    TestWrapper init_hook(to_hook, "prfm literal");
+    init_hook.expect_opc(ARM64_INS_PRFM);
+  }
+  {
+    auto results = perform_near_hook_test(to_hook);
+    // Prefetches are kept, pointing at their original location
+    expect_prefetch_of(results.fixup_inst_destination.addr, 0, &results.target.addr[8]);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook prfm literal");
+    fixup_validator.expect_opc(ARM64_INS_PRFM);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback
+    fixup_validator.expect_b(&results.target.addr[4]);
+  }
+  {
+    auto results = perform_far_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook prfm literal");
+    auto const literal_address = round_up8(&results.fixup_inst_destination.addr[9]);
+    // STR x17, [sp, #-16]!; LDR x17, DATA[0]; PRFM pldl1keep, [x17]; LDR x17, [sp], #16
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_STR, ARM64_REG_X17);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, literal_address);
+    fixup_validator.expect_opc(ARM64_INS_PRFM);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_LDR, ARM64_REG_X17);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback (ldr x17, DATA[1]; br x17)
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, literal_address + 8);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+    // Data validation
+    fixup_validator.expect_big_data((uint64_t)&results.target.addr[8]);
+    fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
+  }
+}
+
+static void test_literal_pool() {
+  puts("Testing literal pool");
+  // cbz x0, #0x10; b #0xc; nop; nop; (callback point)
+  // Both branches target the callback point, so both far jumps share a single address, and the b makes the rest dead
+  static uint8_t to_hook[]{ 0x80, 0x00, 0x00, 0xb4, 0x03, 0x00, 0x00, 0x14, 0x1f, 0x20,
+                            0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6 };
+  {
+    TestWrapper init_hook(to_hook, "literal pool");
+    init_hook.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_CBZ, ARM64_REG_X0, (int64_t)&init_hook.data[4]);
+    init_hook.expect_ops<ARM64_OP_IMM>(ARM64_INS_B, (int64_t)&init_hook.data[4]);
+  }
+  auto results = perform_far_hook_test(to_hook);
+  {
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook literal pool");
+    auto const literal_address = round_up8(&results.fixup_inst_destination.addr[5]);
+    // cbz is inverted: cbnz x0, +0xC; ldr x17, DATA[0]; br x17
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_CBNZ, ARM64_REG_X0,
+                                                           (int64_t)&results.fixup_inst_destination.addr[3]);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, literal_address);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+    // b is a far jump, ldr x17, DATA[0]; br x17
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17, literal_address);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+    // Nothing reaches the nops or the callback after the b, so they are dropped
+    // Data validation
+    fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
+  }
+  // Count the literal loads against the distinct literals they load, to report what pooling saved
+  size_t loads = 0;
+  std::array<int64_t, 8> literals{};
+  size_t distinct = 0;
+  for (auto const& inst : results.fixup_inst_destination.addr.first(5)) {
+    auto const decoded = flamingo::arm64::Decode(inst, reinterpret_cast<int64_t>(&inst));
+    if (decoded.kind != flamingo::arm64::InstKind::kLdrLiteral) continue;
+    loads++;
+    if (std::find(literals.begin(), literals.begin() + distinct, decoded.target) == literals.begin() + distinct) {
+      literals[distinct++] = decoded.target;
+    }
+  }
+  if (loads != 2 || distinct != 1) {
+    ERROR("Expected 2 loads of 1 literal, got: {} loads of {} literals", loads, distinct);
+  }
+  fmt::println("Literal pool saved: {} bytes", (loads - distinct) * sizeof(uint64_t));
+}
+
+static decltype(auto) test_separate(std::span<uint32_t> target, int64_t min_data_distance, int64_t max_data_distance) {
+  constexpr size_t hookSizeNumInsts = 5;
+  constexpr size_t trampolineSize = 32;
+  auto near_data = alloc_near(target, trampolineSize);
+  // Data is placed within the provided distance of our fixups
+  auto data = alloc_within(near_data.fixups.data(), min_data_distance, max_data_distance);
+  flamingo::Fixups fixups{
+    .target = { flamingo::PointerWrapper<uint32_t>{
+      std::span(near_data.target.begin(), near_data.target.begin() + hookSizeNumInsts - 1),
+      flamingo::PageProtectionType::kExecute | flamingo::PageProtectionType::kRead |
+          flamingo::PageProtectionType::kWrite } },
+    .fixup_inst_destination = flamingo::PointerWrapper<uint32_t>(
+        near_data.fixups, flamingo::PageProtectionType::kExecute | flamingo::PageProtectionType::kRead |
+                              flamingo::PageProtectionType::kWrite),
+    .fixup_data_destination = flamingo::PointerWrapper<uint32_t>(data, flamingo::PageProtectionType::kRead),
+  };
+  fixups.CopyOriginalInsts();
+  fixups.PerformFixupsAndCallback();
+  print_decode_loop(fixups.fixup_inst_destination.addr.first(8));
+  return fixups;
+}
+
+static void test_separate_data() {
+  puts("Testing separate data");
+  // ldr x0, #8; ldr w1, #8; nop; ret; ret
+  // Both literals are within the instructions we overwrite, so they are snapshotted into data
+  static uint8_t to_hook[]{ 0x40, 0x00, 0x00, 0x58, 0x41, 0x00, 0x00, 0x18, 0x1f, 0x20,
+                            0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6, 0xc0, 0x03, 0x5f, 0xd6 };
+  std::span<uint32_t> hook_span(reinterpret_cast<uint32_t*>(&to_hook[0]), sizeof(to_hook) / sizeof(uint32_t));
+  constexpr uint64_t x0_literal = 0xd65f03c0d503201fULL;
+  {
+    // Data within LDR literal range is loaded directly
+    auto results = test_separate(hook_span, 0x10000, 0x80000);
+    auto const& data = results.fixup_data_destination.addr;
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near separate data");
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X0, (int64_t)&data[0]);
+    // The w1 literal is the upper half of the x0 literal, so it is pooled
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_W1, (int64_t)&data[1]);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_RET);
+    // Nothing can reach the callback after the ret, so it is dropped
+    if (data[0] != static_cast<uint32_t>(x0_literal) || data[1] != static_cast<uint32_t>(x0_literal >> 32)) {
+      ERROR("Mismatched separate data: {:#x} {:#x}", data[0], data[1]);
+    }
+  }
+  {
+    // Data out of LDR literal range is loaded with an ADRP + LDR
+    auto results = test_separate(hook_span, 0x1000000, 0x2000000);
+    auto const& data = results.fixup_data_destination.addr;
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far separate data");
+    auto const data_page = (int64_t)data.data() & ~0xfffLL;
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X0, data_page);
+    fixup_validator.expect_opc(ARM64_INS_LDR);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X1, data_page);
+    fixup_validator.expect_opc(ARM64_INS_LDR);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_RET);
+    // ldr x0, [x0, #0]; ldr w1, [x1, #4]
+    auto const& fixups = results.fixup_inst_destination.addr;
+    if (fixups[1] != 0xF9400000U || fixups[3] != 0xB9400421U) {
+      ERROR("Mismatched loads from data page: {:#x} {:#x}", fixups[1], fixups[3]);
+    }
+  }
+}
+
+static void test_separate_far_cond_branch() {
+  puts("Testing separate data far conditional branch");
+  // cbz x0, #-0x100000; nop; nop; nop; ret
+  static uint8_t to_hook[]{ 0x00, 0x00, 0x80, 0xb4, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20,
+                            0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6 };
+  std::span<uint32_t> hook_span(reinterpret_cast<uint32_t*>(&to_hook[0]), sizeof(to_hook) / sizeof(uint32_t));
+  constexpr size_t trampolineSize = 32;
+  auto fixup_ptr = flamingo::Allocate(16, trampolineSize * sizeof(uint32_t),
+                                      flamingo::PageProtectionType::kExecute | flamingo::PageProtectionType::kRead);
+  auto actual_target = alloc_far(fixup_ptr, hook_span);
+  // Data is out of LDR literal range, so the far jump the cbz is inverted over loads its destination with ADRP + LDR
+  auto data = alloc_within(fixup_ptr.addr.data(), 0x1000000, 0x2000000);
+  flamingo::Fixups fixups{
+    .target = { flamingo::PointerWrapper<uint32_t>{ std::span(actual_target.begin(), actual_target.begin() + 4),
+                                                    flamingo::PageProtectionType::kExecute |
+                                                        flamingo::PageProtectionType::kRead } },
+    .fixup_inst_destination = fixup_ptr,
+    .fixup_data_destination = flamingo::PointerWrapper<uint32_t>(data, flamingo::PageProtectionType::kRead),
+  };
+  fixups.CopyOriginalInsts();
+  fixups.PerformFixupsAndCallback();
+  print_decode_loop(fixups.fixup_inst_destination.addr.first(12));
+  auto const data_page = (int64_t)data.data() & ~0xfffLL;
+  TestWrapper fixup_validator(fixups.fixup_inst_destination.addr, "Separate data far conditional branch");
+  // cbnz x0, +0x10 skips over all three instructions of the jump
+  fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_CBNZ, ARM64_REG_X0,
+                                                         (int64_t)&fixups.fixup_inst_destination.addr[4]);
+  fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X17, data_page);
+  fixup_validator.expect_opc(ARM64_INS_LDR);
+  fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+  fixup_validator.expect_opc(ARM64_INS_NOP);
+  fixup_validator.expect_opc(ARM64_INS_NOP);
+  fixup_validator.expect_opc(ARM64_INS_NOP);
+  // Callback
+  fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X17, data_page);
+  fixup_validator.expect_opc(ARM64_INS_LDR);
+  fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+  if (data[0] != static_cast<uint32_t>((int64_t)actual_target.data() - 0x100000) ||
+      data[2] != static_cast<uint32_t>(reinterpret_cast<uint64_t>(&actual_target[4]))) {
+    ERROR("Mismatched separate data: {:#x} {:#x}", data[0], data[2]);
+  }
+  // Nothing is in range of the fixups, so relaxation must have arrived at exactly the sizing pass's layout
+  auto const size = flamingo::Fixups::SizeFor(fixups.target.addr, true);
+  if (size.code != 10 * sizeof(uint32_t) || size.data != 4 * sizeof(uint32_t)) {
+    ERROR("Mismatched fixup size, expected: {} code bytes and: {} data bytes, got: {} and: {}", 10 * sizeof(uint32_t),
+          4 * sizeof(uint32_t), size.code, size.data);
+  }
+}
+
+static void test_peephole() {
+  puts("Testing peephole");
+  auto const expect_stats = [](flamingo::Fixups const& fixups, flamingo::PeepholeStats expected) {
+    auto const& stats = fixups.peephole_stats;
+    if (stats.removed_insts != expected.removed_insts || stats.threaded_branches != expected.threaded_branches ||
+        stats.saved_bytes != expected.saved_bytes) {
+      ERROR("Mismatched peephole stats, expected: {} removed, {} threaded, {} bytes saved, got: {}, {}, {}",
+            expected.removed_insts, expected.threaded_branches, expected.saved_bytes, stats.removed_insts,
+            stats.threaded_branches, stats.saved_bytes);
+    }
+  };
+  {
+    // cbz x0, #0x8; ret; b #0x4; b #0x14
+    // The cbz is threaded past the first b, which leaves it dead, and the callback after the last b is dead too
+    static uint8_t to_hook[]{ 0x40, 0x00, 0x00, 0xb4, 0xc0, 0x03, 0x5f, 0xd6, 0x01, 0x00,
+                              0x00, 0x14, 0x05, 0x00, 0x00, 0x14, 0xc0, 0x03, 0x5f, 0xd6 };
+    {
+      auto results = perform_near_hook_test(to_hook);
+      TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook threaded cbz");
+      fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_CBZ, ARM64_REG_X0,
+                                                             (int64_t)&results.fixup_inst_destination.addr[2]);
+      fixup_validator.expect_opc(ARM64_INS_RET);
+      fixup_validator.expect_b(&results.target.addr[8]);
+      expect_stats(results, { .removed_insts = 2, .threaded_branches = 1, .saved_bytes = 8 });
+    }
+    {
+      auto results = perform_far_hook_test(to_hook);
+      TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook threaded cbz");
+      fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_CBZ, ARM64_REG_X0,
+                                                             (int64_t)&results.fixup_inst_destination.addr[2]);
+      fixup_validator.expect_opc(ARM64_INS_RET);
+      fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
+                                                             round_up8(&results.fixup_inst_destination.addr[4]));
+      fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+      // Only the literal for the last b is left, the callback's is dropped along with it
+      fixup_validator.expect_big_data((uint64_t)&results.target.addr[8]);
+      // The dropped far callback was an ldr + br
+      expect_stats(results, { .removed_insts = 3, .threaded_branches = 1, .saved_bytes = 24 });
+    }
+  }
+  {
+    // b #0x8; nop; b #0x10; nop
+    // The first b is threaded straight out of the fixups, and nothing else is reachable
+    static uint8_t to_hook[]{ 0x02, 0x00, 0x00, 0x14, 0x1f, 0x20, 0x03, 0xd5, 0x04, 0x00,
+                              0x00, 0x14, 0x1f, 0x20, 0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6 };
+    auto results = perform_near_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook threaded b");
+    fixup_validator.expect_b(&results.target.addr[6]);
+    expect_stats(results, { .removed_insts = 4, .threaded_branches = 1, .saved_bytes = 16 });
+  }
+  {
+    // b #0; nop; nop; nop
+    // A loop is left alone, but nothing after it is reachable
+    static uint8_t to_hook[]{ 0x00, 0x00, 0x00, 0x14, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20,
+                              0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6 };
+    auto results = perform_near_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook loop");
+    fixup_validator.expect_b(&results.fixup_inst_destination.addr[0]);
+    expect_stats(results, { .removed_insts = 4, .threaded_branches = 0, .saved_bytes = 16 });
+  }
+  {
+    // mov x0, x1; ret; nop; nop
+    // Without any PC-relative instructions the target is copied, but only up to the ret
+    static uint8_t to_hook[]{ 0xe0, 0x03, 0x01, 0xaa, 0xc0, 0x03, 0x5f, 0xd6, 0x1f, 0x20,
+                              0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0xc0, 0x03, 0x5f, 0xd6 };
+    auto results = perform_far_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook copy up to ret");
+    fixup_validator.expect_opc(ARM64_INS_MOV);
+    fixup_validator.expect_opc(ARM64_INS_RET);
+    // Both nops and the far callback (ldr + br, and its literal) are dropped
+    expect_stats(results, { .removed_insts = 4, .threaded_branches = 0, .saved_bytes = 24 });
+  }
+}
+
+static void test_adrp_encoding() {
+  puts("Testing adrp encoding");
+  struct Case {
+    char const* name;
+    int64_t pc;
+    int64_t target;
+  };
+  static constexpr std::array<Case, 6> cases{ {
+    { "positive", 0x7000001234, 0x7012345678 },
+    { "negative", 0x7012345678, 0x7000001234 },
+    { "next page", 0x7000000FFC, 0x7000001000 },
+    { "previous page", 0x7000001000, 0x7000000FFC },
+    { "maximum", 0x7000000010, 0x7000000000 + 0xFFFFF000 },
+    { "minimum", 0x7100000010, 0x7100000000 - 0x100000000 },
+  } };
+  auto handle = flamingo::getHandle();
+  for (auto const& c : cases) {
+    auto const expected = c.target & ~0xfffLL;
+    if (!flamingo::arm64::AdrpInRange(c.pc, c.target)) {
+      ERROR("ADRP {}: {:#x} should be in range of: {:#x}", c.name, c.target, c.pc);
+    }
+    uint32_t const inst = flamingo::arm64::EncodeAdrp(9, c.pc, c.target);
+    auto const decoded = flamingo::arm64::Decode(inst, c.pc);
+    if (decoded.kind != flamingo::arm64::InstKind::kAdrp || decoded.reg != 9 || decoded.target != expected) {
+      ERROR("ADRP {}: Mismatched decode of: {:#x}\n Expected: {:#x}\n Got: {:#x}", c.name, inst, expected,
+            decoded.target);
+    }
+    // Capstone must agree with our decoding
+    cs_insn* insn = nullptr;
+    auto count = cs_disasm(handle, reinterpret_cast<uint8_t const*>(&inst), sizeof(inst), static_cast<uint64_t>(c.pc),
+                           1, &insn);
+    if (count != 1 || insn->id != ARM64_INS_ADRP || insn->detail->arm64.operands[1].imm != expected) {
+      ERROR("ADRP {}: Capstone disagrees on: {:#x}, expected: {:#x}", c.name, inst, expected);
+    }
+    cs_free(insn, count);
+  }
+  // One page past the maximum must fall back
+  if (flamingo::arm64::AdrpInRange(0x7000000010, 0x7000000000 + 0x100000000)) {
+    ERROR("ADRP {:#x} should be out of range of: {:#x}", 0x7100000000, 0x7000000010);
   }
+  puts("---Passed test: adrp encoding");
 }
 
 static void test_adrp() {
@@ -247,35 +892,28 @@ static void test_adrp() {
   {
     auto results = perform_near_hook_test(to_hook);
     TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook adrp");
-    // ADRP is replaced with an ldr to load the data directly
-    // LDR x9, DATA[0]
-    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X9,
-                                                           round_up8(&results.fixup_inst_destination.addr[5]));
+    // ADRP is re-encoded relative to the fixup's page
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X9,
+                                                           (int64_t)(results.target.addr.data()) & ~0xfff);
     fixup_validator.expect_opc(ARM64_INS_MOV);
     fixup_validator.expect_opc(ARM64_INS_STR);
     fixup_validator.expect_opc(ARM64_INS_STR);
     // Callback
     fixup_validator.expect_b(&results.target.addr[4]);
-    // Data validation
-    // ADRP result must match
-    fixup_validator.expect_big_data((int64_t)(results.target.addr.data()) & ~0xfff);
   }
   {
     auto results = perform_far_hook_test(to_hook);
     TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook adrp");
-    // ADRP is replaced with an ldr to load the data directly
-    // LDR x9, DATA[0]
-    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X9,
-                                                           round_up8(&results.fixup_inst_destination.addr[6]));
+    // Out of range of a B, but still well within the +-4GB of an ADRP
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X9,
+                                                           (int64_t)(results.target.addr.data()) & ~0xfff);
     fixup_validator.expect_opc(ARM64_INS_MOV);
     fixup_validator.expect_opc(ARM64_INS_STR);
     fixup_validator.expect_opc(ARM64_INS_STR);
-    // Callback (ldr x17, DATA[1]; br x17)
+    // Callback (ldr x17, DATA[0]; br x17)
     fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
-                                                           round_up8(&results.fixup_inst_destination.addr[8]));
+                                                           round_up8(&results.fixup_inst_destination.addr[6]));
     fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
-    // ADRP result must match
-    fixup_validator.expect_big_data((int64_t)(results.target.addr.data()) & ~0xfff);
     // Check callback point is valid
     fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
   }
@@ -300,57 +938,177 @@ static void test_neg_adrp() {
     fixup_validator.expect_opc(ARM64_INS_CMP);
     // B is a near branch in this case
     fixup_validator.expect_opc(ARM64_INS_B);
-    // ADRP is replaced with an ldr to load the data directly
-    // LDR x8, DATA[0]
-    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X8,
-                                                           round_up8(&results.fixup_inst_destination.addr[6]));
+    // ADRP is re-encoded relative to the fixup's page
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X8,
+                                                           ((int64_t)(results.target.addr.data()) - 0x14E8000) & ~0xfff);
     fixup_validator.expect_opc(ARM64_INS_ADD);
     // Callback
     fixup_validator.expect_b(&results.target.addr[4]);
-    // Data validation
-    // ADRP result must match
-    fixup_validator.expect_big_data(((int64_t)(results.target.addr.data()) - 0x14E8000) & ~0xfff);
   }
   {
     auto results = perform_far_hook_test(to_hook);
     TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook negative adrp");
     fixup_validator.expect_opc(ARM64_INS_CMP);
-    // b.hi past following b to ldr + br pair
-    fixup_validator.expect_b(&results.fixup_inst_destination.addr[3]);
-    // b over ldr + br pair
-    fixup_validator.expect_b(&results.fixup_inst_destination.addr[5]);
+    // b.hi is inverted into a b.ls over the following ldr + br pair
+    fixup_validator.expect_b(&results.fixup_inst_destination.addr[4]);
     // LDR x17, DATA[0]
     fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
-                                                           round_up8(&results.fixup_inst_destination.addr[10]));
+                                                           round_up8(&results.fixup_inst_destination.addr[8]));
     fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
-    // ADRP is replaced with an ldr to load the data directly
-    // LDR x9, DATA[1]
-    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X8,
-                                                           round_up8(&results.fixup_inst_destination.addr[12]));
+    // ADRP is re-encoded relative to the fixup's page
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X8,
+                                                           ((int64_t)(results.target.addr.data()) - 0x14E8000) & ~0xfff);
     fixup_validator.expect_opc(ARM64_INS_ADD);
     // Callback
     fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
-                                                           round_up8(&results.fixup_inst_destination.addr[14]));
+                                                           round_up8(&results.fixup_inst_destination.addr[10]));
     fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
     // Data validation
     // B.hi destination should match
     fixup_validator.expect_big_data((uint64_t)&results.target.addr[6]);
-    // ADRP result must match
-    fixup_validator.expect_big_data(((int64_t)(results.target.addr.data()) - 0x14E8000) & ~0xfff);
     // Check callback point is valid
     fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
   }
 }
 
-// TODO: Test a case where we have a loop in the first 4 instructions
-// TODO: Test a case where we have an ldr literal that loads from within fixup range
-// TODO: Test a case with a negative adrp offset
+static void test_adrp_fusion() {
+  puts("Testing adrp fusion");
+  // Pairs where the second instruction consumes the page in the same register fuse, anything else does not
+  struct Case {
+    uint32_t inst;
+    uint8_t reg;
+    std::optional<flamingo::arm64::PageOffsetUse> use;
+  };
+  static constexpr std::array<Case, 6> cases{ {
+    { 0x91004000U, 0, flamingo::arm64::PageOffsetUse{ 0x10, 0 } },            // add x0, x0, #0x10
+    { 0xF9400C21U, 1, flamingo::arm64::PageOffsetUse{ 0x18, 0x58000001U } },  // ldr x1, [x1, #0x18]
+    { 0xB9800442U, 2, flamingo::arm64::PageOffsetUse{ 0x4, 0x98000002U } },   // ldrsw x2, [x2, #4]
+    { 0x91004001U, 0, std::nullopt },                                         // add x1, x0, #0x10
+    { 0xF9400C20U, 1, std::nullopt },                                         // ldr x0, [x1, #0x18]
+    { 0xB9000C21U, 1, std::nullopt },                                         // str w1, [x1, #0xc]
+  } };
+  for (auto const& c : cases) {
+    auto const use = flamingo::arm64::DecodePageOffsetUse(c.inst, c.reg);
+    if (use.has_value() != c.use.has_value() ||
+        (use.has_value() && (use->offset != c.use->offset || use->literal_load != c.use->literal_load))) {
+      ERROR("Mismatched page offset use for: {:#x}", c.inst);
+    }
+  }
+  // adrp x0, #0; add x0, x0, #0x10; adrp x1, #0; ldr x1, [x1, #0x18]; ret
+  static uint8_t to_hook[]{ 0x00, 0x00, 0x00, 0x90, 0x00, 0x40, 0x00, 0x91, 0x01, 0x00,
+                            0x00, 0x90, 0x21, 0x0c, 0x40, 0xf9, 0xc0, 0x03, 0x5f, 0xd6 };
+  {
+    auto results = perform_near_hook_test(to_hook);
+    // The target is page aligned, so the pairs reference its 4th and 6th instructions
+    auto const page = (int64_t)(results.target.addr.data()) & ~0xfff;
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Near hook adrp fusion");
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADR, ARM64_REG_X0, page + 0x10);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X1, page + 0x18);
+    // Callback
+    fixup_validator.expect_b(&results.target.addr[4]);
+  }
+  {
+    auto results = perform_far_hook_test(to_hook);
+    auto const page = (int64_t)(results.target.addr.data()) & ~0xfff;
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook adrp fusion");
+    // Out of range of an ADR or LDR literal, but the pairs themselves are still in range
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X0, page);
+    fixup_validator.expect_opc(ARM64_INS_ADD);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_ADRP, ARM64_REG_X1, page);
+    fixup_validator.expect_opc(ARM64_INS_LDR);
+    // Callback (ldr x17, DATA[0]; br x17)
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X17,
+                                                           round_up8(&results.fixup_inst_destination.addr[6]));
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X17);
+    fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
+  }
+  // Out of range of the pairs too, the add becomes a load of the address, and the ldr a load through it
+  auto const size = flamingo::Fixups::SizeFor(std::span<uint32_t const>(reinterpret_cast<uint32_t const*>(to_hook), 4),
+                                              false);
+  // Then the callback, a word of padding and three 64b literals
+  constexpr size_t code_words = 1 + 2 + 2;
+  constexpr size_t data_words = 1 + 3 * 2;
+  if (size.code != (code_words + data_words) * sizeof(uint32_t)) {
+    ERROR("Mismatched fixup size, expected: {} bytes, got: {}", (code_words + data_words) * sizeof(uint32_t),
+          size.code);
+  }
+}
+
+static void test_scratch_register() {
+  puts("Testing scratch register");
+  static constexpr uint32_t read_x17 = 0x91000620U;  // add x0, x17, #1
+  static constexpr uint32_t mov_x17 = 0xD2800011U;   // mov x17, #0
+  static constexpr uint32_t nop = 0xD503201FU;
+  struct Case {
+    std::array<uint32_t, 3> insts;
+    uint8_t reg;
+    bool dead;
+  };
+  static constexpr std::array<Case, 9> cases{ {
+    { { mov_x17, read_x17, nop }, 17, true },
+    { { nop, read_x17, mov_x17 }, 17, false },
+    { { 0x94000002U, nop, nop }, 17, true },            // bl #8 clobbers every temporary
+    { { 0x94000002U, nop, nop }, 19, false },           // but not the callee saved registers
+    { { 0xD65F03C0U, nop, nop }, 16, true },            // ret
+    { { 0xB4000040U, read_x17, mov_x17 }, 17, false },  // cbz x0, #8, falling through to a read
+    { { 0xB4000040U, nop, mov_x17 }, 17, true },        // cbz x0, #8, with both paths to a write
+    { { 0x14000000U, nop, nop }, 17, false },           // b . may loop forever
+    { { 0xAA0003F1U, 0xAA1103E0U, nop }, 17, true },    // mov x17, x0; mov x0, x17
+  } };
+  for (auto const& c : cases) {
+    if (flamingo::arm64::IsDeadAt(c.insts, 0x1000, c.reg) != c.dead) {
+      ERROR("Mismatched liveness of x{} at: {:#x}", c.reg, c.insts[0]);
+    }
+  }
+  // ldr q3, #0x20; nop; nop; nop; add x0, x17, #1; mov x16, #0; ret; nop; (data...)
+  // x17 is read after the target, but x16 is dead, so the fixups borrow it rather than spill x17 or clobber it.
+  static uint8_t to_hook[]{ 0x03, 0x01, 0x00, 0x9c, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20, 0x03, 0xd5, 0x1f, 0x20,
+                            0x03, 0xd5, 0x20, 0x06, 0x00, 0x91, 0x10, 0x00, 0x80, 0xd2, 0xc0, 0x03, 0x5f, 0xd6,
+                            0x1f, 0x20, 0x03, 0xd5, 0x00, 0x00, 0x80, 0x3f, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00,
+                            0x40, 0x40, 0x00, 0x00, 0x80, 0x40 };
+  {
+    auto results = perform_far_hook_test(to_hook, 7);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook scratch register");
+    auto const literal_address = round_up8(&results.fixup_inst_destination.addr[7]);
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X16, literal_address);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_LDR, ARM64_REG_Q3);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    fixup_validator.expect_opc(ARM64_INS_NOP);
+    // Callback (ldr x16, DATA[1]; br x16)
+    fixup_validator.expect_ops<ARM64_OP_REG, ARM64_OP_IMM>(ARM64_INS_LDR, ARM64_REG_X16, literal_address + 8);
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_BR, ARM64_REG_X16);
+    fixup_validator.expect_big_data((uint64_t)&results.target.addr[8]);
+    fixup_validator.expect_big_data(reinterpret_cast<uint64_t>(&results.target.addr[4]));
+  }
+  {
+    // Without knowing what follows the target, x17 is spilled and clobbered as before
+    auto results = perform_far_hook_test(to_hook);
+    TestWrapper fixup_validator(results.fixup_inst_destination.addr, "Far hook unknown scratch register");
+    fixup_validator.expect_ops<ARM64_OP_REG>(ARM64_INS_STR, ARM64_REG_X17);
+  }
+}
 
 int main() {
+  test_decoder();
+  test_function_analysis();
   test_no_fixups();
+  test_bcond_within_hook();
   test_bls_tbzs_within_hook();
   test_ldr_ldrb_tbnz_bl();
+  test_cond_branch_inversion();
+  test_ldr_literal();
+  test_ldrsw_literal();
+  test_simd_literal();
+  test_prfm_literal();
+  test_literal_pool();
+  test_separate_data();
+  test_separate_far_cond_branch();
+  test_peephole();
+  test_adrp_encoding();
   test_adrp();
   test_neg_adrp();
+  test_adrp_fusion();
+  test_scratch_register();
   puts("ALL GOOD!");
 }
@@ -116,6 +116,14 @@ struct TestWrapper {
     }
     cs_free(inst, 1);
   }
+  // Expects a B and returns its destination, used for following near hooks to their stubs
+  uint32_t const* expect_b_any() {
+    auto inst = get_next();
+    expect_inst_opc(inst, ARM64_INS_B);
+    auto const* destination = reinterpret_cast<uint32_t const*>(inst->detail->arm64.operands[0].imm);
+    cs_free(inst, 1);
+    return destination;
+  }
   template <arm64_op_type OpType, class T>
   static bool compare_op(cs_arm64_op const& op, T value) {
     if (op.type != OpType) return false;
@@ -210,6 +218,29 @@ inline auto alloc_far(flamingo::PointerWrapper<uint32_t> target_fixups, std::spa
         fmt::ptr(target_fixups.addr.data()));
 }
 
+/// @brief Maps a read only page that is at least min_distance and less than max_distance bytes away from from.
+inline auto alloc_within(void const* from, int64_t min_distance, int64_t max_distance) {
+  constexpr auto kPageCount = 64;
+  auto const page_mask = ~((int64_t)PAGE_SIZE - 1);
+  for (int i = 0; i < kPageCount; i++) {
+    // Alternate between hinting after and before from
+    auto const offset = min_distance + (int64_t)(i / 2) * PAGE_SIZE + PAGE_SIZE;
+    auto const hint = ((int64_t)from + (i % 2 == 0 ? offset : -offset)) & page_mask;
+    auto result = mmap((void*)hint, PAGE_SIZE, PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (result == MAP_FAILED) {
+      perror(strerror(errno));
+      break;
+    }
+    auto const distance = std::llabs((int64_t)result - (int64_t)from);
+    if (distance >= min_distance && distance < max_distance) {
+      return std::span<uint32_t>((uint32_t*)result, (uint32_t*)result + PAGE_SIZE / sizeof(uint32_t));
+    }
+    munmap(result, PAGE_SIZE);
+  }
+  ERROR("Could not find any pages (tried: {}) between: {} and: {} bytes away from: {}", kPageCount, min_distance,
+        max_distance, fmt::ptr(from));
+}
+
 inline void print_decode_loop(std::span<uint32_t const> data) {
   auto handle = flamingo::getHandle();
   for (size_t i = 0; i < data.size(); i++) {